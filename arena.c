@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include "arena.h"
+#include "util.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bytes per block, records and strings are packed back to back
+#define ARENA_BLOCK (1 << 20)
+// strings remembered for interning, later ones are only copied. the ones
+// worth sharing (ports, common credentials, gateway hosts) show up early
+#define ARENA_INTERN_MAX (1 << 16)
+
+typedef struct arena_block {
+    struct arena_block *next;
+    _Alignas(max_align_t) unsigned char data[];
+} arena_block;
+
+struct arena {
+    atomic_size_t refs;
+    arena_block *blocks;           // the first one is being filled
+    size_t used, size;
+    const char **interned;         // open addressing, NULL marks a free slot
+    size_t ninterned, nslots;
+};
+
+static void *arena_take(arena *a, size_t sz, size_t align);
+static void intern_add(arena *a, const char *s, size_t len);
+static uint32_t hash(const char *s, size_t len);
+
+arena *arena_new(void)
+{
+    arena *a = calloc(1, sizeof(*a));
+    if (a == NULL) die("calloc:");
+    atomic_init(&a->refs, 1);
+    return a;
+}
+
+// zeroed memory, aligned for any record
+void *arena_alloc(arena *a, size_t sz)
+{
+    return arena_take(a, sz, _Alignof(max_align_t));
+}
+
+// a nul terminated copy of s, shared with earlier copies of the same string
+const char *arena_intern(arena *a, const char *s, size_t len)
+{
+    size_t mask = a->nslots - 1;
+    for (size_t i = hash(s, len) & mask; a->nslots && a->interned[i]; i = (i + 1) & mask)
+        if (strncmp(a->interned[i], s, len) == 0 && a->interned[i][len] == 0)
+            return a->interned[i];
+
+    char *copy = arena_take(a, len + 1, 1);
+    memcpy(copy, s, len);
+    if (a->ninterned < ARENA_INTERN_MAX)
+        intern_add(a, copy, len);
+    return copy;
+}
+
+// drops the intern table once nothing else will be added
+void arena_seal(arena *a)
+{
+    free(a->interned);
+    a->interned = NULL;
+    a->ninterned = a->nslots = 0;
+}
+
+void arena_hold(arena *a, size_t n)
+{
+    atomic_fetch_add_explicit(&a->refs, n, memory_order_relaxed);
+}
+
+void arena_release(arena *a)
+{
+    if (atomic_fetch_sub_explicit(&a->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    for (arena_block *b = a->blocks, *next; b && (next = b->next, 1); b = next)
+        free(b);
+    free(a->interned);
+    free(a);
+}
+
+// what doesn't fit the current block starts a new one, the tail is wasted
+static void *arena_take(arena *a, size_t sz, size_t align)
+{
+    size_t off = (a->used + align - 1) & ~(align - 1);
+
+    if (a->blocks == NULL || off + sz > a->size) {
+        size_t size = sz > ARENA_BLOCK ? sz : ARENA_BLOCK;
+        arena_block *b = calloc(1, sizeof(*b) + size);
+        if (b == NULL) die("calloc:");
+        b->next = a->blocks;
+        a->blocks = b;
+        a->size = size;
+        off = 0;
+    }
+
+    a->used = off + sz;
+    return a->blocks->data + off;
+}
+
+static void intern_add(arena *a, const char *s, size_t len)
+{
+    if ((a->ninterned + 1) * 2 > a->nslots) {
+        size_t nslots = a->nslots ? a->nslots * 2 : 256;
+        const char **slots = calloc(nslots, sizeof(*slots));
+        if (slots == NULL) die("calloc:");
+
+        for (size_t i = 0; i < a->nslots; i++) {
+            if (a->interned[i] == NULL) continue;
+            size_t j = hash(a->interned[i], strlen(a->interned[i])) & (nslots - 1);
+            while (slots[j]) j = (j + 1) & (nslots - 1);
+            slots[j] = a->interned[i];
+        }
+
+        free(a->interned);
+        a->interned = slots;
+        a->nslots = nslots;
+    }
+
+    size_t i = hash(s, len) & (a->nslots - 1);
+    while (a->interned[i]) i = (i + 1) & (a->nslots - 1);
+    a->interned[i] = s;
+    a->ninterned++;
+}
+
+// fnv-1a
+static uint32_t hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
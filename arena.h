@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+
+// bump allocator for records that are freed all at once. only the thread
+// filling it allocates, any thread may drop references
+typedef struct arena arena;
+
+arena *arena_new(void);
+void *arena_alloc(arena *a, size_t sz);
+const char *arena_intern(arena *a, const char *s, size_t len);
+void arena_seal(arena *a);
+void arena_hold(arena *a, size_t n);
+void arena_release(arena *a);
@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+# runs every benchmark scenario over loopback and prints one json line each.
+# tune with BENCH_DURATION, BENCH_THREADS, BENCH_WORKERS, BENCH_TUNNELS and
+# BENCH_PORT (the first of the 20 ports used, upstreams sit right above it
+# and proxyrot instances from 11 on)
+set -e
+cd "$(dirname "$0")"
+
+duration=${BENCH_DURATION:-5}
+threads=${BENCH_THREADS:-$(nproc)}
+workers=${BENCH_WORKERS:-$(nproc)}
+tunnels=${BENCH_TUNNELS:-2000}
+base=${BENCH_PORT:-21000}
+port=$((base + 10))
+
+ulimit -n 65536 2>/dev/null || ulimit -n "$(ulimit -Hn)"
+
+tmp=$(mktemp -d)
+pids=()
+trap 'kill "${pids[@]}" 2>/dev/null; wait 2>/dev/null; rm -rf "$tmp"' EXIT
+
+# waits until something listens on port $1
+wait_port() {
+    for _ in $(seq 100); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+        sleep 0.05
+    done
+    echo "nothing listening on port $1" >&2
+    return 1
+}
+
+# fakeup PORT [ARGS...]
+fakeup() {
+    ./fakeup -p "$@" &
+    pids+=($!)
+    wait_port "$1"
+}
+
+# scenario NAME LIST "PROXYROT ARGS" LOAD ARGS...
+scenario() {
+    local name=$1 list=$2 args=$3
+    shift 3
+    port=$((port + 1))
+
+    # shellcheck disable=SC2086
+    ../proxyrot -p "$port" -P "$list" -w "$workers" -L error $args > /dev/null &
+    local pid=$!
+    wait_port "$port"
+    ./load -x "127.0.0.1:$port" -P "$pid" -s "$name" -t "$threads" "$@" || true
+    kill -INT "$pid"
+    wait "$pid" 2>/dev/null || true
+}
+
+fakeup $((base + 1)) -t 2
+fakeup $((base + 2)) -t 2 -u bench:bench
+fakeup $((base + 3)) -t 2 -f 0.2
+fakeup $((base + 4)) -l 5
+fakeup $((base + 5)) -l 5
+fakeup $((base + 6)) -l 5
+
+# load asks for "sink", a name only fakeup knows, so the exit hops resolve it
+echo "socks5h 127.0.0.1 $((base + 1))" > "$tmp/plain"
+echo "socks5h 127.0.0.1 $((base + 2)) bench bench" > "$tmp/auth"
+echo "socks5 127.0.0.1 $((base + 3)) | socks5h 127.0.0.1 $((base + 1))" > "$tmp/flaky"
+echo "socks5 127.0.0.1 $((base + 4)) | socks5 127.0.0.1 $((base + 5)) | socks5h 127.0.0.1 $((base + 6))" > "$tmp/chain"
+echo "socks5h 127.0.0.1 $((base + 1)) pool=bench" > "$tmp/pooled"
+# attempts through the flaky chain are still racing when the next launch
+# finds a warm connection through the plain entry
+cat "$tmp/flaky" "$tmp/plain" > "$tmp/racy"
+
+# 200k logins bound to a pool, load logs in as one from the middle
+digest=$(printf '%s' benchx | sha256sum | cut -d' ' -f1)
+awk -v d="$digest" 'BEGIN { for (i = 0; i < 200000; i++) printf "user%d sha256$bench$%s pool=bench\n", i, d }' > "$tmp/users"
+
+scenario storm        "$tmp/plain" "-n"          -m storm -c 256 -d "$duration"
+scenario storm_auth   "$tmp/auth"  "-u bench:x"  -m storm -c 256 -d "$duration" -u bench:x
+scenario storm_users  "$tmp/pooled" "-C $tmp/users" -m storm -c 256 -d "$duration" -u user100000:x
+scenario storm_retry  "$tmp/flaky" "-n -r"       -m storm -c 256 -d "$duration"
+scenario storm_race_warm "$tmp/racy" "-n -r -k 2:1 -W 1:4" -m storm -c 256 -d "$duration"
+scenario storm_uring  "$tmp/plain" "-n -U"       -m storm -c 256 -d "$duration"
+scenario chain_3hop   "$tmp/chain" "-n"          -m storm -c 64  -d "$duration"
+scenario chain_3hop_pipelined "$tmp/chain" "-n -O" -m storm -c 64 -d "$duration"
+scenario bulk         "$tmp/plain" "-n"          -m bulk  -c 8 -b $((256 << 20)) -d "$duration"
+scenario bulk_splice  "$tmp/plain" "-n -s"       -m bulk  -c 8 -b $((256 << 20)) -d "$duration"
+scenario bulk_uring   "$tmp/plain" "-n -U"       -m bulk  -c 8 -b $((256 << 20)) -d "$duration"
+scenario udp          "$tmp/plain" "-n"          -m udp   -c 16 -d "$duration"
+scenario udp_gso      "$tmp/plain" "-n"          -m udp   -c 16 -d "$duration" -G
+scenario udp_uring    "$tmp/plain" "-n -U"       -m udp   -c 16 -d "$duration"
+scenario idle         "$tmp/plain" "-n"          -m idle  -n "$tunnels" -d 30
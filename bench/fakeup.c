@@ -0,0 +1,642 @@
+// stand-in SOCKS5 upstream for benchmarks. CONNECTs to the domain "sink"
+// are answered locally: the client sends a 64 bit big endian byte count,
+// gets that many bytes back and whatever else it sends is discarded. any
+// other target is dialed and relayed, so instances can be chained. UDP
+// ASSOCIATEs are pointed at the UDP port of the same number, which sends
+// every datagram back as it came, as if its destination answered
+#define _GNU_SOURCE
+#include "../util.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define RELAY_BUFSZ 65536
+#define MAX_EVENTS 256
+// datagrams, or GRO trains of them, echoed per call
+#define ECHO_BATCH 32
+
+#define S_GREETING  0
+#define S_AUTH      1
+#define S_REQUEST   2
+#define S_DIALING   3
+#define S_DELAY     4  // reply held back to simulate latency
+#define S_REPLY     5
+#define S_COUNT     6  // sink: reading the byte count
+#define S_SINK      7
+#define S_RELAY     8
+#define S_CLOSE     9  // close once the reply is out
+#define S_ASSOC    10  // UDP association, held until the client hangs up
+#define S_DEAD     11  // freed after the current batch of events
+
+typedef struct conn conn;
+
+typedef struct endpoint {
+    int fd;
+    uint32_t events;
+    bool added;
+    conn *c;
+} endpoint;
+
+typedef struct relay_buf {
+    unsigned char *data;
+    size_t off, len;
+} relay_buf;
+
+struct conn {
+    endpoint cli, up;
+    int state, next;                // next: state after the reply is sent
+    size_t len, off;
+    unsigned char buf[600];
+    unsigned long long left;        // sink: bytes still to send
+    relay_buf rb[2];                // [0] client -> up, [1] up -> client
+    long long heard;                // when the request being answered came in, 0 for now
+    long long due;
+    conn *tnext;
+};
+
+typedef struct loop {
+    int epfd, listenfd, udpfd;
+    conn *delayed, *delayed_tail;   // FIFO, sorted by due
+    conn *dead;
+    unsigned int seed;
+} loop;
+
+static int port = 1080;
+static int nthreads = 1;
+static int latency;                 // ms between a request and its reply
+static double fail_rate;
+static char *user, *pass;
+static const unsigned char zeros[RELAY_BUFSZ];
+
+static void *loop_run(void *arg);
+static void loop_accept(loop *l);
+static void nodelay(int fd);
+static void loop_expire(loop *l);
+static void conn_close(loop *l, conn *c);
+static void conn_watch(loop *l, endpoint *e, uint32_t events);
+static void conn_reply(loop *l, conn *c, size_t len, int next);
+static void conn_step(loop *l, conn *c);
+static void conn_request(loop *l, conn *c);
+static void conn_dialed(loop *l, conn *c);
+static void conn_sink(loop *l, conn *c, uint32_t events);
+static void conn_relay(loop *l, conn *c);
+static void loop_echo(loop *l);
+static int relay_dir(relay_buf *b, int from, int to);
+static void usage(const char *name);
+
+int main(int argc, char **argv)
+{
+    int opt;
+    struct option long_options[] = {
+        {"help"    , no_argument      , NULL, 'h'},
+        {"port"    , required_argument, NULL, 'p'},
+        {"threads" , required_argument, NULL, 't'},
+        {"latency" , required_argument, NULL, 'l'},
+        {"fail"    , required_argument, NULL, 'f'},
+        {"userpass", required_argument, NULL, 'u'},
+        {NULL      , 0                , NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hp:t:l:f:u:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'l': latency = atoi(optarg); break;
+        case 'f': fail_rate = atof(optarg); break;
+        case 'u':
+            user = optarg;
+            pass = strchr(optarg, ':');
+            if (pass) *pass++ = 0;
+            else pass = "";
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (nthreads < 1) die("invalid thread count");
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t *threads = emalloc(sizeof(pthread_t[nthreads]));
+    for (int i = 0; i < nthreads; i++) {
+        loop *l = calloc(1, sizeof(*l));
+        if (l == NULL) die("calloc:");
+        l->seed = i + 1;
+
+        l->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (l->listenfd == -1) die("socket:");
+        int one = 1;
+        setsockopt(l->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(l->listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port)};
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(l->listenfd, (struct sockaddr *)&sa, sizeof(sa)) != 0) die("bind:");
+        if (listen(l->listenfd, 4096) != 0) die("listen:");
+
+        l->udpfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (l->udpfd == -1) die("socket:");
+        setsockopt(l->udpfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        setsockopt(l->udpfd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+        if (bind(l->udpfd, (struct sockaddr *)&sa, sizeof(sa)) != 0) die("bind:");
+
+        l->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (l->epfd == -1) die("epoll_create1:");
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->listenfd, &ev) != 0) die("epoll_ctl:");
+        ev.data.ptr = &l->udpfd;
+        if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->udpfd, &ev) != 0) die("epoll_ctl:");
+
+        if (pthread_create(&threads[i], NULL, &loop_run, l) != 0) die("pthread_create:");
+    }
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    return 0;
+}
+
+static void *loop_run(void *arg)
+{
+    loop *l = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int timeout = -1;
+        if (l->delayed) {
+            long long wait = l->delayed->due - now_ms();
+            timeout = wait > 0 ? wait : 0;
+        }
+
+        int n = epoll_wait(l->epfd, events, MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR) tdie("epoll_wait:");
+
+        for (int i = 0; i < n; i++) {
+            endpoint *e = events[i].data.ptr;
+            if (e == NULL) {
+                loop_accept(l);
+                continue;
+            }
+            if ((void *)e == &l->udpfd) {
+                loop_echo(l);
+                continue;
+            }
+
+            // hangups get reported even on endpoints nobody watches
+            conn *c = e->c;
+            if (c->state == S_DELAY || c->state == S_DEAD) continue;
+            if (c->state == S_DIALING) {
+                if (e == &c->up) conn_dialed(l, c);
+            } else if (c->state == S_SINK) {
+                conn_sink(l, c, events[i].events);
+            } else if (c->state == S_RELAY) {
+                conn_relay(l, c);
+            } else if (c->state == S_ASSOC) {
+                // nothing is expected on the control connection but its end
+                conn_close(l, c);
+            } else {
+                conn_step(l, c);
+            }
+        }
+
+        loop_expire(l);
+
+        while (l->dead) {
+            conn *c = l->dead;
+            l->dead = c->tnext;
+            free(c->rb[0].data);
+            free(c->rb[1].data);
+            free(c);
+        }
+    }
+
+    return NULL;
+}
+
+static void loop_accept(loop *l)
+{
+    for (;;) {
+        int fd = accept4(l->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+        nodelay(fd);
+
+        conn *c = calloc(1, sizeof(*c));
+        if (c == NULL) die("calloc:");
+        c->cli = (endpoint){.fd = fd, .c = c};
+        c->up = (endpoint){.fd = -1, .c = c};
+        c->state = S_GREETING;
+        conn_watch(l, &c->cli, EPOLLIN);
+    }
+}
+
+// replies are small writes spaced by the simulated latency, Nagle would
+// hold the next one back until the peer's delayed ACK
+static void nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void loop_expire(loop *l)
+{
+    long long now = now_ms();
+
+    while (l->delayed && l->delayed->due <= now) {
+        conn *c = l->delayed;
+        l->delayed = c->tnext;
+        if (l->delayed == NULL) l->delayed_tail = NULL;
+
+        c->state = S_REPLY;
+        conn_step(l, c);
+    }
+}
+
+// later events of the same batch may still point at c. the client side is
+// reset so the proxy's ephemeral ports don't pile up in TIME_WAIT
+static void conn_close(loop *l, conn *c)
+{
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    if (c->cli.fd != -1) {
+        setsockopt(c->cli.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        close(c->cli.fd);
+    }
+    if (c->up.fd != -1) close(c->up.fd);
+    c->state = S_DEAD;
+    c->tnext = l->dead;
+    l->dead = c;
+}
+
+static void conn_watch(loop *l, endpoint *e, uint32_t events)
+{
+    if (e->added && e->events == events) return;
+
+    struct epoll_event ev = {.events = events, .data.ptr = e};
+    if (epoll_ctl(l->epfd, e->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, e->fd, &ev) != 0)
+        die("epoll_ctl:");
+    e->events = events;
+    e->added = true;
+}
+
+// sends the len bytes in c->buf once the configured latency passed since
+// the request came in. requests sent together are answered together, as
+// over a link with that latency, so pipelining clients gain what they would
+static void conn_reply(loop *l, conn *c, size_t len, int next)
+{
+    c->len = len;
+    c->off = 0;
+    c->next = next;
+
+    if (latency == 0) {
+        c->state = S_REPLY;
+        conn_step(l, c);
+        return;
+    }
+
+    long long now = now_ms();
+    if (c->heard == 0) c->heard = now;
+    if (c->heard + latency <= now) {
+        c->state = S_REPLY;
+        conn_step(l, c);
+        return;
+    }
+
+    conn_watch(l, &c->cli, 0);
+    c->state = S_DELAY;
+    c->due = c->heard + latency;
+    if (l->delayed_tail && c->due < l->delayed_tail->due) c->due = l->delayed_tail->due;
+    c->tnext = NULL;
+    if (l->delayed_tail) l->delayed_tail->tnext = c;
+    else l->delayed = c;
+    l->delayed_tail = c;
+}
+
+static void conn_step(loop *l, conn *c)
+{
+    int fd = c->cli.fd;
+    int r;
+
+    switch (c->state) {
+    case S_GREETING:
+        if ((r = recv_exact(fd, c->buf, 2, &c->len)) != 0) goto io;
+        if (c->buf[0] != 5) goto fail;
+        if ((r = recv_exact(fd, c->buf, 2 + c->buf[1], &c->len)) != 0) goto io;
+        {
+            int want = user ? 2 : 0;
+            bool ok = memchr(&c->buf[2], want, c->buf[1]) != NULL;
+            c->buf[1] = ok ? want : 0xff;
+            c->len = 0;
+            conn_reply(l, c, 2, !ok ? S_CLOSE : user ? S_AUTH : S_REQUEST);
+        }
+        return;
+
+    case S_AUTH:
+        if ((r = recv_exact(fd, c->buf, 2, &c->len)) != 0) goto io;
+        if ((r = recv_exact(fd, c->buf, 3 + c->buf[1], &c->len)) != 0) goto io;
+        if ((r = recv_exact(fd, c->buf, 3 + c->buf[1] + c->buf[2 + c->buf[1]], &c->len)) != 0) goto io;
+        {
+            size_t ulen = c->buf[1], plen = c->buf[2 + ulen];
+            bool ok = ulen == strlen(user) && memcmp(&c->buf[2], user, ulen) == 0 &&
+                      plen == strlen(pass) && memcmp(&c->buf[3 + ulen], pass, plen) == 0;
+            c->buf[0] = 1;
+            c->buf[1] = ok ? 0 : 1;
+            c->len = 0;
+            conn_reply(l, c, 2, ok ? S_REQUEST : S_CLOSE);
+        }
+        return;
+
+    case S_REQUEST:
+        conn_request(l, c);
+        return;
+
+    case S_REPLY:
+        if ((r = send_exact(fd, c->buf, c->len, &c->off)) != 0) goto io;
+        c->state = c->next;
+        c->len = c->off = 0;
+        // a request already waiting came in along with the one just answered
+        if (recv(fd, &(char){0}, 1, MSG_PEEK | MSG_DONTWAIT) != 1) c->heard = 0;
+        if (c->state == S_CLOSE) goto fail;
+        if (c->state == S_ASSOC) {
+            conn_watch(l, &c->cli, EPOLLIN | EPOLLRDHUP);
+            return;
+        }
+        if (c->state == S_RELAY) {
+            conn_watch(l, &c->up, EPOLLIN);
+            conn_relay(l, c);
+            return;
+        }
+        conn_watch(l, &c->cli, EPOLLIN);
+        return;
+
+    case S_COUNT:
+        if ((r = recv_exact(fd, c->buf, 8, &c->len)) != 0) goto io;
+        c->left = 0;
+        for (int i = 0; i < 8; i++)
+            c->left = c->left << 8 | c->buf[i];
+        c->state = S_SINK;
+        conn_watch(l, &c->cli, EPOLLIN | (c->left ? EPOLLOUT : 0));
+        return;
+    }
+
+    return;
+
+io:
+    if (r == -1) goto fail;
+    conn_watch(l, &c->cli, r == IO_WANT_READ ? EPOLLIN : EPOLLOUT);
+    return;
+
+fail:
+    conn_close(l, c);
+}
+
+// ver + cmd + rsv + atyp + addr + port
+static void conn_request(loop *l, conn *c)
+{
+    int fd = c->cli.fd;
+    int r;
+    size_t need;
+
+    if ((r = recv_exact(fd, c->buf, 5, &c->len)) != 0) goto io;
+    if (c->buf[0] != 5 || (c->buf[1] != 1 && c->buf[1] != 3)) goto fail;
+
+    switch (c->buf[3]) {
+    case 1: need = 4 + 4 + 2; break;
+    case 3: need = 5 + c->buf[4] + 2; break;
+    case 4: need = 4 + 16 + 2; break;
+    default: goto fail;
+    }
+    if ((r = recv_exact(fd, c->buf, need, &c->len)) != 0) goto io;
+
+    char host[256];
+    uint16_t tport = c->buf[need - 2] << 8 | c->buf[need - 1];
+    if (c->buf[3] == 3) {
+        memcpy(host, &c->buf[5], c->buf[4]);
+        host[c->buf[4]] = 0;
+    } else {
+        inet_ntop(c->buf[3] == 1 ? AF_INET : AF_INET6, &c->buf[4], host, sizeof(host));
+    }
+
+    // ver + rep + rsv + ipv4 + port
+    static const unsigned char ok[] = {5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+    bool associate = c->buf[1] == 3;
+    memcpy(c->buf, ok, sizeof(ok));
+
+    if (fail_rate > 0 && rand_r(&l->seed) < fail_rate * ((double)RAND_MAX + 1)) {
+        c->buf[1] = 5;
+        conn_reply(l, c, sizeof(ok), S_CLOSE);
+        return;
+    }
+
+    if (associate) {
+        struct sockaddr_in sa;
+        socklen_t salen = sizeof(sa);
+        getsockname(l->udpfd, (struct sockaddr *)&sa, &salen);
+        memcpy(&c->buf[4], &sa.sin_addr, 4);
+        memcpy(&c->buf[8], &sa.sin_port, 2);
+        conn_reply(l, c, sizeof(ok), S_ASSOC);
+        return;
+    }
+
+    if (strcmp(host, "sink") == 0) {
+        conn_reply(l, c, sizeof(ok), S_COUNT);
+        return;
+    }
+
+    // numeric targets only, a benchmark has no business waiting on dns
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICHOST}, *res;
+    char portstr[8];
+    snprintf(portstr, sizeof(portstr), "%u", tport);
+    if (getaddrinfo(host, portstr, &hints, &res) != 0) {
+        c->buf[1] = 4;
+        conn_reply(l, c, sizeof(ok), S_CLOSE);
+        return;
+    }
+
+    c->up.fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->up.fd == -1 || (connect(c->up.fd, res->ai_addr, res->ai_addrlen) != 0 && errno != EINPROGRESS)) {
+        freeaddrinfo(res);
+        c->buf[1] = 5;
+        conn_reply(l, c, sizeof(ok), S_CLOSE);
+        return;
+    }
+    freeaddrinfo(res);
+    nodelay(c->up.fd);
+
+    c->state = S_DIALING;
+    conn_watch(l, &c->cli, 0);
+    conn_watch(l, &c->up, EPOLLOUT);
+    return;
+
+io:
+    if (r == -1) goto fail;
+    conn_watch(l, &c->cli, EPOLLIN);
+    return;
+
+fail:
+    conn_close(l, c);
+}
+
+static void conn_dialed(loop *l, conn *c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->up.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+    conn_watch(l, &c->up, 0);
+    if (err) {
+        c->buf[1] = 5;
+        conn_reply(l, c, 10, S_CLOSE);
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        c->rb[i].data = emalloc(RELAY_BUFSZ);
+        c->rb[i].off = c->rb[i].len = 0;
+    }
+    conn_reply(l, c, 10, S_RELAY);
+}
+
+static void conn_sink(loop *l, conn *c, uint32_t events)
+{
+    static unsigned char discard[RELAY_BUFSZ];
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ssize_t n = read(c->cli.fd, discard, sizeof(discard));
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            conn_close(l, c);
+            return;
+        }
+    }
+
+    if ((events & EPOLLOUT) && c->left) {
+        size_t want = c->left < RELAY_BUFSZ ? c->left : RELAY_BUFSZ;
+        ssize_t n = write(c->cli.fd, zeros, want);
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            conn_close(l, c);
+            return;
+        }
+        if (n > 0) c->left -= n;
+        if (c->left == 0) conn_watch(l, &c->cli, EPOLLIN);
+    }
+}
+
+static void conn_relay(loop *l, conn *c)
+{
+    int a = relay_dir(&c->rb[0], c->cli.fd, c->up.fd);
+    int b = relay_dir(&c->rb[1], c->up.fd, c->cli.fd);
+    if (a == -1 || b == -1) {
+        conn_close(l, c);
+        return;
+    }
+
+    // a side is only read from while the other can take what's pending
+    conn_watch(l, &c->cli, (c->rb[0].len ? 0 : EPOLLIN) | (c->rb[1].len ? EPOLLOUT : 0));
+    conn_watch(l, &c->up, (c->rb[1].len ? 0 : EPOLLIN) | (c->rb[0].len ? EPOLLOUT : 0));
+}
+
+// moves what it can from one fd to the other, -1 once either side is done
+static int relay_dir(relay_buf *b, int from, int to)
+{
+    for (;;) {
+        if (b->len == 0) {
+            ssize_t n = read(from, b->data, RELAY_BUFSZ);
+            if (n == 0) return -1;
+            if (n == -1) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+            b->off = 0;
+            b->len = n;
+        }
+
+        ssize_t n = write(to, b->data + b->off, b->len);
+        if (n == -1) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        b->off += n;
+        b->len -= n;
+        if (b->len) return 0;
+    }
+}
+
+// sends datagrams back where they came from, GRO trains stay trains
+static void loop_echo(loop *l)
+{
+    static _Thread_local char bufs[ECHO_BATCH][RELAY_BUFSZ];
+    struct mmsghdr msgs[ECHO_BATCH];
+    struct iovec iovs[ECHO_BATCH];
+    struct sockaddr_storage names[ECHO_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctls[ECHO_BATCH];
+
+    for (int i = 0; i < ECHO_BATCH; i++) {
+        iovs[i] = (struct iovec){.iov_base = bufs[i], .iov_len = RELAY_BUFSZ};
+        msgs[i].msg_hdr = (struct msghdr){
+            .msg_name = &names[i], .msg_namelen = sizeof(names[i]),
+            .msg_iov = &iovs[i], .msg_iovlen = 1,
+            .msg_control = ctls[i].buf, .msg_controllen = sizeof(ctls[i].buf),
+        };
+    }
+
+    int n = recvmmsg(l->udpfd, msgs, ECHO_BATCH, 0, NULL);
+    if (n <= 0) return;
+
+    for (int i = 0; i < n; i++) {
+        struct msghdr *h = &msgs[i].msg_hdr;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+        int seg = 0;
+
+        iovs[i].iov_len = msgs[i].msg_len;
+        if (cm && cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+
+        if (seg > 0 && (size_t)seg < msgs[i].msg_len) {
+            uint16_t size = seg;
+            h->msg_controllen = CMSG_SPACE(sizeof(size));
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(size));
+            memcpy(CMSG_DATA(cm), &size, sizeof(size));
+        } else {
+            h->msg_control = NULL;
+            h->msg_controllen = 0;
+        }
+    }
+
+    for (int sent = 0; sent < n;) {
+        int r = sendmmsg(l->udpfd, &msgs[sent], n - sent, 0);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == ENOBUFS) return;
+            r = 1;
+        }
+        sent += r;
+    }
+}
+
+static void usage(const char *name)
+{
+    printf(
+        "usage: %s [OPTION...]\n"
+        "OPTION:\n"
+        "     -h,--help                      shows usage and exits\n"
+        "     -p,--port PORT                 listen on 127.0.0.1:PORT (1080 by default)\n"
+        "     -t,--threads N                 serve from N threads (1 by default)\n"
+        "     -l,--latency MS                answer each request MS milliseconds after it\n"
+        "                                    came in\n"
+        "     -f,--fail RATE                 refuse RATE (0 to 1) of the CONNECTs\n"
+        "     -u,--userpass USER:PASS        require USER:PASS\n"
+    , name);
+}
@@ -0,0 +1,646 @@
+// load generator for benchmarks. drives SOCKS5 clients through proxyrot
+// towards a fakeup sink, or its UDP echo, and prints one json line of results
+#define _GNU_SOURCE
+#include "../util.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MODE_STORM 0  // handshake, close, repeat
+#define MODE_BULK  1  // handshake, download --bytes, close, repeat
+#define MODE_IDLE  2  // open --tunnels and hold them
+#define MODE_UDP   3  // associate, keep --window datagrams echoing
+
+#define C_FREE      0
+#define C_CONNECT   1
+#define C_METHOD    2  // greeting sent, waiting for the method
+#define C_AUTH      3
+#define C_REPLY     4  // CONNECT sent, waiting for the reply
+#define C_DOWNLOAD  5
+#define C_IDLE      6
+#define C_DGRAM     7
+
+// a connection stuck this long counts as failed
+#define STUCK_MS 10000
+#define MAX_EVENTS 256
+// a window that got nothing back this long is taken as lost and sent again
+#define WINDOW_MS 100
+// datagrams, or trains of them, per recvmmsg() and sendmmsg()
+#define DGRAM_BATCH 64
+// the most datagrams the kernel takes in one GSO send
+#define GSO_SEGS 64
+// a client's datagram socket is registered with the low bit of its pointer set
+#define DGRAM_TAG 1
+
+typedef struct client {
+    int fd;
+    int ufd;                       // udp: connected to proxyrot's relay
+    int state;
+    long long started;             // us
+    long long heard;               // udp: last echo or window sent, ms
+    unsigned long long left;       // bytes still to download
+    size_t len, off;
+    unsigned char buf[600];
+} client;
+
+typedef struct lthread {
+    pthread_t thread;
+    int epfd;
+    client *clients;
+    int nclients;
+    long long *lat;                // handshake samples, us
+    size_t nlat, clat;
+    unsigned long long done, failed, bytes, dgrams;
+} lthread;
+
+static struct sockaddr_in target;
+static char *user, *pass;
+static int mode = MODE_STORM;
+static int nthreads = 1;
+static int concurrency = 64;
+static double duration = 5;
+static unsigned long long bytes = 1 << 20;
+static int tunnels = 1000;
+static int dgram_size = 512;
+static int window = 64;
+static bool gso;
+static int train = 1;              // datagrams per send
+static int pid;
+static const char *name = "bench";
+static atomic_bool stopping;
+static atomic_int settled;         // idle tunnels established or failed
+static unsigned char discard[65536];
+// rsv + frag + 127.0.0.1:53, then the payload
+static unsigned char dgram[65536] = {0, 0, 0, 1, 127, 0, 0, 1, 0, 53};
+
+static void *lthread_run(void *arg);
+static void client_start(lthread *t, client *c);
+static void client_event(lthread *t, client *c);
+static void client_done(lthread *t, client *c, bool ok);
+static void client_watch(lthread *t, client *c, uint32_t events);
+static int client_step(lthread *t, client *c);
+static void idle_check(lthread *t);
+static int dgram_start(lthread *t, client *c);
+static void dgram_send(client *c, int n);
+static void dgram_event(lthread *t, client *c);
+static void proc_sample(long long *rss, double *cpu);
+static int cmp_ll(const void *a, const void *b);
+static void usage(const char *argv0);
+
+int main(int argc, char **argv)
+{
+    int opt;
+    char *addr = "127.0.0.1:1080";
+    struct option long_options[] = {
+        {"help"       , no_argument      , NULL, 'h'},
+        {"proxy"      , required_argument, NULL, 'x'},
+        {"userpass"   , required_argument, NULL, 'u'},
+        {"mode"       , required_argument, NULL, 'm'},
+        {"threads"    , required_argument, NULL, 't'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"duration"   , required_argument, NULL, 'd'},
+        {"bytes"      , required_argument, NULL, 'b'},
+        {"tunnels"    , required_argument, NULL, 'n'},
+        {"pid"        , required_argument, NULL, 'P'},
+        {"name"       , required_argument, NULL, 's'},
+        {"size"       , required_argument, NULL, 'S'},
+        {"window"     , required_argument, NULL, 'w'},
+        {"gso"        , no_argument      , NULL, 'G'},
+        {NULL         , 0                , NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hx:u:m:t:c:d:b:n:P:s:S:w:G", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'x': addr = optarg; break;
+        case 'u':
+            user = optarg;
+            pass = strchr(optarg, ':');
+            if (pass) *pass++ = 0;
+            else pass = "";
+            break;
+        case 'm':
+            if (strcmp(optarg, "storm") == 0) mode = MODE_STORM;
+            else if (strcmp(optarg, "bulk") == 0) mode = MODE_BULK;
+            else if (strcmp(optarg, "idle") == 0) mode = MODE_IDLE;
+            else if (strcmp(optarg, "udp") == 0) mode = MODE_UDP;
+            else die("unknown mode %s", optarg);
+            break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'c': concurrency = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'b': bytes = strtoull(optarg, NULL, 10); break;
+        case 'n': tunnels = atoi(optarg); break;
+        case 'P': pid = atoi(optarg); break;
+        case 's': name = optarg; break;
+        case 'S': dgram_size = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'G': gso = true; break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char *colon = strrchr(addr, ':');
+    if (colon == NULL) die("invalid proxy address %s", addr);
+    *colon = 0;
+    target.sin_family = AF_INET;
+    target.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, addr, &target.sin_addr) != 1) die("invalid proxy address %s", addr);
+
+    if (mode == MODE_IDLE) concurrency = tunnels;
+    if (nthreads < 1 || concurrency < nthreads) die("need at least one connection per thread");
+    if (dgram_size < 1 || dgram_size > 1400) die("datagram size must be between 1 and 1400");
+    if (window < 1) die("invalid window");
+
+    // every datagram of a train starts with the header
+    size_t dlen = 10 + dgram_size;
+    if (gso) train = sizeof(dgram) / dlen < GSO_SEGS ? sizeof(dgram) / dlen : GSO_SEGS;
+    for (int i = 1; i < train; i++)
+        memcpy(&dgram[i * dlen], dgram, 10);
+    signal(SIGPIPE, SIG_IGN);
+
+    long long rss0, rss1;
+    double cpu0, cpu1;
+    proc_sample(&rss0, &cpu0);
+
+    lthread *threads = calloc(nthreads, sizeof(*threads));
+    if (threads == NULL) die("calloc:");
+    long long start = now_us();
+
+    for (int i = 0; i < nthreads; i++) {
+        lthread *t = &threads[i];
+        t->nclients = concurrency / nthreads + (i < concurrency % nthreads);
+        t->clients = calloc(t->nclients, sizeof(client));
+        if (t->clients == NULL) die("calloc:");
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (t->epfd == -1) die("epoll_create1:");
+        if (pthread_create(&t->thread, NULL, &lthread_run, t) != 0) die("pthread_create:");
+    }
+
+    if (mode == MODE_IDLE) {
+        // wait for every tunnel to settle, then weigh what they cost
+        long long deadline = now_ms() + (long long)(duration * 1000);
+        while (atomic_load(&settled) < tunnels && now_ms() < deadline)
+            usleep(10000);
+        usleep(200000);
+    } else {
+        usleep((useconds_t)(duration * 1e6));
+    }
+
+    proc_sample(&rss1, &cpu1);
+    double elapsed = (now_us() - start) / 1e6;
+    atomic_store(&stopping, true);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i].thread, NULL);
+
+    unsigned long long done = 0, failed = 0, total = 0, dgrams = 0;
+    size_t nlat = 0;
+    for (int i = 0; i < nthreads; i++) {
+        done += threads[i].done;
+        failed += threads[i].failed;
+        total += threads[i].bytes;
+        dgrams += threads[i].dgrams;
+        nlat += threads[i].nlat;
+    }
+
+    long long *lat = emalloc(sizeof(long long[nlat ? nlat : 1]));
+    for (int i = 0, j = 0; i < nthreads; i++) {
+        if (threads[i].nlat)
+            memcpy(&lat[j], threads[i].lat, sizeof(long long[threads[i].nlat]));
+        j += threads[i].nlat;
+    }
+    qsort(lat, nlat, sizeof(long long), &cmp_ll);
+
+    // each echo crossed proxyrot twice
+    static const char *modes[] = {"storm", "bulk", "idle", "udp"};
+    bool held = mode == MODE_IDLE || mode == MODE_UDP;
+    double cpu = cpu1 - cpu0;
+    printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"threads\":%d,\"concurrency\":%d,"
+           "\"seconds\":%.3f,\"tunnels\":%llu,\"failed\":%llu,\"conns_per_s\":%.1f,"
+           "\"handshake_p50_us\":%lld,\"handshake_p99_us\":%lld,\"bytes\":%llu,"
+           "\"mib_per_s\":%.1f,\"proxy_cpu_s\":%.3f,\"mib_per_s_per_core\":%.1f,"
+           "\"datagrams\":%llu,\"dgrams_per_s\":%.0f,\"dgrams_per_s_per_core\":%.0f,"
+           "\"rss_per_tunnel_bytes\":%.0f}\n",
+           name, modes[mode], nthreads, concurrency, elapsed,
+           held ? (unsigned long long)nlat : done, failed,
+           held ? 0 : done / elapsed,
+           nlat ? lat[nlat / 2] : 0, nlat ? lat[nlat * 99 / 100] : 0, total,
+           total / elapsed / (1 << 20), cpu,
+           cpu > 0 ? total / cpu / (1 << 20) : 0,
+           dgrams, dgrams / elapsed, cpu > 0 ? 2 * dgrams / cpu : 0,
+           mode == MODE_IDLE && nlat && pid ? (double)(rss1 - rss0) / nlat : 0);
+    return failed && mode == MODE_IDLE ? 1 : 0;
+}
+
+static void *lthread_run(void *arg)
+{
+    lthread *t = arg;
+    struct epoll_event events[MAX_EVENTS];
+    long long last_scan = now_ms();
+
+    for (int i = 0; i < t->nclients; i++)
+        client_start(t, &t->clients[i]);
+
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        int n = epoll_wait(t->epfd, events, MAX_EVENTS, mode == MODE_UDP ? WINDOW_MS : 100);
+        for (int i = 0; i < n; i++) {
+            uintptr_t p = (uintptr_t)events[i].data.ptr;
+            if (p & DGRAM_TAG) dgram_event(t, (client *)(p & ~(uintptr_t)DGRAM_TAG));
+            else client_event(t, (client *)p);
+        }
+
+        long long now = now_ms();
+        for (int i = 0; mode == MODE_UDP && i < t->nclients; i++) {
+            client *c = &t->clients[i];
+            if (c->state == C_DGRAM && now - c->heard >= WINDOW_MS) {
+                dgram_send(c, window);
+                c->heard = now;
+            }
+        }
+
+        if (now - last_scan < 1000) continue;
+        last_scan = now;
+
+        for (int i = 0; i < t->nclients; i++) {
+            client *c = &t->clients[i];
+            if (c->state != C_FREE && c->state != C_IDLE && c->state != C_DGRAM && now - c->started / 1000 > STUCK_MS)
+                client_done(t, c, false);
+        }
+    }
+
+    // idle tunnels have to still work before they count
+    if (mode == MODE_IDLE)
+        idle_check(t);
+
+    for (int i = 0; i < t->nclients; i++) {
+        if (t->clients[i].state == C_FREE) continue;
+        close(t->clients[i].fd);
+        if (t->clients[i].state == C_DGRAM) close(t->clients[i].ufd);
+    }
+    return NULL;
+}
+
+static void client_start(lthread *t, client *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->started = now_us();
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1) {
+        t->failed++;
+        c->state = C_FREE;
+        return;
+    }
+
+    // reset on close, thousands of connections a second would otherwise
+    // leave loopback out of ports in TIME_WAIT between scenarios
+    int one = 1;
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+
+    if (connect(c->fd, (struct sockaddr *)&target, sizeof(target)) != 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        t->failed++;
+        c->state = C_FREE;
+        return;
+    }
+
+    c->state = C_CONNECT;
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0) die("epoll_ctl:");
+}
+
+static void client_event(lthread *t, client *c)
+{
+    int r = client_step(t, c);
+    if (r == -1) client_done(t, c, false);
+    else if (r > 0) client_watch(t, c, r == IO_WANT_READ ? EPOLLIN : EPOLLOUT);
+}
+
+// counts c and, unless stopping, reuses its slot for a fresh connection
+static void client_done(lthread *t, client *c, bool ok)
+{
+    if (ok) t->done++;
+    else t->failed++;
+    if (mode == MODE_IDLE && !ok) atomic_fetch_add(&settled, 1);
+
+    close(c->fd);
+    c->state = C_FREE;
+    if (mode != MODE_IDLE && !atomic_load_explicit(&stopping, memory_order_relaxed))
+        client_start(t, c);
+}
+
+static void client_watch(lthread *t, client *c, uint32_t events)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// 0 when c moved on without blocking, IO_WANT_* or -1 otherwise
+static int client_step(lthread *t, client *c)
+{
+    int r;
+
+    for (;;) {
+        switch (c->state) {
+        case C_CONNECT:
+            if (c->len == 0) {
+                c->buf[0] = 5;
+                c->buf[1] = 1;
+                c->buf[2] = user ? 2 : 0;
+                c->len = 3;
+                c->off = 0;
+            }
+            if ((r = send_exact(c->fd, c->buf, c->len, &c->off)) != 0) return r;
+            c->state = C_METHOD;
+            c->len = 0;
+            break;
+
+        case C_METHOD:
+            if ((r = recv_exact(c->fd, c->buf, 2, &c->len)) != 0) return r;
+            if (c->buf[1] != (user ? 2 : 0)) return -1;
+
+            if (user) {
+                size_t ulen = strlen(user), plen = strlen(pass);
+                c->buf[0] = 1;
+                c->buf[1] = ulen;
+                memcpy(&c->buf[2], user, ulen);
+                c->buf[2 + ulen] = plen;
+                memcpy(&c->buf[3 + ulen], pass, plen);
+                c->off = 0;
+                if (send_exact(c->fd, c->buf, 3 + ulen + plen, &c->off) != 0) return -1;
+                c->state = C_AUTH;
+                c->len = 0;
+                break;
+            }
+            /* fallthrough */
+
+        case C_AUTH:
+            if (c->state == C_AUTH) {
+                if ((r = recv_exact(c->fd, c->buf, 2, &c->len)) != 0) return r;
+                if (c->buf[1] != 0) return -1;
+            }
+
+            // CONNECT sink:0 or UDP ASSOCIATE 0.0.0.0:0, small enough to
+            // always go out in one write
+            {
+                static const unsigned char req[] = {5, 1, 0, 3, 4, 's', 'i', 'n', 'k', 0, 0};
+                static const unsigned char assoc[] = {5, 3, 0, 1, 0, 0, 0, 0, 0, 0};
+                c->off = 0;
+                if (mode == MODE_UDP && send_exact(c->fd, assoc, sizeof(assoc), &c->off) != 0) return -1;
+                if (mode != MODE_UDP && send_exact(c->fd, req, sizeof(req), &c->off) != 0) return -1;
+            }
+            c->state = C_REPLY;
+            c->len = 0;
+            break;
+
+        case C_REPLY:
+            if ((r = recv_exact(c->fd, c->buf, 10, &c->len)) != 0) return r;
+            if (c->buf[1] != 0) return -1;
+            {
+                long long us = now_us() - c->started;
+                if (t->nlat == t->clat) {
+                    t->clat = t->clat ? t->clat * 2 : 4096;
+                    t->lat = realloc(t->lat, sizeof(long long[t->clat]));
+                    if (t->lat == NULL) die("realloc:");
+                }
+                t->lat[t->nlat++] = us;
+            }
+
+            if (mode == MODE_IDLE) {
+                c->state = C_IDLE;
+                client_watch(t, c, 0);
+                atomic_fetch_add(&settled, 1);
+                return 0;
+            }
+            if (mode == MODE_UDP)
+                return dgram_start(t, c);
+
+            c->left = mode == MODE_BULK ? bytes : 0;
+            for (int i = 0; i < 8; i++)
+                c->buf[i] = c->left >> (56 - 8 * i);
+            c->off = 0;
+            if (send_exact(c->fd, c->buf, 8, &c->off) != 0) return -1;
+
+            if (c->left == 0) {
+                client_done(t, c, true);
+                return 0;
+            }
+            c->state = C_DOWNLOAD;
+            break;
+
+        case C_DOWNLOAD:
+            while (c->left) {
+                ssize_t n = read(c->fd, discard, c->left < sizeof(discard) ? c->left : sizeof(discard));
+                if (n == 0) return -1;
+                if (n == -1) return errno == EAGAIN || errno == EINTR ? IO_WANT_READ : -1;
+                c->left -= n;
+                t->bytes += n;
+            }
+            client_done(t, c, true);
+            return 0;
+
+        default:
+            return 0;
+        }
+    }
+}
+
+// asks every held tunnel for one byte, the ones that don't answer failed
+static void idle_check(lthread *t)
+{
+    static const unsigned char one[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+    for (int i = 0; i < t->nclients; i++) {
+        client *c = &t->clients[i];
+        if (c->state != C_IDLE) continue;
+
+        unsigned char b;
+        struct epoll_event ev;
+        client_watch(t, c, EPOLLIN);
+        if (send(c->fd, one, sizeof(one), 0) != sizeof(one) ||
+            epoll_wait(t->epfd, &ev, 1, 2000) != 1 || read(c->fd, &b, 1) != 1)
+            t->failed++;
+        else
+            t->done++;
+        client_watch(t, c, 0);
+    }
+}
+
+// opens a socket to the relay address in c->buf's reply and fills the window
+static int dgram_start(lthread *t, client *c)
+{
+    struct sockaddr_in relay = {.sin_family = AF_INET};
+    if (c->buf[3] != 1) return -1;
+    memcpy(&relay.sin_addr, &c->buf[4], 4);
+    memcpy(&relay.sin_port, &c->buf[8], 2);
+
+    int one = 1;
+    c->ufd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->ufd == -1) return -1;
+    setsockopt(c->ufd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+    if (connect(c->ufd, (struct sockaddr *)&relay, sizeof(relay)) != 0) {
+        close(c->ufd);
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = (void *)((uintptr_t)c | DGRAM_TAG)};
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->ufd, &ev) != 0) die("epoll_ctl:");
+
+    // the control connection only has to stay open
+    c->state = C_DGRAM;
+    client_watch(t, c, 0);
+    c->heard = now_ms();
+    dgram_send(c, window);
+    return 0;
+}
+
+// sends n datagrams, in trains when --gso is on. what doesn't fit the
+// socket buffer is lost like on any network, the window gets refilled
+static void dgram_send(client *c, int n)
+{
+    struct mmsghdr msgs[DGRAM_BATCH];
+    struct iovec iovs[DGRAM_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } ctls[DGRAM_BATCH];
+    size_t len = 10 + dgram_size;
+
+    while (n > 0) {
+        int m = 0;
+        for (; m < DGRAM_BATCH && n > 0; m++) {
+            int segs = n < train ? n : train;
+            iovs[m] = (struct iovec){.iov_base = dgram, .iov_len = len * segs};
+            msgs[m].msg_hdr = (struct msghdr){.msg_iov = &iovs[m], .msg_iovlen = 1};
+            if (segs > 1) {
+                uint16_t size = len;
+                msgs[m].msg_hdr.msg_control = ctls[m].buf;
+                msgs[m].msg_hdr.msg_controllen = sizeof(ctls[m].buf);
+                struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[m].msg_hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(size));
+                memcpy(CMSG_DATA(cm), &size, sizeof(size));
+            }
+            n -= segs;
+        }
+        if (sendmmsg(c->ufd, msgs, m, 0) != m) return;
+    }
+}
+
+// counts the echoes in, every one of them lets another datagram out
+static void dgram_event(lthread *t, client *c)
+{
+    struct mmsghdr msgs[DGRAM_BATCH];
+    struct iovec iovs[DGRAM_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctls[DGRAM_BATCH];
+    static _Thread_local unsigned char bufs[DGRAM_BATCH][65536];
+
+    if (c->state != C_DGRAM) return;
+
+    for (int i = 0; i < DGRAM_BATCH; i++) {
+        iovs[i] = (struct iovec){.iov_base = bufs[i], .iov_len = sizeof(bufs[i])};
+        msgs[i].msg_hdr = (struct msghdr){
+            .msg_iov = &iovs[i], .msg_iovlen = 1,
+            .msg_control = ctls[i].buf, .msg_controllen = sizeof(ctls[i].buf),
+        };
+    }
+
+    int n = recvmmsg(c->ufd, msgs, DGRAM_BATCH, 0, NULL);
+    if (n <= 0) return;
+
+    int got = 0;
+    for (int i = 0; i < n; i++) {
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+        size_t len = msgs[i].msg_len;
+        int seg = 0;
+        if (cm && cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+        got += seg > 0 ? (len + seg - 1) / seg : 1;
+        t->bytes += len;
+    }
+
+    t->dgrams += got;
+    c->heard = now_ms();
+    dgram_send(c, got);
+}
+
+// proxyrot's resident set in bytes and cpu time in seconds
+static void proc_sample(long long *rss, double *cpu)
+{
+    *rss = 0;
+    *cpu = 0;
+    if (pid == 0) return;
+
+    char path[64], buf[4096];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+
+    // fields after the parenthesized command name, utime is the 14th
+    char *p = strrchr(buf, ')');
+    if (p == NULL) return;
+    unsigned long utime = 0, stime = 0;
+    long rsspages = 0;
+    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+           &utime, &stime, &rsspages);
+
+    long hz = sysconf(_SC_CLK_TCK);
+    *cpu = (double)(utime + stime) / hz;
+    *rss = rsspages * sysconf(_SC_PAGESIZE);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *argv0)
+{
+    printf(
+        "usage: %s [OPTION...]\n"
+        "OPTION:\n"
+        "     -h,--help                      shows usage and exits\n"
+        "     -x,--proxy ADDR:PORT           proxyrot to load (127.0.0.1:1080 by default)\n"
+        "     -u,--userpass USER:PASS        authenticate as USER:PASS\n"
+        "     -m,--mode MODE                 storm, bulk, idle or udp (storm by default)\n"
+        "     -t,--threads N                 client threads (1 by default)\n"
+        "     -c,--concurrency N             connections kept in flight (64 by default)\n"
+        "     -d,--duration SECONDS          how long to run, idle waits up to that long\n"
+        "                                    for its tunnels (5 by default)\n"
+        "     -b,--bytes BYTES               bulk download per tunnel (1MiB by default)\n"
+        "     -n,--tunnels N                 idle tunnels to hold (1000 by default)\n"
+        "     -P,--pid PID                   proxyrot's pid, for cpu and rss figures\n"
+        "     -s,--name NAME                 scenario name in the output\n"
+        "     -S,--size BYTES                udp payload per datagram (512 by default)\n"
+        "     -w,--window N                  udp datagrams in flight per association\n"
+        "                                    (64 by default)\n"
+        "     -G,--gso                       send udp datagrams in GSO trains\n"
+    , argv0);
+}
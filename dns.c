@@ -0,0 +1,497 @@
+#define _GNU_SOURCE
+#include "dns.h"
+#include "util.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// failed resolutions are retried after this many seconds
+#define DNS_NEG_TTL 5
+#define DNS_BUCKETS 4096
+// destinations are kept per stripe, most recently used first, so a client
+// can't grow the cache past DNS_DEST_STRIPES * DNS_DEST_PER_STRIPE names
+#define DNS_DEST_STRIPES 64
+#define DNS_DEST_PER_STRIPE 64
+// misses are resolved off the workers, this many at once
+#define DNS_DEST_THREADS 4
+
+// readers copy the address out under a seqlock, so the resolver thread can
+// refresh it in place without workers ever taking a lock
+struct dns_entry {
+    char *host;
+    char *port;
+    atomic_uint seq;
+    int status;
+    dns_addr addr;
+    bool numeric;
+    long long refresh_at;
+    unsigned refs;                 // proxies using it, under lock
+    size_t index;                  // in entries, under lock
+    struct dns_entry *next;
+};
+
+// a destination clients CONNECT to, resolved for socks5 upstreams
+typedef struct dns_dest {
+    struct dns_dest *prev, *next;  // stripe
+    struct dns_dest *qnext;        // resolver queue
+    uint32_t hash;
+    int status;                    // 0, -1 or DNS_PENDING
+    bool queued;                   // left alone by eviction until resolved
+    bool waited;                   // a worker waits for this answer
+    long long expires_at;
+    dns_addr addr;
+    size_t len;
+    char name[256];
+} dns_dest;
+
+typedef struct dest_stripe {
+    pthread_mutex_t lock;
+    dns_dest *head, *tail;
+    unsigned n;
+} dest_stripe;
+
+static dns_entry *buckets[DNS_BUCKETS];
+static dns_entry **entries;
+static size_t nentries, centries;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static bool started, stopping;
+static int ttl;
+
+static dest_stripe stripes[DNS_DEST_STRIPES];
+static dns_dest *queue, *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static bool dests_started, dests_stopping;
+static int *notify_fds;
+static size_t nnotify;
+
+static dns_entry *dns_find(uint32_t h, const char *host, const char *port);
+static void dns_drop(dns_entry *e);
+static void dns_resolve(dns_entry *e);
+static void *dns_refresh(void *arg);
+static uint32_t hash(const char *host, const char *port);
+static dns_dest *dest_find(dest_stripe *s, uint32_t h, const char *name, size_t len);
+static dns_dest *dest_new(dest_stripe *s, uint32_t h, const char *name, size_t len);
+static void dest_link(dest_stripe *s, dns_dest *d);
+static void dest_unlink(dest_stripe *s, dns_dest *d);
+static void dest_queue(dns_dest *d);
+static void *dest_resolve(void *arg);
+
+// every call takes a reference, proxies give it back with dns_cache_put()
+// once they are freed
+dns_entry *dns_cache_get(const char *host, const char *port)
+{
+    uint32_t h = hash(host, port) % DNS_BUCKETS;
+    dns_entry *e;
+
+    pthread_mutex_lock(&lock);
+    if ((e = dns_find(h, host, port))) e->refs++;
+    pthread_mutex_unlock(&lock);
+    if (e) return e;
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) die("calloc:");
+    e->host = strdup(host);
+    e->port = strdup(port);
+    if (e->host == NULL || e->port == NULL) die("strdup:");
+
+    unsigned char tmp[sizeof(struct in6_addr)];
+    e->numeric = inet_pton(AF_INET, host, tmp) == 1 || inet_pton(AF_INET6, host, tmp) == 1;
+    e->status = -1;
+
+    // once the refresher runs, new entries are resolved before they are
+    // published so it never writes the same entry concurrently
+    if (started)
+        dns_resolve(e);
+
+    pthread_mutex_lock(&lock);
+
+    dns_entry *found = dns_find(h, host, port);
+    if (found) {
+        found->refs++;
+        pthread_mutex_unlock(&lock);
+        free(e->host);
+        free(e->port);
+        free(e);
+        return found;
+    }
+
+    e->refs = 1;
+    e->next = buckets[h];
+    buckets[h] = e;
+
+    if (nentries == centries) {
+        centries = centries ? centries * 2 : 64;
+        entries = realloc(entries, sizeof(dns_entry*[centries]));
+        if (entries == NULL) die("realloc:");
+    }
+    e->index = nentries;
+    entries[nentries++] = e;
+
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+// hosts no proxy uses anymore, like those a reload dropped from the
+// lists, leave the cache with their last reference
+void dns_cache_put(dns_entry *e)
+{
+    pthread_mutex_lock(&lock);
+    if (--e->refs == 0) dns_drop(e);
+    pthread_mutex_unlock(&lock);
+}
+
+// returns -1 while the host is negatively cached
+int dns_lookup(dns_entry *e, dns_addr *addr)
+{
+    unsigned seq;
+    int status;
+
+    do {
+        seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        status = e->status;
+        *addr = e->addr;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&e->seq, memory_order_relaxed));
+
+    return status;
+}
+
+// resolves every known host once, then keeps them fresh in the background
+void dns_cache_start(int seconds)
+{
+    ttl = seconds;
+
+    for (size_t i = 0; i < nentries; i++)
+        dns_resolve(entries[i]);
+
+    if (pthread_create(&thread, NULL, &dns_refresh, NULL) != 0)
+        die("pthread_create:");
+    started = true;
+}
+
+void dns_cache_stop(void)
+{
+    // a resolver can be stuck in getaddrinfo() for its whole timeout, so
+    // they are left to exit with the process and keep their entries. none
+    // of them writes to a notify fd after this
+    if (dests_started) {
+        pthread_mutex_lock(&queue_lock);
+        dests_stopping = true;
+        pthread_cond_broadcast(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+    }
+
+    if (started) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(thread, NULL);
+    }
+
+    for (size_t i = 0; i < nentries; i++) {
+        free(entries[i]->host);
+        free(entries[i]->port);
+        free(entries[i]);
+    }
+    if (entries) free(entries);
+    entries = NULL;
+    nentries = centries = 0;
+    memset(buckets, 0, sizeof(buckets));
+}
+
+// the address name resolves to, with port 0. a miss or an expired failure
+// returns DNS_PENDING and queues a resolution, an expired answer is still
+// handed out while a fresh one is fetched
+int dns_dest_lookup(const char *name, size_t len, dns_addr *addr)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+
+    dest_stripe *s = &stripes[h % DNS_DEST_STRIPES];
+    long long now = now_ms();
+    int status;
+
+    pthread_mutex_lock(&s->lock);
+
+    dns_dest *d = dest_find(s, h, name, len);
+    if (d == NULL && (d = dest_new(s, h, name, len)) == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+
+    if (d != s->head) {
+        dest_unlink(s, d);
+        dest_link(s, d);
+    }
+
+    if (d->expires_at <= now && !d->queued) {
+        if (d->status != 0) d->status = DNS_PENDING;
+        dest_queue(d);
+    }
+
+    status = d->status;
+    if (status == 0) *addr = d->addr;
+    else if (status == DNS_PENDING) d->waited = true;
+
+    pthread_mutex_unlock(&s->lock);
+    return status;
+}
+
+// each of notify gets written once an answer somebody waited for is in
+void dns_dest_start(const int *notify, size_t n)
+{
+    notify_fds = emalloc(sizeof(int[n]));
+    memcpy(notify_fds, notify, sizeof(int[n]));
+    nnotify = n;
+
+    for (int i = 0; i < DNS_DEST_STRIPES; i++)
+        pthread_mutex_init(&stripes[i].lock, NULL);
+
+    for (int i = 0; i < DNS_DEST_THREADS; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, &dest_resolve, NULL) != 0)
+            die("pthread_create:");
+        pthread_detach(t);
+    }
+    dests_started = true;
+}
+
+static dns_entry *dns_find(uint32_t h, const char *host, const char *port)
+{
+    for (dns_entry *e = buckets[h]; e; e = e->next)
+        if (strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0)
+            return e;
+    return NULL;
+}
+
+// called with lock held. the last entry takes e's place in entries, a
+// refresher walking them just sees it a round later
+static void dns_drop(dns_entry *e)
+{
+    dns_entry **link = &buckets[hash(e->host, e->port) % DNS_BUCKETS];
+    while (*link != e) link = &(*link)->next;
+    *link = e->next;
+
+    entries[e->index] = entries[--nentries];
+    entries[e->index]->index = e->index;
+
+    free(e->host);
+    free(e->port);
+    free(e);
+}
+
+static void dns_resolve(dns_entry *e)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_PASSIVE;
+
+    dns_addr addr;
+    memset(&addr, 0, sizeof(addr));
+    int status = -1;
+
+    if (getaddrinfo(e->host, e->port, &hints, &res) == 0) {
+        addr.family = res->ai_family;
+        addr.socktype = res->ai_socktype;
+        addr.protocol = res->ai_protocol;
+        addr.addrlen = res->ai_addrlen;
+        memcpy(&addr.addr, res->ai_addr, res->ai_addrlen);
+        status = 0;
+        freeaddrinfo(res);
+    }
+
+    unsigned seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    atomic_store_explicit(&e->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->status = status;
+    e->addr = addr;
+    atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+
+    e->refresh_at = now_ms() + (status == 0 ? ttl : DNS_NEG_TTL) * 1000LL;
+}
+
+static void *dns_refresh(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+
+    while (!stopping) {
+        long long now = now_ms();
+
+        for (size_t i = 0; i < nentries && !stopping; i++) {
+            dns_entry *e = entries[i];
+            if (e->numeric && e->status == 0) continue;
+            if (e->refresh_at > now) continue;
+
+            // don't hold up dns_cache_get() while the resolver blocks,
+            // the reference keeps e around if its proxies go meanwhile
+            e->refs++;
+            pthread_mutex_unlock(&lock);
+            dns_resolve(e);
+            pthread_mutex_lock(&lock);
+            if (--e->refs == 0) dns_drop(e);
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&cond, &lock, &ts);
+    }
+
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// fnv-1a over host and port
+static uint32_t hash(const char *host, const char *port)
+{
+    uint32_t h = 2166136261u;
+    for (; *host; host++) h = (h ^ (unsigned char)*host) * 16777619u;
+    h = (h ^ ':') * 16777619u;
+    for (; *port; port++) h = (h ^ (unsigned char)*port) * 16777619u;
+    return h;
+}
+
+static dns_dest *dest_find(dest_stripe *s, uint32_t h, const char *name, size_t len)
+{
+    for (dns_dest *d = s->head; d; d = d->next)
+        if (d->hash == h && d->len == len && memcmp(d->name, name, len) == 0)
+            return d;
+    return NULL;
+}
+
+// a full stripe gives up its least recently used entry that isn't being
+// resolved, NULL when there is none
+static dns_dest *dest_new(dest_stripe *s, uint32_t h, const char *name, size_t len)
+{
+    dns_dest *d;
+
+    if (len >= sizeof(d->name)) return NULL;
+
+    if (s->n < DNS_DEST_PER_STRIPE) {
+        if ((d = malloc(sizeof(*d))) == NULL) return NULL;
+        s->n++;
+    } else {
+        for (d = s->tail; d && d->queued; d = d->prev);
+        if (d == NULL) return NULL;
+        dest_unlink(s, d);
+    }
+
+    memset(d, 0, sizeof(*d));
+    d->hash = h;
+    d->len = len;
+    memcpy(d->name, name, len);
+    d->status = -1;
+    dest_link(s, d);
+    return d;
+}
+
+static void dest_link(dest_stripe *s, dns_dest *d)
+{
+    d->prev = NULL;
+    d->next = s->head;
+    if (s->head) s->head->prev = d;
+    else s->tail = d;
+    s->head = d;
+}
+
+static void dest_unlink(dest_stripe *s, dns_dest *d)
+{
+    if (d->prev) d->prev->next = d->next;
+    else s->head = d->next;
+    if (d->next) d->next->prev = d->prev;
+    else s->tail = d->prev;
+    d->prev = d->next = NULL;
+}
+
+// called with d's stripe locked
+static void dest_queue(dns_dest *d)
+{
+    d->queued = true;
+    d->qnext = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) queue_tail->qnext = d;
+    else queue = d;
+    queue_tail = d;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// a queued entry is never evicted or renamed, so its name is read unlocked
+static void *dest_resolve(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue == NULL && !dests_stopping)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (dests_stopping) {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        dns_dest *d = queue;
+        if ((queue = d->qnext) == NULL) queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        dns_addr addr;
+        memset(&addr, 0, sizeof(addr));
+        int status = -1;
+
+        if (getaddrinfo(d->name, NULL, &hints, &res) == 0) {
+            // the upstream may not reach IPv6, so IPv4 goes first
+            struct addrinfo *ai = res;
+            for (struct addrinfo *i = res; i; i = i->ai_next) {
+                if (i->ai_family == AF_INET) {
+                    ai = i;
+                    break;
+                }
+            }
+            addr.family = ai->ai_family;
+            addr.socktype = ai->ai_socktype;
+            addr.protocol = ai->ai_protocol;
+            addr.addrlen = ai->ai_addrlen;
+            memcpy(&addr.addr, ai->ai_addr, ai->ai_addrlen);
+            status = 0;
+            freeaddrinfo(res);
+        }
+
+        dest_stripe *s = &stripes[d->hash % DNS_DEST_STRIPES];
+        pthread_mutex_lock(&s->lock);
+        d->status = status;
+        d->addr = addr;
+        d->expires_at = now_ms() + (status == 0 ? ttl : DNS_NEG_TTL) * 1000LL;
+        d->queued = false;
+        bool waited = d->waited;
+        d->waited = false;
+        pthread_mutex_unlock(&s->lock);
+
+        if (!waited) continue;
+
+        uint64_t one = 1;
+        pthread_mutex_lock(&queue_lock);
+        for (size_t i = 0; !dests_stopping && i < nnotify; i++)
+            write(notify_fds[i], &one, sizeof(one));
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
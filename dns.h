@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+// dns_dest_lookup() has no answer yet, the notify fds get written once it does
+#define DNS_PENDING 1
+
+typedef struct dns_entry dns_entry;
+
+typedef struct dns_addr {
+    int family, socktype, protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} dns_addr;
+
+dns_entry *dns_cache_get(const char *host, const char *port);
+void dns_cache_put(dns_entry *e);
+int dns_lookup(dns_entry *e, dns_addr *addr);
+void dns_cache_start(int ttl);
+void dns_cache_stop(void);
+int dns_dest_lookup(const char *name, size_t len, dns_addr *addr);
+void dns_dest_start(const int *notify, size_t n);
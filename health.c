@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include "health.h"
+#include "log.h"
+#include "proxyrot.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// checks in flight at once
+#define HEALTH_CONCURRENCY 256
+// consecutive results needed to flip a proxy's state
+#define HEALTH_FALL 2
+#define HEALTH_RISE 2
+
+typedef struct check {
+    proxy_info *proxy;
+    int fd;
+    int connecting;
+    long long started;
+    long long deadline;
+    negotiation neg;
+} check;
+
+static proxy_set *set;   // the set of the current round
+static rcu_reader reader;
+static int interval;
+static int epfd = -1;
+static int stopfd = -1;
+static pthread_t thread;
+static check checks[HEALTH_CONCURRENCY];
+
+static void *health_run(void *arg);
+static int check_start(check *c, proxy_info *proxy);
+static void check_step(check *c);
+static void check_done(check *c, int ok);
+static void check_watch(check *c, uint32_t events);
+
+void health_start(int seconds)
+{
+    interval = seconds;
+    rcu_register(&reader);
+    set = proxy_set_snapshot(&proxies, &reader);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) die("epoll_create1:");
+
+    stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stopfd == -1) die("eventfd:");
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, stopfd, &ev) != 0)
+        die("epoll_ctl:");
+
+    for (int i = 0; i < HEALTH_CONCURRENCY; i++)
+        checks[i].fd = -1;
+
+    if (pthread_create(&thread, NULL, &health_run, NULL) != 0)
+        die("pthread_create:");
+}
+
+void health_stop(void)
+{
+    if (epfd == -1) return;
+
+    uint64_t one = 1;
+    write(stopfd, &one, sizeof(one));
+    pthread_join(thread, NULL);
+
+    for (int i = 0; i < HEALTH_CONCURRENCY; i++)
+        if (checks[i].fd != -1) close(checks[i].fd);
+    close(stopfd);
+    close(epfd);
+    epfd = stopfd = -1;
+    proxy_set_put(set);
+}
+
+// dials every proxy once per interval, walking its whole chain. each round
+// checks whatever set was current when it started
+static void *health_run(void *arg)
+{
+    (void)arg;
+    struct epoll_event events[HEALTH_CONCURRENCY];
+    size_t next = 0;
+    int inflight = 0;
+    long long round = now_ms();
+
+    for (;;) {
+        long long now = now_ms();
+
+        if (next == set->len && inflight == 0 && now >= round + interval * 1000LL) {
+            next = 0;
+            round = now;
+            proxy_set_put(set);
+            set = proxy_set_snapshot(&proxies, &reader);
+            proxy_set_recount(set);
+        }
+
+        for (int i = 0; i < HEALTH_CONCURRENCY && next < set->len; i++) {
+            if (checks[i].fd != -1) continue;
+            if (check_start(&checks[i], set->proxies[next++]) == 0)
+                inflight++;
+        }
+
+        int wait = -1;
+        if (inflight) {
+            for (int i = 0; i < HEALTH_CONCURRENCY; i++) {
+                if (checks[i].fd == -1) continue;
+                long long left = checks[i].deadline - now;
+                if (left < 0) left = 0;
+                if (wait == -1 || left < wait) wait = left;
+            }
+        } else if (next == set->len) {
+            long long left = round + interval * 1000LL - now;
+            wait = left > 0 ? left : 0;
+        }
+
+        int n = epoll_wait(epfd, events, HEALTH_CONCURRENCY, wait);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            tdie("epoll_wait:");
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) return NULL;
+            check_step(events[i].data.ptr);
+        }
+
+        now = now_ms();
+        inflight = 0;
+        for (int i = 0; i < HEALTH_CONCURRENCY; i++) {
+            if (checks[i].fd == -1) continue;
+            if (checks[i].deadline <= now)
+                check_done(&checks[i], 0);
+            else
+                inflight++;
+        }
+    }
+}
+
+static int check_start(check *c, proxy_info *proxy)
+{
+    c->proxy = proxy;
+    c->connecting = 1;
+    c->started = now_us();
+    c->deadline = now_ms() + connect_timeout;
+
+    c->fd = proxy_connect(proxy);
+    if (c->fd == -1) {
+        check_done(c, 0);
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0) {
+        check_done(c, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void check_step(check *c)
+{
+    if (c->fd == -1) return;
+
+    if (c->connecting) {
+        int err;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            check_done(c, 0);
+            return;
+        }
+        c->connecting = 0;
+        c->deadline = now_ms() + hop_timeout;
+        proxy_negotiation_init(&c->neg, c->proxy, pipeline, NULL, 0);
+    }
+
+    proxy_info *hop = c->neg.cur;
+    int r = proxy_negotiate(&c->neg, c->fd);
+    if (c->neg.cur != hop)
+        c->deadline = now_ms() + hop_timeout;
+    if (r == IO_WANT_READ || r == IO_WANT_WRITE)
+        check_watch(c, r == IO_WANT_READ ? EPOLLIN : EPOLLOUT);
+    else
+        check_done(c, r == 0);
+}
+
+static void check_watch(check *c, uint32_t events)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+        check_done(c, 0);
+}
+
+// flips the proxy only after HEALTH_FALL failures or HEALTH_RISE successes
+// in a row, so a single lost check doesn't pull it from rotation
+static void check_done(check *c, int ok)
+{
+    proxy_info *p = c->proxy;
+    char proxy_str[4096];
+
+    if (c->fd != -1) close(c->fd);
+    c->fd = -1;
+
+    proxy_latency(p, ok ? now_us() - c->started : connect_timeout * 1000LL);
+
+    if (ok) {
+        p->fails = 0;
+        if (p->oks < HEALTH_RISE) p->oks++;
+    } else {
+        p->oks = 0;
+        if (p->fails < HEALTH_FALL) p->fails++;
+    }
+
+    bool down = atomic_load_explicit(&p->down, memory_order_relaxed);
+
+    if (down && p->oks >= HEALTH_RISE) {
+        atomic_store_explicit(&p->down, false, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&set->ndown, 1, memory_order_relaxed);
+        sprint_proxy(p, proxy_str, sizeof(proxy_str));
+        log_msg(LOG_INFO, "proxy %s is up", proxy_str);
+    } else if (!down && p->fails >= HEALTH_FALL) {
+        atomic_store_explicit(&p->down, true, memory_order_relaxed);
+        atomic_fetch_add_explicit(&set->ndown, 1, memory_order_relaxed);
+        sprint_proxy(p, proxy_str, sizeof(proxy_str));
+        log_msg(LOG_WARN, "proxy %s is down", proxy_str);
+    }
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "rotation.h"
+
+void health_start(int interval);
+void health_stop(void);
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include "log.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// records per thread ring, a power of 2
+#define LOG_RING 1024
+// longest line kept, longer ones are truncated
+#define LOG_RECSZ 256
+// how often the flusher drains the rings
+#define LOG_FLUSH_MS 20
+// bytes gathered per write()
+#define LOG_BATCH 65536
+
+typedef struct log_record {
+    int level;
+    int len;
+    char text[LOG_RECSZ];
+} log_record;
+
+// single producer (its thread), single consumer (the flusher)
+typedef struct log_ring {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_ullong dropped;
+    struct log_ring *next;
+    log_record recs[LOG_RING];
+} log_ring;
+
+int log_level = LOG_INFO;
+
+static const char *levels[] = {"error", "warn", "info", "debug"};
+
+static _Thread_local log_ring *ring;
+static _Atomic(log_ring *) rings;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static bool started, stopping;
+static unsigned long long reported;
+
+static log_ring *log_register(void);
+static void log_vmsg(int level, const char *fmt, va_list ap);
+static void *log_run(void *arg);
+static void log_flush(void);
+static void log_write(int fd, char *buf, size_t *len);
+
+int log_level_from_str(const char *str)
+{
+    for (int i = 0; i < (int)(sizeof(levels) / sizeof(levels[0])); i++)
+        if (strcmp(str, levels[i]) == 0)
+            return i;
+    return -1;
+}
+
+void log_start(void)
+{
+    if (pthread_create(&thread, NULL, &log_run, NULL) != 0)
+        die("pthread_create:");
+    started = true;
+}
+
+// call once every other thread is done logging
+void log_stop(void)
+{
+    if (started) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(thread, NULL);
+        started = false;
+    }
+
+    log_flush();
+
+    for (log_ring *r = rings, *next; r && (next = r->next, 1); r = next)
+        free(r);
+    rings = NULL;
+    ring = NULL;
+}
+
+// never blocks: formats straight into the calling thread's ring and counts
+// the record as dropped when the ring is full
+void log_msg(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    log_vmsg(level, fmt, ap);
+    va_end(ap);
+}
+
+// log_msg() for code that also runs before log_start(), like loading the
+// lists, whose messages go straight to stderr until then
+void log_report(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (started) {
+        log_vmsg(level, fmt, ap);
+    } else if (log_enabled(level)) {
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+    }
+    va_end(ap);
+}
+
+unsigned long long log_dropped(void)
+{
+    unsigned long long n = 0;
+    for (log_ring *r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next)
+        n += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    return n;
+}
+
+static void log_vmsg(int level, const char *fmt, va_list ap)
+{
+    if (!log_enabled(level)) return;
+
+    log_ring *r = ring ? ring : log_register();
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOG_RING) {
+        atomic_store_explicit(&r->dropped, atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+
+    log_record *rec = &r->recs[head % LOG_RING];
+    int n = vsnprintf(rec->text, LOG_RECSZ - 1, fmt, ap);
+
+    if (n < 0) n = 0;
+    if (n > LOG_RECSZ - 2) n = LOG_RECSZ - 2;
+    rec->text[n++] = '\n';
+    rec->len = n;
+    rec->level = level;
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// rings are pushed once per thread and only freed by log_stop
+static log_ring *log_register(void)
+{
+    log_ring *r = calloc(1, sizeof(*r));
+    if (r == NULL) die("calloc:");
+
+    r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &r->next, r, memory_order_release, memory_order_relaxed));
+
+    ring = r;
+    return r;
+}
+
+static void *log_run(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+
+    while (!stopping) {
+        pthread_mutex_unlock(&lock);
+        log_flush();
+        pthread_mutex_lock(&lock);
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (!stopping)
+            pthread_cond_timedwait(&cond, &lock, &ts);
+    }
+
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// drains every ring, info and debug to stdout, warnings and errors to
+// stderr, in as few writes as possible
+static void log_flush(void)
+{
+    static char out[LOG_BATCH], err[LOG_BATCH];
+    size_t nout = 0, nerr = 0;
+
+    for (log_ring *r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next) {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            log_record *rec = &r->recs[tail % LOG_RING];
+            char *buf = rec->level <= LOG_WARN ? err : out;
+            size_t *len = rec->level <= LOG_WARN ? &nerr : &nout;
+
+            if (*len + rec->len > LOG_BATCH)
+                log_write(buf == err ? STDERR_FILENO : STDOUT_FILENO, buf, len);
+            memcpy(buf + *len, rec->text, rec->len);
+            *len += rec->len;
+        }
+
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+
+    unsigned long long dropped = log_dropped();
+    if (dropped != reported) {
+        char msg[64];
+        int n = snprintf(msg, sizeof(msg), "%llu log records dropped\n", dropped - reported);
+        if (nerr + n > LOG_BATCH)
+            log_write(STDERR_FILENO, err, &nerr);
+        memcpy(err + nerr, msg, n);
+        nerr += n;
+        reported = dropped;
+    }
+
+    log_write(STDOUT_FILENO, out, &nout);
+    log_write(STDERR_FILENO, err, &nerr);
+}
+
+static void log_write(int fd, char *buf, size_t *len)
+{
+    size_t off = 0;
+    while (off < *len) {
+        ssize_t n = write(fd, buf + off, *len - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    *len = 0;
+}
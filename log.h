@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+extern int log_level;
+
+int log_level_from_str(const char *str);
+void log_start(void);
+void log_stop(void);
+void log_msg(int level, const char *fmt, ...);
+void log_report(int level, const char *fmt, ...);
+unsigned long long log_dropped(void);
+
+// lets callers skip building arguments nobody will see
+static inline bool log_enabled(int level)
+{
+    return level <= log_level;
+}
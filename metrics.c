@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "log.h"
+#include "proxyrot.h"
+#include "util.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// how long a scraper may take to send its request and read the reply
+#define METRICS_IO_TIMEOUT 1000
+
+static const long long buckets[METRICS_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+static const char *fail_phases[METRICS_NFAILS] = {"connect", "auth", "chain"};
+
+static proxy_set *set;   // the set being written out
+static size_t *order;    // its indexes by proxy_id(), a run of equal ids is one series
+static uint64_t *ids;
+static rcu_reader reader;
+static int nslots;
+static int listenfd = -1;
+static int stopfd = -1;
+static pthread_t thread;
+
+static void *metrics_run(void *arg);
+static void metrics_serve(int fd);
+static void metrics_write(FILE *f);
+static int metrics_order(void);
+static int order_cmp(const void *a, const void *b);
+static size_t series_end(size_t i);
+static void write_histogram(FILE *f, const char *name, const char *label, size_t i, size_t end,
+                            size_t hist, size_t sum);
+static unsigned long long total(size_t i, size_t end, size_t field);
+static void sprint_label(size_t i, char *str, size_t sz);
+
+void metrics_init(int nworkers)
+{
+    nslots = nworkers;
+    rcu_register(&reader);
+}
+
+// p's per worker slots, made by the first worker to dial it so proxies of
+// a long list that never get picked cost nothing. NULL without metrics or
+// when memory ran out, the connection just goes uncounted
+proxy_stats *metrics_stats(proxy_info *p)
+{
+    proxy_stats *s = atomic_load_explicit(&p->stats, memory_order_acquire);
+    if (s || nslots == 0) return s;
+
+    if ((s = aligned_alloc(_Alignof(proxy_stats), sizeof(proxy_stats[nslots]))) == NULL)
+        return NULL;
+    memset(s, 0, sizeof(proxy_stats[nslots]));
+
+    proxy_stats *cur = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&p->stats, &cur, s, memory_order_acq_rel, memory_order_acquire)) {
+        free(s);
+        return cur;
+    }
+    return s;
+}
+
+void metrics_add(atomic_ullong *v, unsigned long long n)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_observe(atomic_ullong *hist, atomic_ullong *sum, long long us)
+{
+    int i = 0;
+    while (i < METRICS_BUCKETS && us > buckets[i]) i++;
+    metrics_add(&hist[i], 1);
+    metrics_add(sum, us);
+}
+
+void metrics_start(int fd)
+{
+    listenfd = fd;
+
+    stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stopfd == -1) die("eventfd:");
+
+    if (pthread_create(&thread, NULL, &metrics_run, NULL) != 0)
+        die("pthread_create:");
+}
+
+void metrics_stop(void)
+{
+    if (stopfd == -1) return;
+
+    uint64_t one = 1;
+    write(stopfd, &one, sizeof(one));
+    pthread_join(thread, NULL);
+    close(stopfd);
+    close(listenfd);
+    stopfd = listenfd = -1;
+}
+
+// scrapes are rare and tiny, one at a time is plenty
+static void *metrics_run(void *arg)
+{
+    (void)arg;
+    struct pollfd fds[2] = {
+        {.fd = stopfd, .events = POLLIN},
+        {.fd = listenfd, .events = POLLIN},
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            tdie("poll:");
+        }
+
+        if (fds[0].revents) return NULL;
+
+        int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) continue;
+        metrics_serve(fd);
+        close(fd);
+    }
+}
+
+static void metrics_serve(int fd)
+{
+    struct timeval tv = {.tv_sec = METRICS_IO_TIMEOUT / 1000, .tv_usec = METRICS_IO_TIMEOUT % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // the request itself doesn't matter, every path gets the metrics
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char req[4096];
+    if (poll(&pfd, 1, METRICS_IO_TIMEOUT) != 1 || recv(fd, req, sizeof(req), 0) <= 0)
+        return;
+
+    char *body = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&body, &len);
+    if (f == NULL) return;
+    set = proxy_set_snapshot(&proxies, &reader);
+    if (metrics_order() == 0) metrics_write(f);
+    proxy_set_put(set);
+    free(order);
+    free(ids);
+    order = NULL;
+    ids = NULL;
+    fclose(f);
+
+    char head[256];
+    int hlen = snprintf(head, sizeof(head),
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n", len);
+
+    size_t off = 0;
+    if (send_exact(fd, head, hlen, &off) == 0) {
+        off = 0;
+        send_exact(fd, body, len, &off);
+    }
+
+    free(body);
+}
+
+#define FIELD(f) offsetof(proxy_stats, f)
+
+static void metrics_write(FILE *f)
+{
+    char label[4096];
+
+    fputs("# HELP proxyrot_connections_total Upstream connections dialed.\n"
+          "# TYPE proxyrot_connections_total counter\n", f);
+    for (size_t i = 0, end; i < set->len; i = end) {
+        end = series_end(i);
+        sprint_label(i, label, sizeof(label));
+        fprintf(f, "proxyrot_connections_total{%s} %llu\n", label, total(i, end, FIELD(conns)));
+    }
+
+    fputs("# HELP proxyrot_failures_total Upstream connections that failed, by phase.\n"
+          "# TYPE proxyrot_failures_total counter\n", f);
+    for (size_t i = 0, end; i < set->len; i = end) {
+        end = series_end(i);
+        sprint_label(i, label, sizeof(label));
+        for (int p = 0; p < METRICS_NFAILS; p++)
+            fprintf(f, "proxyrot_failures_total{%s,phase=\"%s\"} %llu\n",
+                    label, fail_phases[p], total(i, end, FIELD(fails[p])));
+    }
+
+    fputs("# HELP proxyrot_bytes_total Bytes relayed through tunnels.\n"
+          "# TYPE proxyrot_bytes_total counter\n", f);
+    for (size_t i = 0, end; i < set->len; i = end) {
+        end = series_end(i);
+        sprint_label(i, label, sizeof(label));
+        fprintf(f, "proxyrot_bytes_total{%s,direction=\"up\"} %llu\n", label, total(i, end, FIELD(bytes_up)));
+        fprintf(f, "proxyrot_bytes_total{%s,direction=\"down\"} %llu\n", label, total(i, end, FIELD(bytes_down)));
+    }
+
+    fputs("# HELP proxyrot_active_tunnels Tunnels currently relaying.\n"
+          "# TYPE proxyrot_active_tunnels gauge\n", f);
+    for (size_t i = 0, end; i < set->len; i = end) {
+        end = series_end(i);
+        sprint_label(i, label, sizeof(label));
+        fprintf(f, "proxyrot_active_tunnels{%s} %lld\n", label, (long long)total(i, end, FIELD(active)));
+    }
+
+    fputs("# HELP proxyrot_up Whether the proxy is in rotation.\n"
+          "# TYPE proxyrot_up gauge\n", f);
+    for (size_t i = 0, end; i < set->len; i = end) {
+        end = series_end(i);
+        sprint_label(i, label, sizeof(label));
+        fprintf(f, "proxyrot_up{%s} %d\n", label,
+                !atomic_load_explicit(&set->proxies[order[i]]->down, memory_order_relaxed));
+    }
+
+    fputs("# HELP proxyrot_connect_seconds Time to establish the TCP connection to the proxy.\n"
+          "# TYPE proxyrot_connect_seconds histogram\n", f);
+    for (size_t i = 0, end; i < set->len; i = end) {
+        end = series_end(i);
+        sprint_label(i, label, sizeof(label));
+        write_histogram(f, "proxyrot_connect_seconds", label, i, end, FIELD(connect), FIELD(connect_sum));
+    }
+
+    fputs("# HELP proxyrot_handshake_seconds Time to negotiate auth and the whole chain.\n"
+          "# TYPE proxyrot_handshake_seconds histogram\n", f);
+    for (size_t i = 0, end; i < set->len; i = end) {
+        end = series_end(i);
+        sprint_label(i, label, sizeof(label));
+        write_histogram(f, "proxyrot_handshake_seconds", label, i, end, FIELD(handshake), FIELD(handshake_sum));
+    }
+
+    fprintf(f, "# HELP proxyrot_log_dropped_total Log records lost to full log rings.\n"
+               "# TYPE proxyrot_log_dropped_total counter\n"
+               "proxyrot_log_dropped_total %llu\n", log_dropped());
+}
+
+// sorts the set's indexes by proxy_id(). series are named after what the
+// entries are rather than where they sit in the list, so they carry on
+// across reloads, and identical lines add up into one
+static int metrics_order(void)
+{
+    order = malloc(sizeof(size_t[set->len ? set->len : 1]));
+    ids = malloc(sizeof(uint64_t[set->len ? set->len : 1]));
+    if (order == NULL || ids == NULL) return -1;
+
+    for (size_t i = 0; i < set->len; i++) {
+        order[i] = i;
+        ids[i] = proxy_id(set->proxies[i]);
+    }
+    qsort(order, set->len, sizeof(size_t), &order_cmp);
+    return 0;
+}
+
+// by id, then by record so a record listed twice sits next to itself
+static int order_cmp(const void *a, const void *b)
+{
+    size_t i = *(const size_t *)a, j = *(const size_t *)b;
+    if (ids[i] != ids[j]) return ids[i] < ids[j] ? -1 : 1;
+    uintptr_t p = (uintptr_t)set->proxies[i], q = (uintptr_t)set->proxies[j];
+    return (p > q) - (p < q);
+}
+
+// one past the last position of order in the series starting at i
+static size_t series_end(size_t i)
+{
+    size_t end = i + 1;
+    while (end < set->len && ids[order[end]] == ids[order[i]]) end++;
+    return end;
+}
+
+static void write_histogram(FILE *f, const char *name, const char *label, size_t i, size_t end,
+                            size_t hist, size_t sum)
+{
+    unsigned long long count = 0;
+
+    for (int b = 0; b <= METRICS_BUCKETS; b++) {
+        count += total(i, end, hist + b * sizeof(atomic_ullong));
+        if (b < METRICS_BUCKETS)
+            fprintf(f, "%s_bucket{%s,le=\"%g\"} %llu\n", name, label, buckets[b] / 1e6, count);
+        else
+            fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, label, count);
+    }
+
+    fprintf(f, "%s_sum{%s} %g\n", name, label, total(i, end, sum) / 1e6);
+    fprintf(f, "%s_count{%s} %llu\n", name, label, count);
+}
+
+// sums one counter over every worker and every record of a series
+static unsigned long long total(size_t i, size_t end, size_t field)
+{
+    unsigned long long v = 0;
+
+    for (size_t k = i; k < end; k++) {
+        proxy_info *p = set->proxies[order[k]];
+        if (k > i && p == set->proxies[order[k - 1]]) continue;
+
+        proxy_stats *s = atomic_load_explicit(&p->stats, memory_order_acquire);
+        for (int w = 0; s && w < nslots; w++)
+            v += atomic_load_explicit((atomic_ullong *)((char *)&s[w] + field), memory_order_relaxed);
+    }
+
+    return v;
+}
+
+// the id keeps entries through the same proxies with other credentials
+// apart, prometheus rejects repeated series
+static void sprint_label(size_t i, char *str, size_t sz)
+{
+    char raw[2048];
+    sprint_proxy(set->proxies[order[i]], raw, sizeof(raw));
+
+    size_t j = snprintf(str, sz, "id=\"%016llx\",proxy=\"", (unsigned long long)ids[order[i]]);
+    for (char *s = raw; *s && j + 3 < sz; s++) {
+        if (*s == '"' || *s == '\\') str[j++] = '\\';
+        str[j++] = *s;
+    }
+    str[j++] = '"';
+    str[j] = 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "rotation.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define METRICS_FAIL_CONNECT 0
+#define METRICS_FAIL_AUTH    1
+#define METRICS_FAIL_CHAIN   2
+#define METRICS_NFAILS       3
+
+// latency histogram upper bounds, in microseconds
+#define METRICS_BUCKETS 13
+
+// one proxy's counters as seen by one worker. only that worker writes
+// them, so updates are plain relaxed load + store, no locked instructions
+typedef struct proxy_stats {
+    _Alignas(64) atomic_ullong conns;     // upstream connections dialed
+    atomic_ullong fails[METRICS_NFAILS];
+    atomic_ullong bytes_up, bytes_down;
+    atomic_ullong active;                 // wraps below 0, sums right across workers
+    atomic_ullong connect[METRICS_BUCKETS + 1], connect_sum;
+    atomic_ullong handshake[METRICS_BUCKETS + 1], handshake_sum;
+} proxy_stats;
+
+void metrics_init(int nworkers);
+proxy_stats *metrics_stats(proxy_info *p);
+void metrics_start(int listenfd);
+void metrics_stop(void);
+void metrics_add(atomic_ullong *v, unsigned long long n);
+void metrics_observe(atomic_ullong *hist, atomic_ullong *sum, long long us);
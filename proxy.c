@@ -1,165 +1,417 @@
 #define _GNU_SOURCE
 #include "proxy.h"
+#include "dns.h"
 #include "socks5.h"
+#include "tcp.h"
 #include "util.h"
+#include <arpa/inet.h>
 #include <ctype.h>
-#include <netdb.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-static int is_str_number(const char *str);
-static int parse_identifier(const char *str, char **field, char **endptr);
-static size_t get_identifier_len(const char *str, char **startptr);
+static const char *protos[] = {"socks5", "socks5h"};
 
-static int is_str_number(const char *str) {
-    while (*str) {
-        if (!isdigit(*str++)) return 0;
-    }
-    return 1;
-}
+static size_t next_token(const char **s, const char *end);
+static bool is_port(const char *str, size_t len);
+static int scan_option(const char *s, size_t len, proxy_opts *opts);
+static bool scan_number(const char *s, size_t len, unsigned long *v);
+static bool proxy_literal(proxy_info *p);
+static void hop_of(const proxy_info *p, proxy_hop *h);
+static bool hop_equal(const proxy_hop *a, const proxy_hop *b);
+static bool field_equal(const char *a, size_t alen, const char *b, size_t blen);
+static uint32_t fnv_field(uint32_t h, const char *s, size_t len);
 
-int proxy_connect(const proxy_info *proxy, int timeout)
+int proxy_connect(const proxy_info *proxy)
 {
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = AI_PASSIVE;
+    struct sockaddr_storage addr;
+    socklen_t len;
 
-    if (getaddrinfo(proxy->host, proxy->port, &hints, &res) != 0)
+    int fd = proxy_socket(proxy, &addr, &len);
+    if (fd == -1) return -1;
+
+    if (connect(fd, (struct sockaddr*)&addr, len) != 0 && errno != EINPROGRESS) {
+        close(fd);
         return -1;
+    }
 
-    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (fd == -1) goto free_err;
+    return fd;
+}
 
-    set_sock_timeout(fd, timeout);
+// a non-blocking socket for proxy and the address to connect it to, for
+// callers that connect it themselves
+int proxy_socket(const proxy_info *proxy, struct sockaddr_storage *addr, socklen_t *len)
+{
+    dns_addr res;
 
-    if (connect(fd, res->ai_addr, res->ai_addrlen) != 0) goto close_err;
+    if (proxy->dns) {
+        if (dns_lookup(proxy->dns, &res) != 0)
+            return -1;
+        memcpy(addr, &res.addr, res.addrlen);
+        *len = res.addrlen;
+    } else {
+        *len = proxy->addr.sa.sa_family == AF_INET6 ? sizeof(proxy->addr.in6) : sizeof(proxy->addr.in);
+        memcpy(addr, &proxy->addr, *len);
+    }
 
-    freeaddrinfo(res);
+    int fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd != -1 && tcp_dialing(fd) != 0) {
+        close(fd);
+        return -1;
+    }
     return fd;
-
-close_err:
-    close(fd);
-free_err:
-    freeaddrinfo(res);
-    return -1;
 }
 
-int parse_proxy_info(const char *line, proxy_info *p)
+// splits one line of a proxy list into hops pointing into it, *hops grows
+// as needed, and its options into opts. returns how many hops, 0 for blank
+// and comment lines and -1 when the line is malformed
+int proxy_scan(const char *line, const char *end, proxy_hop **hops, size_t *cap, proxy_opts *opts)
 {
-    memset(p, 0, sizeof(*p));
-    char *tmp = (char*)line;
-    proxy_info *current_proxy = p;
+    const char *s = line;
+    size_t n = 0, len = next_token(&s, end);
+    *opts = (proxy_opts){.weight = 1};
+    if (len == 0 || *s == '#') return 0;
 
     for (;;) {
-        int r = parse_identifier(tmp, &current_proxy->proto, &tmp);
-        if (r != 0 || current_proxy->proto == NULL) goto err;
-        if (!is_supported_proto(current_proxy->proto)) goto err;
-
-        r = parse_identifier(tmp, &current_proxy->host, &tmp);
-        if (r != 0 || current_proxy->host == NULL) goto err;
-
-        r = parse_identifier(tmp, &current_proxy->port, &tmp);
-        if (r != 0 || current_proxy->port == NULL) goto err;
-        if (!is_str_number(current_proxy->port)) goto err;
-
-        if (strncmp(current_proxy->proto, "socks5", 6) == 0) {
-            if (get_identifier_len(tmp, &tmp) != 0 && *tmp == '|')
-                goto next_chain_proxy;
-            r = parse_identifier(tmp, &current_proxy->user, &tmp);
-            if (r != 0) goto err;
-
-            if (get_identifier_len(tmp, &tmp) != 0 && *tmp == '|')
-                goto next_chain_proxy;
-            r = parse_identifier(tmp, &current_proxy->pass, &tmp);
-            if (r != 0) goto err;
+        if (n == *cap) {
+            *cap = *cap ? *cap * 2 : 4;
+            *hops = realloc(*hops, sizeof(proxy_hop[*cap]));
+            if (*hops == NULL) die("realloc:");
         }
 
-        if (get_identifier_len(tmp, &tmp) == 0 || *tmp == '#')
-            return 0;
+        proxy_hop *h = &(*hops)[n++];
+        memset(h, 0, sizeof(*h));
+
+        len = next_token(&s, end);
+        if ((h->proto = proxy_proto_from_str(s, len)) == -1) return -1;
+        s += len;
 
-next_chain_proxy:
+        h->hostlen = next_token(&s, end);
+        h->host = s;
+        s += h->hostlen;
+        if (h->hostlen == 0) return -1;
 
-        if (*tmp == '|') {
-            current_proxy->chain = calloc(1, sizeof(*current_proxy));
-            if (current_proxy->chain == NULL) goto err;
-            current_proxy = current_proxy->chain;
-            tmp++;
-            continue;
+        h->portlen = next_token(&s, end);
+        h->port = s;
+        s += h->portlen;
+        if (!is_port(h->port, h->portlen)) return -1;
+
+        // user and pass are optional, a token starting with | is the next hop
+        // and options may come in between
+        while ((len = next_token(&s, end)) != 0 && *s != '|' && !(*s == '#' && h->pass)) {
+            int r = scan_option(s, len, opts);
+            if (r == -1) return -1;
+            if (r == 0) {
+                if (h->pass) return -1;
+                if (h->user) {
+                    h->pass = s;
+                    h->passlen = len;
+                } else {
+                    h->user = s;
+                    h->userlen = len;
+                }
+            }
+            s += len;
         }
 
-        goto err;
+        if (len == 0 || *s == '#') return n;
+        s++;
+    }
+}
+
+// 1 when [s, s+len) is a key=value option, stored in opts, 0 when it is
+// something else and -1 when its value is out of range
+static int scan_option(const char *s, size_t len, proxy_opts *opts)
+{
+    static const char weight[] = "weight=", max_conns[] = "max_conns=", pool[] = "pool=";
+    unsigned long v;
+
+    if (len >= sizeof(weight) - 1 && memcmp(s, weight, sizeof(weight) - 1) == 0) {
+        if (!scan_number(s + sizeof(weight) - 1, len - (sizeof(weight) - 1), &v)) return -1;
+        if (v == 0 || v > PROXY_MAX_WEIGHT) return -1;
+        opts->weight = v;
+        return 1;
+    }
+
+    if (len >= sizeof(max_conns) - 1 && memcmp(s, max_conns, sizeof(max_conns) - 1) == 0) {
+        if (!scan_number(s + sizeof(max_conns) - 1, len - (sizeof(max_conns) - 1), &v)) return -1;
+        if (v == 0 || v > UINT_MAX) return -1;
+        opts->max_conns = v;
+        return 1;
+    }
+
+    if (len >= sizeof(pool) - 1 && memcmp(s, pool, sizeof(pool) - 1) == 0) {
+        if (len == sizeof(pool) - 1) return -1;
+        opts->pool = s + sizeof(pool) - 1;
+        opts->poollen = len - (sizeof(pool) - 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+static bool scan_number(const char *s, size_t len, unsigned long *v)
+{
+    if (len == 0 || len > 10) return false;
+
+    *v = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)s[i])) return false;
+        *v = *v * 10 + s[i] - '0';
+    }
+    return true;
+}
+
+// copies the hops of a scanned line into a's records. only the first hop
+// is dialed by us, the rest resolve upstream
+proxy_info *proxy_build(arena *a, const proxy_hop *hops, size_t n, const proxy_opts *opts)
+{
+    proxy_info *first = NULL, **link = &first;
+
+    for (size_t i = 0; i < n; i++) {
+        proxy_info *p = arena_alloc(a, sizeof(*p));
+        p->arena = a;
+        p->proto = hops[i].proto;
+        p->host = arena_intern(a, hops[i].host, hops[i].hostlen);
+        p->port = arena_intern(a, hops[i].port, hops[i].portlen);
+        if (hops[i].user) p->user = arena_intern(a, hops[i].user, hops[i].userlen);
+        if (hops[i].pass) p->pass = arena_intern(a, hops[i].pass, hops[i].passlen);
+        *link = p;
+        link = &p->chain;
+    }
+
+    if (!proxy_literal(first))
+        first->dns = dns_cache_get(first->host, first->port);
+    atomic_init(&first->refs, 1);
+    proxy_configure(first, opts);
+    return first;
+}
+
+// options aren't part of an entry's identity, a reload that keeps the
+// entry updates them in place
+void proxy_configure(proxy_info *p, const proxy_opts *opts)
+{
+    atomic_store_explicit(&p->weight, opts->weight, memory_order_relaxed);
+    atomic_store_explicit(&p->max_conns, opts->max_conns, memory_order_relaxed);
+}
+
+// counts a client connection against p, unless p is at max_conns
+bool proxy_acquire(proxy_info *p)
+{
+    unsigned max = atomic_load_explicit(&p->max_conns, memory_order_relaxed);
+    if (max == 0) {
+        atomic_fetch_add_explicit(&p->inflight, 1, memory_order_relaxed);
+        return true;
+    }
+
+    unsigned n = atomic_load_explicit(&p->inflight, memory_order_relaxed);
+    do {
+        if (n >= max) return false;
+    } while (!atomic_compare_exchange_weak_explicit(&p->inflight, &n, n + 1, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+void proxy_release(proxy_info *p)
+{
+    atomic_fetch_sub_explicit(&p->inflight, 1, memory_order_relaxed);
+}
+
+bool proxy_full(const proxy_info *p)
+{
+    unsigned max = atomic_load_explicit(&p->max_conns, memory_order_relaxed);
+    return max && atomic_load_explicit(&p->inflight, memory_order_relaxed) >= max;
+}
+
+// literal addresses are kept in the record, only names go through the cache
+static bool proxy_literal(proxy_info *p)
+{
+    uint16_t port = htons(atoi(p->port));
+
+    if (inet_pton(AF_INET, p->host, &p->addr.in.sin_addr) == 1) {
+        p->addr.in.sin_family = AF_INET;
+        p->addr.in.sin_port = port;
+        return true;
+    }
+
+    if (inet_pton(AF_INET6, p->host, &p->addr.in6.sin6_addr) == 1) {
+        p->addr.in6.sin6_family = AF_INET6;
+        p->addr.in6.sin6_port = port;
+        return true;
+    }
+
+    return false;
+}
+
+void proxy_ref(proxy_info *p)
+{
+    atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
+}
+
+// the last reference hands p (and its chain) back to its arena
+void proxy_unref(proxy_info *p)
+{
+    if (atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (p->dns) dns_cache_put(p->dns);
+    free(atomic_load_explicit(&p->stats, memory_order_relaxed));
+    free(p->warm);
+    arena_release(p->arena);
+}
+
+// whether p was built from a line scanned into hops
+bool proxy_matches(const proxy_info *p, const proxy_hop *hops, size_t n)
+{
+    proxy_hop h;
+    size_t i = 0;
+
+    for (; p && i < n; p = p->chain, i++) {
+        hop_of(p, &h);
+        if (!hop_equal(&h, &hops[i])) return false;
+    }
+    return p == NULL && i == n;
+}
+
+uint32_t proxy_hash(const proxy_info *p)
+{
+    proxy_hop h;
+    hop_of(p, &h);
+    return proxy_hop_hash(&h);
+}
+
+// fnv-1a over every hop and its credentials, wide enough that a list of
+// millions has no two entries sharing one by chance
+uint64_t proxy_id(const proxy_info *p)
+{
+    uint64_t h = 14695981039346656037ull;
+
+    for (; p; p = p->chain) {
+        const char *fields[] = {protos[p->proto], p->host, p->port, p->user ? p->user : "", p->pass ? p->pass : ""};
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            for (const char *s = fields[i]; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ull;
+            h = (h ^ ' ') * 1099511628211ull;
+        }
+        h = (h ^ '|') * 1099511628211ull;
     }
 
-err:
-    free_proxy_info(p);
+    return h;
+}
+
+// fnv-1a over the first hop, enough to spread a proxy list
+uint32_t proxy_hop_hash(const proxy_hop *h)
+{
+    const char *proto = protos[h->proto];
+    uint32_t r = fnv_field(2166136261u, proto, strlen(proto));
+    r = fnv_field(r, h->host, h->hostlen);
+    r = fnv_field(r, h->port, h->portlen);
+    r = fnv_field(r, h->user, h->userlen);
+    return fnv_field(r, h->pass, h->passlen);
+}
+
+int proxy_proto_from_str(const char *str, size_t len)
+{
+    for (int i = 0; i < (int)(sizeof(protos) / sizeof(protos[0])); i++)
+        if (strlen(protos[i]) == len && memcmp(str, protos[i], len) == 0)
+            return i;
     return -1;
 }
 
-void free_proxy_info(proxy_info *p)
+const char *proxy_proto_name(int proto)
+{
+    return protos[proto];
+}
+
+// moves *s to the next whitespace delimited token of [*s, end) and returns
+// its length, 0 at the end of the line
+static size_t next_token(const char **s, const char *end)
 {
-    if (p->chain) {
-        free_proxy_info(p->chain);
-        free(p->chain);
+    const char *p = *s;
+    while (p < end && (*p == 0 || isspace((unsigned char)*p))) p++;
+    *s = p;
+    while (p < end && *p != 0 && !isspace((unsigned char)*p)) p++;
+    return p - *s;
+}
+
+static bool is_port(const char *str, size_t len)
+{
+    if (len == 0 || len > 5) return false;
+
+    long port = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)str[i])) return false;
+        port = port * 10 + str[i] - '0';
     }
-    if (p->host)  free(p->host);
-    if (p->port)  free(p->port);
-    if (p->user)  free(p->user);
-    if (p->pass)  free(p->pass);
-    if (p->proto) free(p->proto);
-    p->chain = NULL;
-    p->host = p->port = p->user = p->pass = p->proto = NULL;
+    return port <= 65535;
 }
 
-static int parse_identifier(const char *str, char **field, char **endptr)
+static void hop_of(const proxy_info *p, proxy_hop *h)
 {
-    char *tmp;
-    size_t idlen = get_identifier_len(str, &tmp);
-    if (idlen == 0) return 0;
-    char *id = strndup(tmp, idlen);
-    if (id == NULL) return -1;
-    *field = id;
-    if (endptr) *endptr = tmp + idlen;
-    return 0;
+    h->proto = p->proto;
+    h->host = p->host;
+    h->port = p->port;
+    h->user = p->user;
+    h->pass = p->pass;
+    h->hostlen = strlen(p->host);
+    h->portlen = strlen(p->port);
+    h->userlen = p->user ? strlen(p->user) : 0;
+    h->passlen = p->pass ? strlen(p->pass) : 0;
 }
 
-static size_t get_identifier_len(const char *str, char **startptr)
+static bool hop_equal(const proxy_hop *a, const proxy_hop *b)
 {
-    size_t r = 0;
-    while (isspace(*str)) str++;
-    if (startptr) *startptr = (char*)str;
-    while (*str && !isspace(*str++)) r++;
-    return r;
+    return a->proto == b->proto &&
+           field_equal(a->host, a->hostlen, b->host, b->hostlen) &&
+           field_equal(a->port, a->portlen, b->port, b->portlen) &&
+           field_equal(a->user, a->userlen, b->user, b->userlen) &&
+           field_equal(a->pass, a->passlen, b->pass, b->passlen);
 }
 
-int is_supported_proto(const char *proto)
+static bool field_equal(const char *a, size_t alen, const char *b, size_t blen)
 {
-    if (strcmp(proto, "socks5")  == 0) return 1;
-    if (strcmp(proto, "socks5h") == 0) return 1;
-    return 0;
+    return alen == blen && (alen == 0 || memcmp(a, b, alen) == 0);
+}
+
+static uint32_t fnv_field(uint32_t h, const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return (h ^ ' ') * 16777619u;
+}
+
+void proxy_negotiation_init(negotiation *n, proxy_info *proxy, bool pipeline, const unsigned char *req, size_t reqlen)
+{
+    socks5_negotiation_init(n, proxy, pipeline, req, reqlen);
 }
 
-int proxy_chain(proxy_info *proxy, int pfd)
+int proxy_negotiate(negotiation *n, int pfd)
 {
-    return socks5_chain(proxy, pfd);
+    return socks5_negotiate(n, pfd);
 }
 
-int proxy_auth(proxy_info *proxy, int pfd)
+// whether a failed negotiation broke while chaining to n->cur->chain
+// rather than while authenticating with n->cur
+int proxy_negotiation_chaining(const negotiation *n)
 {
-    return socks5_auth(proxy, pfd);
+    return n->state == SOCKS5_CONNECT || n->state == SOCKS5_CONNECT_REPLY;
 }
 
-int proxy_handler(proxy_info *proxy, int cfd, int pfd)
+// folds a sample into the EWMA with a weight of 1/8. concurrent updates
+// may drop a sample, which is fine for a moving average
+void proxy_latency(proxy_info *proxy, long long us)
 {
-    return socks5_handler(proxy, cfd, pfd);
+    if (us > UINT_MAX) us = UINT_MAX;
+    long long old = atomic_load_explicit(&proxy->latency, memory_order_relaxed);
+    long long v = old == 0 ? us : old + (us - old) / 8;
+    atomic_store_explicit(&proxy->latency, v ? v : 1, memory_order_relaxed);
 }
 
 void sprint_proxy(proxy_info *proxy, char *str, size_t sz)
 {
-    size_t written = snprintf(str, sz, "%s %s:%s", proxy->proto, proxy->host, proxy->port);
+    size_t written = snprintf(str, sz, "%s %s:%s", proxy_proto_name(proxy->proto), proxy->host, proxy->port);
     if (written >= sz) return;
 
     if (proxy->chain) {
@@ -1,22 +1,94 @@
 #pragma once
 
+#include "arena.h"
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#define PROXY_SOCKS5  0
+#define PROXY_SOCKS5H 1
+
+#define PROXY_MAX_WEIGHT 65535
+
+// ver + ulen + max uname + plen + max passwd, the largest handshake message
+#define NEG_BUFSZ (1 + 1 + 255 + 1 + 255)
+// greeting + userpass + CONNECT sent back to back when pipelining
+#define NEG_PIPELINE_BUFSZ (4 + NEG_BUFSZ + 5 + 255 + 2)
+
+// a fixed size record living in the arena of the load that parsed it, its
+// strings are interned there too
 typedef struct proxy_info {
-    char *proto;
-    char *host;
-    char *port;
-    char *user;
-    char *pass;
+    const char *host;
+    const char *port;
+    const char *user;
+    const char *pass;
     struct proxy_info *chain;
-    struct proxy_info *next;
+    struct dns_entry *dns;         // NULL when host is a literal address
+    _Atomic(struct proxy_stats *) stats; // one slot per worker, NULL until first dialed
+    struct warm_pool *warm;        // one pool per worker, NULL without -W
+    arena *arena;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } addr;                        // the literal address, first hop only
+    atomic_uint refs;              // proxy sets and connections holding it
+    atomic_uint inflight;          // client connections using it
+    atomic_uint latency;           // connect + handshake EWMA, in microseconds
+    atomic_uint weight;            // share of picks, 1 by default
+    atomic_uint max_conns;         // cap on inflight, 0 for none
+    atomic_bool retired;           // dropped from the proxy set by a reload
+    atomic_bool down;              // set by the health checker
+    unsigned char proto;
+    unsigned char fails, oks;      // health checker streaks
 } proxy_info;
 
+// one hop of a proxy list line, the fields point into the line
+typedef struct proxy_hop {
+    int proto;
+    const char *host, *port, *user, *pass;
+    size_t hostlen, portlen, userlen, passlen;
+} proxy_hop;
+
+// per entry options, written as key=value anywhere on its line
+typedef struct proxy_opts {
+    unsigned weight;
+    unsigned max_conns;
+    const char *pool;              // comma separated pool names, NULL for none
+    size_t poollen;
+} proxy_opts;
+
+// resumable upstream handshake (auth + chain), driven over a non-blocking fd
+typedef struct negotiation {
+    proxy_info *cur;
+    int state;
+    bool pipeline;
+    const unsigned char *req;      // follows the exit hop's greeting, NULL for none
+    size_t reqlen;
+    size_t off, len;
+    unsigned char buf[NEG_PIPELINE_BUFSZ];
+} negotiation;
+
 void sprint_proxy(proxy_info *proxy, char *str, size_t sz);
-int is_supported_proto(const char *proto);
-int parse_proxy_info(const char *line, proxy_info *p);
-void free_proxy_info(proxy_info *p);
-int proxy_connect(const proxy_info *proxy, int timeout);
-int proxy_auth(proxy_info *proxy, int pfd);
-int proxy_chain(proxy_info *proxy, int pfd);
-int proxy_handler(proxy_info *proxy, int cfd, int pfd);
+int proxy_proto_from_str(const char *str, size_t len);
+const char *proxy_proto_name(int proto);
+int proxy_scan(const char *line, const char *end, proxy_hop **hops, size_t *cap, proxy_opts *opts);
+proxy_info *proxy_build(arena *a, const proxy_hop *hops, size_t n, const proxy_opts *opts);
+void proxy_configure(proxy_info *p, const proxy_opts *opts);
+bool proxy_acquire(proxy_info *p);
+void proxy_release(proxy_info *p);
+bool proxy_full(const proxy_info *p);
+void proxy_ref(proxy_info *p);
+void proxy_unref(proxy_info *p);
+bool proxy_matches(const proxy_info *p, const proxy_hop *hops, size_t n);
+uint32_t proxy_hash(const proxy_info *p);
+uint64_t proxy_id(const proxy_info *p);
+uint32_t proxy_hop_hash(const proxy_hop *h);
+int proxy_connect(const proxy_info *proxy);
+int proxy_socket(const proxy_info *proxy, struct sockaddr_storage *addr, socklen_t *len);
+void proxy_negotiation_init(negotiation *n, proxy_info *proxy, bool pipeline, const unsigned char *req, size_t reqlen);
+int proxy_negotiate(negotiation *n, int pfd);
+int proxy_negotiation_chaining(const negotiation *n);
+void proxy_latency(proxy_info *proxy, long long us);
@@ -1,18 +1,28 @@
 #define _GNU_SOURCE
+#include "proxyrot.h"
+#include "dns.h"
+#include "health.h"
+#include "log.h"
+#include "metrics.h"
 #include "proxy.h"
-#include "socks5.h"
+#include "rotation.h"
+#include "tcp.h"
+#include "users.h"
 #include "util.h"
-#include <arpa/inet.h>
-#include <ctype.h>
+#include "worker.h"
 #include <errno.h>
 #include <getopt.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -21,62 +31,117 @@
 #define ADDR "127.0.0.1"
 #define WORKERS 8
 #define TIMEOUT 10
-
-#define FLAG_NO_AUTH       (1 << 0)
-#define FLAG_USERPASS_AUTH (1 << 1)
+#define BACKLOG 4096
+#define DNS_TTL 60
+#define WARM_IDLE 10
+#define RACE_DELAY 200
+// quiet period after a file change before reloading
+#define WATCH_SETTLE_MS 200
 
 char *server_pass;
 char *server_user;
 bool retry = false;
+bool splice_relay = false;
+bool pipeline = false;
+bool reuseport = false;
+bool watch = false;
+bool affinity = false;
+bool use_uring = false;
 int timeout;
+int connect_timeout;
+int hop_timeout;
+int client_timeout;
+int idle_timeout;
 int nworkers;
-int run;
-int serverfd;
+int backlog;
+int dns_ttl;
+int warm_min;
+int warm_max;
+int warm_idle;
+int health_interval;
+int race;
+int race_delay;
+volatile sig_atomic_t run;
+int *serverfds;
+int *resolvefds;
+int wakefd = -1;
+int reloadfd = -1;
+int watchfd = -1;
+int *proxy_wds;
+int users_wd = -1;
 int server_flags;
-proxy_info *current_proxy;
-proxy_info *proxies;
-proxy_info *proxies_tail;
-pthread_mutex_t proxies_lock;
+int rotation = ROTATION_ROUNDROBIN;
+_Atomic(proxy_set *) proxies;
+_Atomic(user_table *) users;
+char **proxy_files;
+size_t nproxy_files;
+char *users_file;
 pthread_t *threads;
+worker *workers;
 
 static int create_server(const char *host, const char *port, int backlog);
-static proxy_info *get_next_proxy(void);
-static void load_proxy_file(const char *path);
 static void cleanup(void);
 static void int_handler(int sig);
+static void hup_handler(int sig);
+static void proxies_prepare(proxy_set *s);
+static void reload(void);
+static void reload_proxies(void);
+static void reload_users(void);
+static void watch_add(void);
+static void watch_settle(bool *proxies_changed, bool *users_changed);
 static void usage(int argc, char **argv);
-static void *work(void *arg);
 
 int main(int argc, char **argv)
 {
     setlinebuf(stdout);
     setlinebuf(stderr);
 
-    if (pthread_mutex_init(&proxies_lock, NULL) != 0)
-        die("pthread_mutex_init:");
-
-    proxies_tail = proxies;
-
     char *addr = ADDR, *port = PORT;
+    char *metrics_addr = NULL;
     int opt;
     nworkers = WORKERS;
     timeout = TIMEOUT;
+    backlog = BACKLOG;
+    dns_ttl = DNS_TTL;
+    warm_idle = WARM_IDLE;
+    race_delay = RACE_DELAY;
 
     static struct option long_options[] = {
         {"help"    , no_argument      , NULL, 'h'},
         {"version" , no_argument      , NULL, 'v'},
         {"no-auth" , no_argument      , NULL, 'n'},
         {"retry"   , no_argument      , NULL, 'r'},
+        {"splice"  , no_argument      , NULL, 's'},
+        {"reuseport", no_argument     , NULL, 'R'},
+        {"watch"   , no_argument      , NULL, 'F'},
+        {"pipeline", no_argument      , NULL, 'O'},
+        {"affinity", no_argument      , NULL, 'A'},
+        {"io-uring", no_argument      , NULL, 'U'},
+        {"tcp"     , required_argument, NULL, 'T'},
+        {"backlog" , required_argument, NULL, 'b'},
+        {"select"  , required_argument, NULL, 'S'},
+        {"dns-ttl" , required_argument, NULL, 'd'},
+        {"warm"    , required_argument, NULL, 'W'},
+        {"warm-idle", required_argument, NULL, 'i'},
+        {"health"  , required_argument, NULL, 'H'},
+        {"race"    , required_argument, NULL, 'k'},
+        {"metrics" , required_argument, NULL, 'M'},
+        {"log-level", required_argument, NULL, 'L'},
         {"addr"    , required_argument, NULL, 'a'},
         {"port"    , required_argument, NULL, 'p'},
         {"proxies" , required_argument, NULL, 'P'},
         {"userpass", required_argument, NULL, 'u'},
+        {"users"   , required_argument, NULL, 'C'},
         {"workers" , required_argument, NULL, 'w'},
         {"timeout" , required_argument, NULL, 't'},
+        {"connect-timeout", required_argument, NULL, 'c'},
+        {"hop-timeout", required_argument, NULL, 'g'},
+        {"client-timeout", required_argument, NULL, 'l'},
+        {"idle-timeout", required_argument, NULL, 'e'},
         {NULL      , 0                , NULL, 0}
     };
 
-    while((opt = getopt_long(argc, argv, ":hvnra:p:u:w:P:t:", long_options, NULL)) != -1) {
+    while((opt = getopt_long(argc, argv, ":hvnrsROFAUa:p:u:C:w:P:t:b:S:d:W:i:H:k:c:g:l:e:M:L:T:", long_options, NULL)) != -1) {
         switch(opt) {
         case 'u':
             {
@@ -90,8 +155,14 @@ int main(int argc, char **argv)
                 }
             }
             break;
+        case 'C':
+            server_flags |= FLAG_USERPASS_AUTH;
+            users_file = optarg;
+            break;
         case 'P':
-            load_proxy_file(optarg);
+            proxy_files = realloc(proxy_files, sizeof(char *[nproxy_files + 1]));
+            if (proxy_files == NULL) die("realloc:");
+            proxy_files[nproxy_files++] = optarg;
             break;
         case 'v':
             printf("%s %s\n", argv[0], VERSION);
@@ -107,10 +178,89 @@ int main(int argc, char **argv)
             if (timeout <= 0)
                 die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
             break;
+        case 'c':
+            connect_timeout = atoi(optarg);
+            if (connect_timeout <= 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'g':
+            hop_timeout = atoi(optarg);
+            if (hop_timeout <= 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'l':
+            client_timeout = atoi(optarg);
+            if (client_timeout <= 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'e':
+            idle_timeout = atoi(optarg);
+            if (idle_timeout < 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog <= 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'S':
+            rotation = rotation_from_str(optarg);
+            if (rotation == -1)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'd':
+            dns_ttl = atoi(optarg);
+            if (dns_ttl <= 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'W':
+            {
+                char *tmp = strchr(optarg, ':');
+                warm_min = atoi(optarg);
+                warm_max = tmp ? atoi(tmp + 1) : warm_min;
+                if (warm_min < 0 || warm_max <= 0 || warm_min > warm_max)
+                    die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            }
+            break;
+        case 'i':
+            warm_idle = atoi(optarg);
+            if (warm_idle <= 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'H':
+            health_interval = atoi(optarg);
+            if (health_interval <= 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'k':
+            {
+                char *tmp = strchr(optarg, ':');
+                race = atoi(optarg);
+                if (tmp) race_delay = atoi(tmp + 1);
+                if (race <= 0 || race_delay < 0)
+                    die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            }
+            break;
+        case 'T':
+            if (tcp_configure(optarg) != 0)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'L':
+            log_level = log_level_from_str(optarg);
+            if (log_level == -1)
+                die("%s %s is invalid", argv[optind-2], optarg, argv[0]);
+            break;
+        case 'M': metrics_addr = optarg; break;
         case 'n': server_flags |= FLAG_NO_AUTH; break;
         case 'a': addr = optarg; break;
         case 'p': port = optarg; break;
         case 'r': retry = true; break;
+        case 's': splice_relay = true; break;
+        case 'R': reuseport = true; break;
+        case 'O': pipeline = true; break;
+        case 'F': watch = true; break;
+        case 'A': affinity = true; break;
+        case 'U': use_uring = true; break;
         case 'h':
             usage(argc, argv);
             return 0;
@@ -119,11 +269,38 @@ int main(int argc, char **argv)
         }
     }
 
+    // phase deadlines not given fall back to --timeout
+    if (!connect_timeout) connect_timeout = timeout * 1000;
+    if (!hop_timeout) hop_timeout = timeout * 1000;
+    if (!client_timeout) client_timeout = timeout * 1000;
+
     threads = emalloc(sizeof(pthread_t[nworkers]));
+    workers = emalloc(sizeof(worker[nworkers]));
+    serverfds = emalloc(sizeof(int[nworkers]));
+    resolvefds = emalloc(sizeof(int[nworkers]));
+    for (int i = 0; i < nworkers; i++)
+        resolvefds[i] = -1;
+
+    if (metrics_addr)
+        metrics_init(nworkers);
+
+    proxy_set *s = proxy_set_new();
+    for (size_t i = 0; i < nproxy_files; i++)
+        if (proxy_set_load(s, proxy_files[i], NULL) != 0)
+            exit(1);
 
-    if (proxies == NULL)
+    if (s->len == 0)
         die("missing proxies");
 
+    proxies_prepare(s);
+    atomic_store(&proxies, s);
+
+    if (users_file) {
+        user_table *t = user_table_load(users_file);
+        if (t == NULL) exit(1);
+        atomic_store(&users, t);
+    }
+
     if (!(server_flags & (FLAG_NO_AUTH | FLAG_USERPASS_AUTH)))
         die("no auth method provided, exiting\n%s -h for help", argv[0]);
 
@@ -133,27 +310,105 @@ int main(int argc, char **argv)
     if (server_flags & FLAG_USERPASS_AUTH)
         puts("accepting userpass auth");
 
+    if (users_file)
+        printf("loaded %zu users\n", atomic_load(&users)->len);
+
     printf("listening on %s:%s\n", addr, port);
 
-    serverfd = create_server(addr, port, nworkers);
-    if (serverfd == -1) die("create_server:");
+    // with reuseport the kernel spreads connections over one listener per
+    // worker, otherwise every worker shares the first one
+    for (int i = 0; i < nworkers; i++) {
+        if (i > 0 && !reuseport) {
+            serverfds[i] = serverfds[0];
+            continue;
+        }
+        serverfds[i] = create_server(addr, port, backlog);
+        if (serverfds[i] == -1) die("create_server:");
+        if (tcp_listener(serverfds[i], backlog, (client_timeout + 999) / 1000) != 0)
+            die("setsockopt:");
+    }
 
-    if (signal(SIGINT, int_handler) != 0)
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd == -1) die("eventfd:");
+
+    if (signal(SIGINT, int_handler) == SIG_ERR)
+        die("signal:");
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         die("signal:");
 
-    if (signal(SIGPIPE, SIG_IGN) != 0)
+    reloadfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reloadfd == -1) die("eventfd:");
+
+    if (signal(SIGHUP, hup_handler) == SIG_ERR)
         die("signal:");
 
-    proxies_tail->next = proxies;
-    current_proxy = proxies;
+    if (watch) {
+        watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watchfd == -1) die("inotify_init1:");
+        proxy_wds = malloc(nproxy_files * sizeof(*proxy_wds));
+        if (proxy_wds == NULL) die("malloc:");
+        watch_add();
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        resolvefds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (resolvefds[i] == -1) die("eventfd:");
+    }
+
+    log_start();
+    dns_cache_start(dns_ttl);
+    dns_dest_start(resolvefds, nworkers);
+
+    if (health_interval)
+        health_start(health_interval);
+
+    if (metrics_addr) {
+        char *mport = strrchr(metrics_addr, ':');
+        if (mport) *mport++ = 0;
+        int fd = mport ? create_server(metrics_addr, mport, backlog) : create_server(ADDR, metrics_addr, backlog);
+        if (fd == -1) die("create_server:");
+        printf("serving metrics on %s:%s\n", mport ? metrics_addr : ADDR, mport ? mport : metrics_addr);
+        metrics_start(fd);
+    }
+
     run = 1;
 
     for (int i = 0; i < nworkers; i++) {
         printf("starting worker %d\n", i);
-        if (pthread_create(&threads[i], NULL, &work, &serverfd) != 0)
+        worker_init(&workers[i], i, serverfds[i], !reuseport, wakefd, resolvefds[i]);
+        if (pthread_create(&threads[i], NULL, &worker_run, &workers[i]) != 0)
             die("pthread_create:");
     }
 
+    // the main thread only handles reloads from here on
+    struct pollfd fds[3] = {
+        {.fd = wakefd, .events = POLLIN},
+        {.fd = reloadfd, .events = POLLIN},
+        {.fd = watchfd, .events = POLLIN},
+    };
+
+    while (run) {
+        if (poll(fds, 3, -1) == -1) {
+            if (errno == EINTR) continue;
+            die("poll:");
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t n;
+            read(reloadfd, &n, sizeof(n));
+            reload();
+        }
+
+        if (fds[2].revents & POLLIN) {
+            bool proxies_changed = false, users_changed = false;
+            watch_settle(&proxies_changed, &users_changed);
+            if (proxies_changed) reload_proxies();
+            if (users_changed) reload_users();
+            watch_add();
+        }
+    }
+
     for (int i = 0; i < nworkers; i++) {
         if (pthread_join(threads[i], NULL) != 0)
             die("pthread_join:");
@@ -176,7 +431,7 @@ static int create_server(const char *host, const char *port, int backlog)
     if (getaddrinfo(host, port, &hints, &res) != 0)
         return -1;
 
-    int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int sockfd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
     if (sockfd == -1)
         goto error;
 
@@ -213,234 +468,226 @@ static void usage(int argc, char **argv)
         "     -P,--proxies FILE              add proxies from FILE\n"
         "     -n,--no-auth                   allow no auth authentication\n"
         "     -u,--userpass USER:PASS        use USER:PASS as authentication\n"
+        "     -C,--users FILE                accept the logins in FILE, each may be bound\n"
+        "                                    to a pool of proxies\n"
         "     -p,--port PORT                 listen on PORT ("PORT" by default)\n"
         "     -a,--addr ADDR                 bind on ADDR ("ADDR" by default)\n"
         "     -w,--workers WORKERS           number of WORKERS (%d by default)\n"
         "     -t,--timeout SECONDS           set connection timeout (%d by default)\n"
+        "     -c,--connect-timeout MS        upstream connect timeout (--timeout by default)\n"
+        "     -g,--hop-timeout MS            upstream negotiation timeout per chain hop\n"
+        "                                    (--timeout by default)\n"
+        "     -l,--client-timeout MS         client handshake timeout (--timeout by default)\n"
+        "     -e,--idle-timeout MS           close tunnels idle for MS (never by default)\n"
         "     -r,--retry                     if proxy connection fail, try another\n"
-    , argv[0], WORKERS, TIMEOUT);
+        "     -s,--splice                    relay with splice(2) instead of copying\n"
+        "     -R,--reuseport                 give each worker its own listening socket\n"
+        "     -F,--watch                     reload a -P or -C FILE when it changes,\n"
+        "                                    SIGHUP reloads all of them\n"
+        "     -O,--pipeline                  send greeting, auth and CONNECT to each proxy\n"
+        "                                    without waiting for replies (only for proxies\n"
+        "                                    known to accept it)\n"
+        "     -b,--backlog BACKLOG           listen BACKLOG (%d by default)\n"
+        "     -S,--select POLICY             proxy selection POLICY: roundrobin, striped,\n"
+        "                                    leastconn, p2c, latency (roundrobin by default)\n"
+        "     -A,--affinity                  send each client through the same proxy while\n"
+        "                                    it stays up, keyed by SESSION when it logs in\n"
+        "                                    as USER-SESSION and by its address otherwise\n"
+        "     -d,--dns-ttl SECONDS           cache proxy and destination host lookups for\n"
+        "                                    SECONDS (%d by default)\n"
+        "     -W,--warm MIN[:MAX]            keep MIN to MAX negotiated connections ready per\n"
+        "                                    proxy and worker\n"
+        "     -i,--warm-idle SECONDS         drop unused ready connections after SECONDS\n"
+        "                                    (%d by default)\n"
+        "     -H,--health SECONDS            check every proxy each SECONDS and skip dead ones\n"
+        "     -k,--race K[:MS]               with -r, race up to K proxies, starting one every\n"
+        "                                    MS milliseconds (%d by default)\n"
+        "     -U,--io-uring                  accept, connect and relay through io_uring,\n"
+        "                                    epoll is used when the kernel lacks it and\n"
+        "                                    --splice has no effect\n"
+        "     -T,--tcp OPTION[,OPTION...]    tune client and upstream sockets with fastopen,\n"
+        "                                    quickack, deferaccept, keepalive=SECONDS,\n"
+        "                                    sndbuf=BYTES and rcvbuf=BYTES\n"
+        "     -M,--metrics [ADDR:]PORT       serve per proxy metrics for Prometheus on PORT\n"
+        "     -L,--log-level LEVEL           log LEVEL: error, warn, info, debug (info by default)\n"
+    , argv[0], WORKERS, TIMEOUT, BACKLOG, DNS_TTL, WARM_IDLE, RACE_DELAY);
 }
 
 static void cleanup(void)
 {
     if (server_pass) free(server_pass);
     if (server_user) free(server_user);
-    if (proxies_tail) proxies_tail->next = NULL;
     if (threads) free(threads);
-    pthread_mutex_destroy(&proxies_lock);
-    for (proxy_info *tmp = proxies, *next; tmp && (next = tmp->next, 1); tmp = next) {
-        free_proxy_info(tmp);
-        free(tmp);
+    if (workers) free(workers);
+    health_stop();
+    metrics_stop();
+    if (proxies) proxy_set_put(proxies);
+    user_table_free(users);
+    if (proxy_files) free(proxy_files);
+    dns_cache_stop();
+    log_stop();
+    if (serverfds) {
+        for (int i = 0; i < (reuseport ? nworkers : 1); i++)
+            close(serverfds[i]);
+        free(serverfds);
     }
-    close(serverfd);
+    // resolvers write to these until dns_cache_stop()
+    if (resolvefds) {
+        for (int i = 0; i < nworkers; i++)
+            if (resolvefds[i] != -1) close(resolvefds[i]);
+        free(resolvefds);
+    }
+    if (wakefd != -1) close(wakefd);
+    if (reloadfd != -1) close(reloadfd);
+    if (watchfd != -1) close(watchfd);
+    if (proxy_wds) free(proxy_wds);
 }
 
-static void load_proxy_file(const char *path)
+static void proxies_prepare(proxy_set *s)
 {
-    char *line = NULL;
-    char *tmp;
-    size_t len;
-    ssize_t read;
-    FILE *f = fopen(path, "r");
-    proxy_info *p;
-    if (f == NULL) die("fopen:");
-
-    while ((read = getline(&line, &len, f)) != -1) {
-        if (read == 0) continue;
-        if (line[read - 1] == '\n') {
-            line[read - 1] = 0;
-            read--;
-        }
-        if (read == 0) continue;
-        tmp = line;
-        while(isspace(*tmp)) tmp++;
-        if (*tmp == '#' || *tmp == '\0') continue;
-
-        p = emalloc(sizeof(*p));
-
-        if (parse_proxy_info(tmp, p) != 0)
-            die("could not parse proxy `%s`", line);
-
-        if (proxies == NULL) {
-            proxies = proxies_tail = p;
-        } else {
-            proxies_tail->next = p;
-            proxies_tail = p;
-        }
+    proxy_set_weigh(s);
+    if (affinity)
+        proxy_set_ring(s);
+
+    for (size_t i = 0; i < s->poolslots; i++) {
+        proxy_set *pool = s->pools[i].set;
+        if (pool == NULL) continue;
+        proxy_set_weigh(pool);
+        if (affinity)
+            proxy_set_ring(pool);
     }
 
-    if (errno)
-        die("getline:");
-
-    if (line)
-        free(line);
-
-    fclose(f);
+    for (size_t i = 0; i < s->len; i++)
+        worker_prepare(s->proxies[i]);
 }
 
-static proxy_info *get_next_proxy(void)
+static void reload(void)
 {
-    if (pthread_mutex_lock(&proxies_lock) != 0)
-        tdie("pthread_mutex_lock:");
-
-    proxy_info *proxy = current_proxy;
-    current_proxy = current_proxy->next;
-
-    if (pthread_mutex_unlock(&proxies_lock) != 0)
-        tdie("pthread_mutex_unlock:");
-
-    return proxy;
+    reload_proxies();
+    if (users_file)
+        reload_users();
 }
 
-static int userpass_auth(int fd)
+// builds a new set from the -P files and publishes it. workers switch on
+// their next pick, live tunnels keep the proxy_info they hold
+static void reload_proxies(void)
 {
-    unsigned char buf[1 + 1 + 255 + 1 + 255];
-
-    if (read(fd, buf, sizeof(buf)) < 3) return -1;
-
-    if (buf[0] != 1) return -1;
-
-    unsigned char *tmp = &buf[1];
-    if (strncmp((char*)(tmp+1), server_user, *tmp) != 0) goto auth_err;
+    proxy_set *old = atomic_load_explicit(&proxies, memory_order_relaxed);
+    proxy_set *s = proxy_set_new();
+    proxy_index x;
+    proxy_index_init(&x, old);
+
+    for (size_t i = 0; i < nproxy_files; i++) {
+        if (proxy_set_load(s, proxy_files[i], &x) != 0) {
+            proxy_index_free(&x);
+            proxy_set_put(s);
+            log_msg(LOG_ERROR, "reload failed, keeping the current proxies");
+            return;
+        }
+    }
 
-    tmp += *tmp + 1;
-    if (server_pass && strncmp((char*)(tmp+1), server_pass, *tmp) != 0) goto auth_err;
+    if (s->len == 0) {
+        proxy_index_free(&x);
+        proxy_set_put(s);
+        log_msg(LOG_ERROR, "reload found no proxies, keeping the current ones");
+        return;
+    }
 
-    buf[1] = 0;
-    if (write(fd, buf, 2) != 2) return -1;
+    size_t kept = x.kept;
+    proxy_index_retire(&x);
+    proxy_set_recount(s);
+    proxies_prepare(s);
+    atomic_store_explicit(&proxies, s, memory_order_release);
 
-    return 0;
+    // no worker can still be picking from old after this
+    rcu_synchronize();
+    proxy_set_put(old);
 
-auth_err:
-    buf[1] = -1;
-    write(fd, buf, 2);
-    return -1;
+    log_msg(LOG_INFO, "reloaded %zu proxies, %zu unchanged", s->len, kept);
 }
 
-static int auth(int fd)
+// logins in flight finish against the old table, it is freed once every
+// worker has moved on
+static void reload_users(void)
 {
-    unsigned char buf[1 + 1 + 255];
-
-    if (read(fd, buf, sizeof(buf)) < 3) return -1;
+    user_table *old = atomic_load_explicit(&users, memory_order_relaxed);
+    user_table *t = user_table_load(users_file);
 
-    if (buf[0] != 5) return -1;
-
-    if (server_flags & FLAG_NO_AUTH && memchr(&buf[2], 0, buf[1])) {
-        buf[1] = SOCKS5_NO_AUTH;
-        if (write(fd, buf, 2) != 2)
-            return -1;
-        return 0;
+    if (t == NULL) {
+        log_msg(LOG_ERROR, "reload failed, keeping the current users");
+        return;
     }
 
-    if (server_flags & FLAG_USERPASS_AUTH && memchr(&buf[2], 2, buf[1])) {
-        buf[1] = SOCKS5_USERPASS_AUTH;
-        if (write(fd, buf, 2) != 2)
-            return -1;
-        return userpass_auth(fd);
-    }
+    atomic_store_explicit(&users, t, memory_order_release);
+    rcu_synchronize();
+    user_table_free(old);
 
-    buf[1] = SOCKS5_INVALID_AUTH;
-    write(fd, buf, 2);
-    return -1;
+    log_msg(LOG_INFO, "reloaded %zu users", t->len);
 }
 
-static int handler(proxy_info *proxy, int cfd, int pfd)
+// files replaced by a rename are new inodes, so this runs after every reload.
+// the watch descriptors are kept to tell which file an event is about
+static void watch_add(void)
 {
-    proxy_info *cur = proxy;
-    for (;;) {
-        if (proxy_auth(cur, pfd) != 0) {
-            fprintf(stderr, "auth negotiation with proxy %s %s:%s failed\n", cur->proto, cur->host, cur->port);
-            return -2;
-        }
-
-        if (cur->chain == NULL) break;
-
-        if (proxy_chain(cur->chain, pfd) != 0) {
-            fprintf(stderr, "could not chain with proxy %s %s:%s\n", cur->chain->proto, cur->chain->host, cur->chain->port);
-            return -2;
-        }
-
-        cur = cur->chain;
-    }
-
-    // After succesfull connection, remove timeout
-    set_sock_timeout(cfd, 0);
-    set_sock_timeout(pfd, 0);
-
-    return proxy_handler(proxy, cfd, pfd);
+    for (size_t i = 0; i < nproxy_files; i++)
+        proxy_wds[i] = inotify_add_watch(watchfd, proxy_files[i], IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+    if (users_file)
+        users_wd = inotify_add_watch(watchfd, users_file, IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
 }
 
-static void *work(void *arg)
+// editors tend to write a file in several steps, wait for them to finish.
+// sets whichever of the proxy and users files were touched meanwhile
+static void watch_settle(bool *proxies_changed, bool *users_changed)
 {
-    int fd = ((int*)arg)[0];
-
-    struct sockaddr_storage cli;
-
-    while (run) {
-        socklen_t addrlen = sizeof(cli);
-        int cfd = accept(fd, (struct sockaddr*)&cli, &addrlen);
-
-        if (!run) {
-            if (cfd != -1)
-                close(cfd);
-            return NULL;
-        }
-
-        if (cfd == -1)
-            tdie("accept:");
-
-        set_sock_timeout(cfd, timeout);
-
-        char clihost[INET6_ADDRSTRLEN];
-        clihost[0] = 0;
-
-        switch (cli.ss_family) {
-        case AF_INET:
-            inet_ntop(cli.ss_family, &((struct sockaddr_in *)&cli)->sin_addr, clihost, sizeof(clihost));
-            break;
-        case AF_INET6:
-            inet_ntop(cli.ss_family, &((struct sockaddr_in6 *)&cli)->sin6_addr, clihost, sizeof(clihost));
-            break;
-        }
-
-        if (auth(cfd) != 0) {
-            fprintf(stderr, "auth negotiation failed\n");
-            close(cfd);
-            continue;
-        }
-
-        for (;;) {
-            char proxy_str[4096];
-            proxy_info *proxy = get_next_proxy();
-            sprint_proxy(proxy, proxy_str, sizeof(proxy_str));
-            printf("connection from %s through proxy %s\n", clihost, proxy_str);
-
-            int pfd = proxy_connect(proxy, timeout);
-            if (pfd == -1) {
-                fprintf(stderr, "could not connect to proxy %s %s:%s\n", proxy->proto, proxy->host, proxy->port);
-                if (retry) continue;
-                close(cfd);
-                break;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {.fd = watchfd, .events = POLLIN};
+    ssize_t n;
+
+    do {
+        while ((n = read(watchfd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + n;) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                for (size_t i = 0; i < nproxy_files; i++)
+                    if (ev->wd == proxy_wds[i]) *proxies_changed = true;
+                if (users_file && ev->wd == users_wd) *users_changed = true;
+                p += sizeof(*ev) + ev->len;
             }
+        }
+    } while (poll(&pfd, 1, WATCH_SETTLE_MS) == 1);
+}
 
-            if (handler(proxy, cfd, pfd) == -2 && retry) {
-                close(pfd);
-                continue;
-            }
+// pool is a user's own proxies, NULL to pick from all of them
+proxy_info *get_next_proxy(proxy_set *pool)
+{
+    return proxy_set_next(pool ? pool : atomic_load_explicit(&proxies, memory_order_acquire), rotation);
+}
 
-            close(pfd);
-            close(cfd);
-            break;
-        }
-    }
+// the i-th choice for key, see proxy_set_affine(). the rotation takes over
+// once the ring has nothing left to offer
+proxy_info *get_affine_proxy(proxy_set *pool, uint32_t key, size_t i)
+{
+    proxy_set *s = pool ? pool : atomic_load_explicit(&proxies, memory_order_acquire);
+    proxy_info *p = proxy_set_affine(s, key, i);
+    return p ? p : proxy_set_next(s, rotation);
+}
 
-    return NULL;
+size_t proxy_count(proxy_set *pool)
+{
+    return (pool ? pool : atomic_load_explicit(&proxies, memory_order_acquire))->len;
 }
 
 static void int_handler(int sig)
 {
     (void)sig;
     run = 0;
-    if (shutdown(serverfd, SHUT_RD) != 0)
-        die("shutdown:");
+    // wakes every worker, nobody reads it back
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+}
+
+static void hup_handler(int sig)
+{
+    (void)sig;
+    uint64_t one = 1;
+    write(reloadfd, &one, sizeof(one));
 }
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "proxy.h"
+#include "rotation.h"
+#include "users.h"
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLAG_NO_AUTH       (1 << 0)
+#define FLAG_USERPASS_AUTH (1 << 1)
+
+extern char *server_pass;
+extern char *server_user;
+extern bool retry;
+extern bool splice_relay;
+extern bool pipeline;
+extern bool affinity;
+extern bool use_uring;
+extern int timeout;
+extern int connect_timeout;
+extern int hop_timeout;
+extern int client_timeout;
+extern int idle_timeout;
+extern int warm_min;
+extern int warm_max;
+extern int warm_idle;
+extern int race;
+extern int race_delay;
+extern volatile sig_atomic_t run;
+extern int server_flags;
+extern _Atomic(proxy_set *) proxies;
+extern _Atomic(user_table *) users;
+extern int nworkers;
+
+proxy_info *get_next_proxy(proxy_set *pool);
+proxy_info *get_affine_proxy(proxy_set *pool, uint32_t key, size_t i);
+size_t proxy_count(proxy_set *pool);
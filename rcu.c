@@ -0,0 +1,41 @@
+#define _GNU_SOURCE
+#include "rcu.h"
+#include <time.h>
+
+static atomic_ullong epoch = 1;
+static _Atomic(rcu_reader *) readers;
+
+// readers stay registered until exit
+void rcu_register(rcu_reader *r)
+{
+    atomic_init(&r->epoch, 0);
+    r->next = atomic_load_explicit(&readers, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&readers, &r->next, r, memory_order_release, memory_order_relaxed));
+}
+
+void rcu_online(rcu_reader *r)
+{
+    atomic_store_explicit(&r->epoch, atomic_load_explicit(&epoch, memory_order_relaxed), memory_order_relaxed);
+    // the store must be visible before any shared pointer is loaded
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void rcu_offline(rcu_reader *r)
+{
+    atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+void rcu_synchronize(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned long long target = atomic_fetch_add(&epoch, 1) + 1;
+
+    for (rcu_reader *r = atomic_load_explicit(&readers, memory_order_acquire); r; r = r->next) {
+        for (;;) {
+            unsigned long long e = atomic_load(&r->epoch);
+            if (e == 0 || e >= target) break;
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+            nanosleep(&ts, NULL);
+        }
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdatomic.h>
+
+// quiescent state based reclamation. a reader is online while it may hold
+// pointers into shared data and goes offline whenever it blocks, a writer
+// that swapped something out waits in rcu_synchronize() until every reader
+// that could still see the old version went offline at least once
+typedef struct rcu_reader {
+    _Alignas(64) atomic_ullong epoch; // 0 while offline
+    struct rcu_reader *next;
+} rcu_reader;
+
+void rcu_register(rcu_reader *r);
+void rcu_online(rcu_reader *r);
+void rcu_offline(rcu_reader *r);
+void rcu_synchronize(void);
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// max read/write rounds per call, so one busy tunnel can't starve the others
+#define RELAY_ROUNDS 4
+// max bytes moved into a pipe at once, the default pipe capacity
+#define RELAY_PIPESZ 65536
+// idle pipes kept per worker thread
+#define RELAY_PIPE_CACHE 64
+// reads under a quarter of the buffer in a row before it is halved
+#define RELAY_SHRINK_READS 16
+// buffer sizes, RELAY_BUFMIN doubled up to RELAY_BUFMAX
+#define RELAY_CLASSES 7
+// idle buffer bytes kept per worker thread, the rest goes back to malloc
+#define RELAY_POOL_BYTES (4 << 20)
+// smaller sends aren't worth pinning pages for
+#define RELAY_ZC_MIN (16 * 1024)
+// aux of a ring recv, sends carry their buffer there
+#define RELAY_AUX_RECV 0xffff
+
+#define WOULD_BLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == EINTR)
+
+// an idle buffer, linked through its own first bytes
+typedef struct pooled {
+    struct pooled *next;
+} pooled;
+
+static _Thread_local int pipe_cache[RELAY_PIPE_CACHE][2];
+static _Thread_local int npipe_cache;
+static _Thread_local pooled *buf_pool[RELAY_CLASSES];
+static _Thread_local size_t buf_pool_bytes;
+
+static int relay_pump_copy(relay_dir *d);
+static int relay_pump_splice(relay_dir *d);
+static void relay_adapt(relay_dir *d, size_t n);
+static int relay_shut(relay_dir *d);
+static void relay_drop(relay_dir *d);
+static char *buf_get(size_t size);
+static void buf_put(char *buf, size_t size);
+static int buf_class(size_t size);
+static int pipe_get(int fds[2]);
+static void pipe_put(int fds[2], bool empty);
+
+// nothing is allocated up front, a direction borrows a buffer or a pipe
+// only while it has data in flight. splicing doesn't apply to a ring
+void relay_init(relay_dir *d, int from, int to, bool splice, uring *ring)
+{
+    d->from = from;
+    d->to = to;
+    d->off = d->len = 0;
+    d->size = RELAY_BUFMIN;
+    d->small = 0;
+    d->done = false;
+    d->splice = splice && ring == NULL;
+    d->total = 0;
+    d->buf = NULL;
+    d->pipe[0] = d->pipe[1] = -1;
+    d->ring = ring;
+    d->bid = d->next = -1;
+    d->next_len = 0;
+    d->recving = d->sending = d->eof = false;
+    d->zc = ring && ring->zc;
+}
+
+// a ring op still in flight keeps its buffer until it completes
+void relay_free(relay_dir *d)
+{
+    if (d->ring) {
+        d->from = d->to = -1;
+        if (!d->recving && !d->sending) relay_drop(d);
+        return;
+    }
+
+    if (d->buf) buf_put(d->buf, d->size);
+    d->buf = NULL;
+
+    if (d->pipe[0] != -1)
+        pipe_put(d->pipe, d->len == 0);
+    d->pipe[0] = d->pipe[1] = -1;
+}
+
+// frees the calling thread's idle pipes and buffers
+void relay_cleanup(void)
+{
+    while (npipe_cache) {
+        npipe_cache--;
+        close(pipe_cache[npipe_cache][0]);
+        close(pipe_cache[npipe_cache][1]);
+    }
+
+    for (int i = 0; i < RELAY_CLASSES; i++) {
+        while (buf_pool[i]) {
+            pooled *p = buf_pool[i];
+            buf_pool[i] = p->next;
+            free(p);
+        }
+    }
+    buf_pool_bytes = 0;
+}
+
+int relay_pending(const relay_dir *d)
+{
+    return d->off < d->len;
+}
+
+bool relay_done(const relay_dir *d)
+{
+    return d->done;
+}
+
+// flushes queued data and reads more while both ends allow it.
+// returns 0 when it would block, RELAY_EOF once `from` is drained and its
+// EOF passed on to `to`, and -1 on error. a drained direction hands its
+// buffer or pipe back before returning
+int relay_pump(relay_dir *d)
+{
+    if (d->done) return RELAY_EOF;
+
+    int r = d->splice ? relay_pump_splice(d) : relay_pump_copy(d);
+
+    if (d->buf && !relay_pending(d)) {
+        buf_put(d->buf, d->size);
+        d->buf = NULL;
+    }
+    if (d->pipe[0] != -1 && d->len == 0) {
+        pipe_put(d->pipe, true);
+        d->pipe[0] = d->pipe[1] = -1;
+    }
+
+    return r;
+}
+
+static int relay_pump_copy(relay_dir *d)
+{
+    for (int i = 0; i < RELAY_ROUNDS; i++) {
+        if (relay_pending(d)) {
+            ssize_t n = write(d->to, d->buf + d->off, d->len - d->off);
+            if (n == -1) return WOULD_BLOCK(errno) ? 0 : -1;
+            d->off += n;
+            d->total += n;
+            if (relay_pending(d)) return 0;
+        }
+
+        d->off = d->len = 0;
+        // out of memory only this tunnel fails, the others hold on to theirs
+        if (d->buf == NULL && (d->buf = buf_get(d->size)) == NULL) return -1;
+
+        ssize_t n = read(d->from, d->buf, d->size);
+        if (n == 0) return relay_shut(d);
+        if (n == -1) return WOULD_BLOCK(errno) ? 0 : -1;
+        d->len = n;
+        relay_adapt(d, n);
+    }
+
+    return 0;
+}
+
+// bulk transfers get fewer, larger syscalls, interactive ones keep their
+// memory small. resizing keeps the data just read
+static void relay_adapt(relay_dir *d, size_t n)
+{
+    size_t size = d->size;
+
+    if (n == d->size) {
+        d->small = 0;
+        if (size < RELAY_BUFMAX) size *= 2;
+    } else if (n < d->size / 4 && ++d->small >= RELAY_SHRINK_READS) {
+        d->small = 0;
+        if (size > RELAY_BUFMIN) size /= 2;
+    }
+
+    if (size == d->size) return;
+    char *buf = buf_get(size);
+    if (buf == NULL) return;
+    memcpy(buf, d->buf, n);
+    buf_put(d->buf, d->size);
+    d->buf = buf;
+    d->size = size;
+}
+
+// passes EOF on as a half-close, the other direction keeps going
+static int relay_shut(relay_dir *d)
+{
+    if (shutdown(d->to, SHUT_WR) == -1 && errno != ENOTCONN) return -1;
+    d->done = true;
+    return RELAY_EOF;
+}
+
+// starts what d can do next on its ring: sending the buffer it holds,
+// and receiving into another one meanwhile. it holds two at most, so a
+// slow reader holds back its writer. returns how many ops were started
+int relay_post(relay_dir *d, uint64_t ud)
+{
+    int n = 0;
+    if (d->done || d->from == -1) return 0;
+
+    if (!d->sending && d->bid != -1) {
+        size_t len = d->len - d->off;
+        uring_send(d->ring, d->to, d->buf + d->off, len, d->zc && len >= RELAY_ZC_MIN, ud | URING_UD(NULL, 0, d->bid));
+        d->sending = true;
+        n++;
+    }
+
+    if (!d->recving && !d->eof && d->next == -1) {
+        uring_recv(d->ring, d->from, ud | URING_UD(NULL, 0, RELAY_AUX_RECV));
+        d->recving = true;
+        n++;
+    }
+
+    return n;
+}
+
+// takes the result of one of d's ring ops, aux as it was posted with.
+// returns what relay_pump() would, or RELAY_NOBUF when the ring ran out of
+// buffers and the recv has to be posted again later
+int relay_complete(relay_dir *d, int res, unsigned flags, unsigned aux)
+{
+    int r = 0;
+
+    // the kernel let go of a zero copy send's buffer
+    if (flags & IORING_CQE_F_NOTIF) {
+        // copied anyway, as over loopback, so plain sends are cheaper
+        if ((unsigned)res & IORING_NOTIF_USAGE_ZC_COPIED) d->zc = false;
+        uring_buf_unref(d->ring, aux);
+        return 0;
+    }
+
+    if (aux == RELAY_AUX_RECV) {
+        d->recving = false;
+        if (flags & IORING_CQE_F_BUFFER) {
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buf = uring_buf_take(d->ring, bid);
+            if (res <= 0) {
+                uring_buf_unref(d->ring, bid);
+            } else if (d->bid == -1) {
+                d->bid = bid;
+                d->buf = buf;
+                d->off = 0;
+                d->len = res;
+            } else {
+                d->next = bid;
+                d->next_len = res;
+            }
+        }
+        if (res == -ENOBUFS) r = RELAY_NOBUF;
+        else if (res < 0) r = -1;
+        else if (res == 0) d->eof = true;
+    } else {
+        d->sending = false;
+        // its notification drops this reference
+        if (flags & IORING_CQE_F_MORE) uring_buf_ref(d->ring, d->bid);
+        if (res < 0) {
+            r = -1;
+        } else {
+            d->off += res;
+            d->total += res;
+        }
+        if (r == 0 && d->off == d->len) {
+            uring_buf_unref(d->ring, d->bid);
+            d->bid = d->next;
+            d->buf = d->bid == -1 ? NULL : d->ring->bufs + d->bid * d->ring->bufsz;
+            d->off = 0;
+            d->len = d->next_len;
+            d->next = -1;
+        }
+    }
+
+    if (d->from == -1) {
+        if (!d->recving && !d->sending) relay_drop(d);
+        return 0;
+    }
+
+    if (r == 0 && d->eof && d->bid == -1 && !d->done)
+        r = relay_shut(d);
+    return r;
+}
+
+// hands d's ring buffers back
+static void relay_drop(relay_dir *d)
+{
+    if (d->bid != -1) uring_buf_unref(d->ring, d->bid);
+    if (d->next != -1) uring_buf_unref(d->ring, d->next);
+    d->bid = d->next = -1;
+    d->buf = NULL;
+    d->off = d->len = 0;
+}
+
+// socket -> pipe -> socket, the payload never reaches userspace
+static int relay_pump_splice(relay_dir *d)
+{
+    for (int i = 0; i < RELAY_ROUNDS; i++) {
+        if (d->len) {
+            ssize_t n = splice(d->pipe[0], NULL, d->to, NULL, d->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == -1) return WOULD_BLOCK(errno) ? 0 : -1;
+            d->len -= n;
+            d->total += n;
+            if (d->len) return 0;
+        }
+
+        // out of pipes, copying still works
+        if (d->pipe[0] == -1 && pipe_get(d->pipe) != 0) {
+            d->splice = false;
+            return relay_pump_copy(d);
+        }
+
+        ssize_t n = splice(d->from, NULL, d->pipe[1], NULL, RELAY_PIPESZ, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) return relay_shut(d);
+        if (n == -1) {
+            if (errno == EINVAL || errno == ENOSYS) {
+                // splice is unsupported here, the pipe is still empty
+                d->splice = false;
+                return relay_pump_copy(d);
+            }
+            return WOULD_BLOCK(errno) ? 0 : -1;
+        }
+        d->len = n;
+    }
+
+    return 0;
+}
+
+// a buffer of one of the RELAY_CLASSES sizes, recycled when possible.
+// NULL when memory ran out
+static char *buf_get(size_t size)
+{
+    int c = buf_class(size);
+    pooled *p = buf_pool[c];
+
+    if (p == NULL) return malloc(size);
+    buf_pool[c] = p->next;
+    buf_pool_bytes -= size;
+    return (char *)p;
+}
+
+static void buf_put(char *buf, size_t size)
+{
+    if (buf_pool_bytes + size > RELAY_POOL_BYTES) {
+        free(buf);
+        return;
+    }
+
+    int c = buf_class(size);
+    pooled *p = (pooled *)buf;
+    p->next = buf_pool[c];
+    buf_pool[c] = p;
+    buf_pool_bytes += size;
+}
+
+static int buf_class(size_t size)
+{
+    int c = 0;
+    while ((size_t)RELAY_BUFMIN << c < size) c++;
+    return c;
+}
+
+static int pipe_get(int fds[2])
+{
+    if (npipe_cache) {
+        npipe_cache--;
+        fds[0] = pipe_cache[npipe_cache][0];
+        fds[1] = pipe_cache[npipe_cache][1];
+        return 0;
+    }
+
+    return pipe2(fds, O_NONBLOCK | O_CLOEXEC);
+}
+
+// a pipe that still holds data can't be reused
+static void pipe_put(int fds[2], bool empty)
+{
+    if (empty && npipe_cache < RELAY_PIPE_CACHE) {
+        pipe_cache[npipe_cache][0] = fds[0];
+        pipe_cache[npipe_cache][1] = fds[1];
+        npipe_cache++;
+        return;
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "uring.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// copy buffers start small for interactive traffic and double on every
+// read that fills them, up to RELAY_BUFMAX
+#define RELAY_BUFMIN 4096
+#define RELAY_BUFMAX (256 * 1024)
+#define RELAY_EOF    1
+#define RELAY_NOBUF  2
+// buffers of a worker's ring, shared by all of its tunnels
+#define RELAY_RING_BUFS  64
+#define RELAY_RING_BUFSZ (64 * 1024)
+
+// one direction of a tunnel, from -> to. in splice mode the data stays in
+// the kernel, queued in pipe, and len counts the bytes held there. buf and
+// pipe are borrowed from per thread pools while data is in flight, an idle
+// direction holds neither. with a ring, buf is one of its buffers and
+// every step is an op of its own, see relay_post()
+typedef struct relay_dir {
+    int from, to;
+    size_t off, len;
+    size_t size;               // of buf, kept while it is lent out
+    unsigned short small;      // reads in a row well under size
+    bool done;                 // from reached EOF and to was shut down
+    bool splice;
+    bool recving, sending;     // ring ops in flight
+    bool eof;                  // from reached EOF on a ring, to gets shut once drained
+    bool zc;                   // large ring sends go zero copy
+    unsigned long long total;  // bytes delivered to `to`
+    char *buf;                 // NULL when idle
+    int pipe[2];               // -1 when idle
+    uring *ring;
+    int bid;                   // ring buffer being sent from, -1 when none
+    int next;                  // ring buffer received meanwhile, -1 when none
+    unsigned next_len;
+} relay_dir;
+
+void relay_init(relay_dir *d, int from, int to, bool splice, uring *ring);
+void relay_free(relay_dir *d);
+void relay_cleanup(void);
+int relay_pump(relay_dir *d);
+int relay_pending(const relay_dir *d);
+bool relay_done(const relay_dir *d);
+int relay_post(relay_dir *d, uint64_t ud);
+int relay_complete(relay_dir *d, int res, unsigned flags, unsigned aux);
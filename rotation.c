@@ -0,0 +1,704 @@
+#define _GNU_SOURCE
+#include "rotation.h"
+#include "log.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// proxies compared per leastconn pick
+#define LEASTCONN_WINDOW 8
+// hash ring points per proxy, fewer on lists so long the ring would pass
+// RING_MAX_POINTS. more points spread keys more evenly
+#define RING_VNODES 100
+#define RING_MAX_POINTS (1 << 20)
+// distinct proxies an affine pick tries for a key and ring points it looks
+// at, later retries and crowded rings fall back to the rotation
+#define AFFINE_MAX 8
+#define AFFINE_WALK 1024
+// smallest piece of a proxy file given a parser thread of its own
+#define LOAD_CHUNK (1 << 20)
+#define LOAD_MAX_THREADS 32
+// pool slots of a set before the first one gets added
+#define POOL_SLOTS 16
+
+// the pool option of an entry, pointing into its file
+typedef struct load_pool {
+    const char *names;
+    size_t len;
+} load_pool;
+
+// one slice of a proxy file and what its parser made of it
+typedef struct load_chunk {
+    const char *start, *end;
+    proxy_index *index;
+    arena *arena;
+    proxy_info **proxies;
+    load_pool *pools;              // one per proxies, NULL while none had one
+    size_t len, cap;
+    size_t fresh, kept;            // built into arena, taken over from index
+    proxy_kept *kept_opts;         // one per kept
+    size_t keptcap;
+    const char *bad;               // the first line that didn't parse
+    size_t badlen;
+    pthread_t thread;
+    bool started;
+} load_chunk;
+
+static atomic_size_t nstripes;
+static _Thread_local size_t stripe;
+static _Thread_local int has_stripe;
+static _Thread_local uint64_t rng;
+
+static char *load_file(int fd, size_t *size, bool *mapped);
+static void *load_run(void *arg);
+static proxy_info *proxy_index_find(proxy_index *x, const proxy_hop *hops, size_t n);
+static void pool_join(proxy_set *s, const char *names, size_t len, proxy_info *p);
+static proxy_pool *pool_slot(proxy_set *s, const char *name, size_t len);
+static int ring_cmp(const void *a, const void *b);
+static uint32_t mix32(uint32_t h);
+static proxy_info *proxy_set_pick(proxy_set *s, int rotation);
+static proxy_info *proxy_set_column(proxy_set *s, size_t i, uint32_t coin);
+static proxy_info *proxy_set_draw(proxy_set *s);
+static proxy_info *least_loaded(proxy_info *a, proxy_info *b);
+static proxy_info *least_cost(proxy_info *a, proxy_info *b);
+static uint64_t rng_next(void);
+
+int rotation_from_str(const char *str)
+{
+    if (strcmp(str, "roundrobin") == 0) return ROTATION_ROUNDROBIN;
+    if (strcmp(str, "striped")    == 0) return ROTATION_STRIPED;
+    if (strcmp(str, "leastconn")  == 0) return ROTATION_LEASTCONN;
+    if (strcmp(str, "p2c")        == 0) return ROTATION_P2C;
+    if (strcmp(str, "latency")    == 0) return ROTATION_LATENCY;
+    return -1;
+}
+
+proxy_set *proxy_set_new(void)
+{
+    static atomic_ulong gen;
+
+    proxy_set *s = calloc(1, sizeof(*s));
+    if (s == NULL) die("calloc:");
+    s->gen = atomic_fetch_add(&gen, 1) + 1;
+    atomic_init(&s->refs, 1);
+    return s;
+}
+
+// appends the proxies in path to s, reusing the entries x knows. the file
+// is mapped and cut at line boundaries into chunks parsed in parallel,
+// each into an arena of its own. errors are reported but not fatal, so a
+// broken file can't take down a reload
+int proxy_set_load(proxy_set *s, const char *path, proxy_index *x)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        log_report(LOG_ERROR, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    size_t size;
+    bool mapped;
+    char *data = load_file(fd, &size, &mapped);
+    close(fd);
+    if (data == NULL) {
+        log_report(LOG_ERROR, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = size / LOAD_CHUNK + 1;
+    if (ncpu > 0 && n > (size_t)ncpu) n = ncpu;
+    if (n > LOAD_MAX_THREADS) n = LOAD_MAX_THREADS;
+
+    load_chunk *chunks = calloc(n, sizeof(*chunks));
+    if (chunks == NULL) die("calloc:");
+
+    const char *end = data + size, *start = data;
+    for (size_t i = 0; i < n; i++) {
+        const char *stop = i == n - 1 ? end : data + size / n * (i + 1);
+        if (stop < start) stop = start;
+        const char *eol = memchr(stop, '\n', end - stop);
+        stop = eol && i != n - 1 ? eol + 1 : end;
+
+        chunks[i].start = start;
+        chunks[i].end = stop;
+        chunks[i].index = x;
+        chunks[i].arena = arena_new();
+        start = stop;
+    }
+
+    // the calling thread takes the first chunk, a chunk whose thread can't
+    // be started is parsed inline afterwards
+    for (size_t i = 1; i < n; i++)
+        chunks[i].started = pthread_create(&chunks[i].thread, NULL, &load_run, &chunks[i]) == 0;
+    load_run(&chunks[0]);
+
+    int r = 0;
+    size_t total = s->len;
+    for (size_t i = 0; i < n; i++) {
+        load_chunk *c = &chunks[i];
+        if (c->started) pthread_join(c->thread, NULL);
+        else if (i != 0) load_run(c);
+
+        if (c->bad && r == 0) {
+            log_report(LOG_ERROR, "could not parse proxy `%.*s`", (int)c->badlen, c->bad);
+            r = -1;
+        }
+        total += c->len;
+    }
+
+    if (total > s->cap) {
+        s->cap = total;
+        s->proxies = realloc(s->proxies, sizeof(proxy_info *[s->cap]));
+        if (s->proxies == NULL) die("realloc:");
+    }
+
+    // entries are kept even after an error, so putting s cleans them up
+    for (size_t i = 0; i < n; i++) {
+        load_chunk *c = &chunks[i];
+        if (c->len)
+            memcpy(&s->proxies[s->len], c->proxies, sizeof(proxy_info *[c->len]));
+        for (size_t j = 0; c->pools && j < c->len; j++)
+            if (c->pools[j].names) pool_join(s, c->pools[j].names, c->pools[j].len, c->proxies[j]);
+        s->len += c->len;
+        if (x && c->kept) {
+            x->kept_opts = realloc(x->kept_opts, sizeof(proxy_kept[x->kept + c->kept]));
+            if (x->kept_opts == NULL) die("realloc:");
+            memcpy(&x->kept_opts[x->kept], c->kept_opts, sizeof(proxy_kept[c->kept]));
+            x->kept += c->kept;
+        }
+
+        arena_seal(c->arena);
+        arena_hold(c->arena, c->fresh);
+        arena_release(c->arena);
+        free(c->proxies);
+        free(c->pools);
+        free(c->kept_opts);
+    }
+
+    free(chunks);
+    if (mapped) munmap(data, size);
+    else free(data);
+    return r;
+}
+
+// the whole file, mapped when it is a regular one and read otherwise
+static char *load_file(int fd, size_t *size, bool *mapped)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1) return NULL;
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (data != MAP_FAILED) {
+            *size = st.st_size;
+            *mapped = true;
+            return data;
+        }
+    }
+
+    size_t len = 0, cap = 65536;
+    char *data = emalloc(cap);
+
+    for (;;) {
+        if (len == cap) {
+            cap *= 2;
+            data = realloc(data, cap);
+            if (data == NULL) die("realloc:");
+        }
+        ssize_t r = read(fd, data + len, cap - len);
+        if (r == 0) break;
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            free(data);
+            return NULL;
+        }
+        len += r;
+    }
+
+    *size = len;
+    *mapped = false;
+    return data;
+}
+
+static void *load_run(void *arg)
+{
+    load_chunk *c = arg;
+    proxy_hop *hops = NULL;
+    proxy_opts opts;
+    size_t cap = 0;
+
+    for (const char *line = c->start, *eol; line < c->end; line = eol + 1) {
+        eol = memchr(line, '\n', c->end - line);
+        if (eol == NULL) eol = c->end;
+
+        int n = proxy_scan(line, eol, &hops, &cap, &opts);
+        if (n == 0) continue;
+        if (n == -1) {
+            c->bad = line;
+            c->badlen = eol - line;
+            break;
+        }
+
+        if (c->len == c->cap) {
+            c->cap = c->cap ? c->cap * 2 : 1024;
+            c->proxies = realloc(c->proxies, sizeof(proxy_info *[c->cap]));
+            if (c->proxies == NULL) die("realloc:");
+            if (c->pools) {
+                c->pools = realloc(c->pools, sizeof(load_pool[c->cap]));
+                if (c->pools == NULL) die("realloc:");
+                memset(&c->pools[c->len], 0, sizeof(load_pool[c->cap - c->len]));
+            }
+        }
+
+        // most lists have no pools, they don't pay for the tags
+        if (opts.pool && c->pools == NULL) {
+            c->pools = calloc(c->cap, sizeof(load_pool));
+            if (c->pools == NULL) die("calloc:");
+        }
+        if (opts.pool)
+            c->pools[c->len] = (load_pool){.names = opts.pool, .len = opts.poollen};
+
+        proxy_info *p = c->index ? proxy_index_find(c->index, hops, n) : NULL;
+        if (p) {
+            // the live set still picks with the old options, they change
+            // once every file loaded
+            if (c->kept == c->keptcap) {
+                c->keptcap = c->keptcap ? c->keptcap * 2 : 1024;
+                c->kept_opts = realloc(c->kept_opts, sizeof(proxy_kept[c->keptcap]));
+                if (c->kept_opts == NULL) die("realloc:");
+            }
+            opts.pool = NULL;
+            c->kept_opts[c->kept++] = (proxy_kept){.proxy = p, .opts = opts};
+            proxy_ref(p);
+        } else {
+            p = proxy_build(c->arena, hops, n, &opts);
+            c->fresh++;
+        }
+
+        c->proxies[c->len++] = p;
+    }
+
+    free(hops);
+    return NULL;
+}
+
+void proxy_index_init(proxy_index *x, proxy_set *old)
+{
+    x->set = old;
+    x->kept_opts = NULL;
+    x->kept = 0;
+    x->nslots = 64;
+    while (x->nslots < old->len * 2) x->nslots *= 2;
+
+    // SIZE_MAX marks a free slot
+    x->slots = emalloc(sizeof(size_t[x->nslots]));
+    memset(x->slots, 0xff, sizeof(size_t[x->nslots]));
+    x->used = calloc(old->len ? old->len : 1, sizeof(atomic_bool));
+    if (x->used == NULL) die("calloc:");
+
+    for (size_t i = 0; i < old->len; i++) {
+        size_t h = proxy_hash(old->proxies[i]) & (x->nslots - 1);
+        while (x->slots[h] != SIZE_MAX) h = (h + 1) & (x->nslots - 1);
+        x->slots[h] = i;
+    }
+}
+
+// gives the entries the new set took over their new options and retires
+// the rest, then frees x. call it once the new set is complete
+void proxy_index_retire(proxy_index *x)
+{
+    for (size_t i = 0; i < x->kept; i++)
+        proxy_configure(x->kept_opts[i].proxy, &x->kept_opts[i].opts);
+    for (size_t i = 0; i < x->set->len; i++)
+        if (!atomic_load_explicit(&x->used[i], memory_order_relaxed))
+            atomic_store_explicit(&x->set->proxies[i]->retired, true, memory_order_relaxed);
+    proxy_index_free(x);
+}
+
+void proxy_index_free(proxy_index *x)
+{
+    free(x->slots);
+    free(x->used);
+    free(x->kept_opts);
+    x->slots = NULL;
+    x->used = NULL;
+    x->kept_opts = NULL;
+}
+
+// safe from several loader threads, the live set doesn't change meanwhile
+static proxy_info *proxy_index_find(proxy_index *x, const proxy_hop *hops, size_t n)
+{
+    size_t h = proxy_hop_hash(hops) & (x->nslots - 1);
+
+    for (; x->slots[h] != SIZE_MAX; h = (h + 1) & (x->nslots - 1)) {
+        proxy_info *o = x->set->proxies[x->slots[h]];
+        if (!proxy_matches(o, hops, n)) continue;
+        atomic_store_explicit(&x->used[x->slots[h]], true, memory_order_relaxed);
+        return o;
+    }
+
+    return NULL;
+}
+
+// adds p to every pool in the comma separated names, creating them as
+// needed. pools hold their own references
+static void pool_join(proxy_set *s, const char *names, size_t len, proxy_info *p)
+{
+    for (const char *name = names, *end = names + len, *comma; name < end; name = comma + 1) {
+        comma = memchr(name, ',', end - name);
+        if (comma == NULL) comma = end;
+        if (comma == name) continue;
+
+        if ((s->npools + 1) * 2 > s->poolslots) {
+            proxy_pool *old = s->pools;
+            size_t n = s->poolslots;
+            s->poolslots = n ? n * 2 : POOL_SLOTS;
+            s->pools = calloc(s->poolslots, sizeof(proxy_pool));
+            if (s->pools == NULL) die("calloc:");
+            for (size_t i = 0; i < n; i++)
+                if (old[i].name) *pool_slot(s, old[i].name, strlen(old[i].name)) = old[i];
+            free(old);
+        }
+
+        proxy_pool *pool = pool_slot(s, name, comma - name);
+        if (pool->name == NULL) {
+            pool->name = strndup(name, comma - name);
+            if (pool->name == NULL) die("strndup:");
+            pool->set = proxy_set_new();
+            s->npools++;
+        }
+
+        proxy_set *ps = pool->set;
+        if (ps->len == ps->cap) {
+            ps->cap = ps->cap ? ps->cap * 2 : 16;
+            ps->proxies = realloc(ps->proxies, sizeof(proxy_info *[ps->cap]));
+            if (ps->proxies == NULL) die("realloc:");
+        }
+        proxy_ref(p);
+        ps->proxies[ps->len++] = p;
+    }
+}
+
+// the slot holding name, or the free one it would go to
+static proxy_pool *pool_slot(proxy_set *s, const char *name, size_t len)
+{
+    size_t i = affinity_key(name, len) & (s->poolslots - 1);
+
+    for (; s->pools[i].name; i = (i + 1) & (s->poolslots - 1))
+        if (strncmp(s->pools[i].name, name, len) == 0 && s->pools[i].name[len] == 0)
+            break;
+    return &s->pools[i];
+}
+
+// the entries of s tagged with pool name, NULL when there are none
+proxy_set *proxy_set_pool(proxy_set *s, const char *name)
+{
+    if (s->pools == NULL) return NULL;
+    return pool_slot(s, name, strlen(name))->set;
+}
+
+// pools are only recounted here, between rounds of the health checker
+void proxy_set_recount(proxy_set *s)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < s->len; i++)
+        n += atomic_load_explicit(&s->proxies[i]->down, memory_order_relaxed);
+    atomic_store_explicit(&s->ndown, n, memory_order_relaxed);
+
+    for (size_t i = 0; i < s->poolslots; i++)
+        if (s->pools[i].set) proxy_set_recount(s->pools[i].set);
+}
+
+// vose's alias method, so a weighted pick costs one column and one coin.
+// weights are scaled so that the mean is total, which keeps it exact
+void proxy_set_weigh(proxy_set *s)
+{
+    uint64_t total = 0;
+    bool equal = true;
+
+    for (size_t i = 0; i < s->len; i++) {
+        unsigned w = atomic_load_explicit(&s->proxies[i]->weight, memory_order_relaxed);
+        equal = equal && w == atomic_load_explicit(&s->proxies[0]->weight, memory_order_relaxed);
+        total += w;
+    }
+    if (equal) return;
+
+    uint64_t *scaled = emalloc(sizeof(uint64_t[s->len]));
+    // under the mean from the front, the rest from the back
+    uint32_t *work = emalloc(sizeof(uint32_t[s->len]));
+    size_t nsmall = 0, large = s->len;
+    s->alias = emalloc(sizeof(proxy_alias[s->len]));
+
+    for (size_t i = 0; i < s->len; i++) {
+        scaled[i] = atomic_load_explicit(&s->proxies[i]->weight, memory_order_relaxed) * (uint64_t)s->len;
+        if (scaled[i] < total) work[nsmall++] = i;
+        else work[--large] = i;
+        s->alias[i] = (proxy_alias){.prob = UINT32_MAX, .index = i};
+    }
+
+    while (nsmall && large < s->len) {
+        uint32_t l = work[--nsmall], g = work[large];
+        s->alias[l] = (proxy_alias){.prob = (double)scaled[l] / total * 4294967296.0, .index = g};
+        scaled[g] -= total - scaled[l];
+        if (scaled[g] < total) {
+            large++;
+            work[nsmall++] = g;
+        }
+    }
+
+    free(scaled);
+    free(work);
+}
+
+// places RING_VNODES points per unit of weight on the ring, fewer when
+// that would pass RING_MAX_POINTS. a point only depends on its proxy's
+// lines, so a reload moves just the keys of what changed
+void proxy_set_ring(proxy_set *s)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < s->len; i++)
+        total += atomic_load_explicit(&s->proxies[i]->weight, memory_order_relaxed);
+
+    size_t per = RING_VNODES, div = 1;
+    if (total * RING_VNODES > RING_MAX_POINTS) {
+        per = RING_MAX_POINTS;
+        div = total;
+    }
+
+    s->nring = 0;
+    s->ring = emalloc(sizeof(ring_point[div == 1 ? total * per + 1 : RING_MAX_POINTS + s->len]));
+
+    for (size_t i = 0; i < s->len; i++) {
+        uint32_t h = 0;
+        for (proxy_info *p = s->proxies[i]; p; p = p->chain)
+            h = mix32(h ^ proxy_hash(p));
+        size_t n = atomic_load_explicit(&s->proxies[i]->weight, memory_order_relaxed) * per / div;
+        for (size_t v = 0; v < (n ? n : 1); v++)
+            s->ring[s->nring++] = (ring_point){.hash = mix32(h + v * 0x9e3779b9u), .index = i};
+    }
+
+    qsort(s->ring, s->nring, sizeof(ring_point), &ring_cmp);
+}
+
+// the i-th distinct proxy clockwise from key, passing over the ones marked
+// down or at max_conns, so only the keys of a proxy that goes away, down or
+// full land elsewhere. the walk is bounded, NULL past the AFFINE_MAX-th
+// proxy or when AFFINE_WALK points didn't turn up the i-th
+proxy_info *proxy_set_affine(proxy_set *s, uint32_t key, size_t i)
+{
+    if (i >= AFFINE_MAX || s->nring == 0) return NULL;
+
+    size_t lo = 0, hi = s->nring;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->ring[mid].hash < key) lo = mid + 1;
+        else hi = mid;
+    }
+
+    bool skip_down = atomic_load_explicit(&s->ndown, memory_order_relaxed) < s->len;
+    size_t walk = s->nring < AFFINE_WALK ? s->nring : AFFINE_WALK;
+    // the proxies counted so far, points of several interleave on the ring
+    uint32_t seen[AFFINE_MAX];
+    size_t nseen = 0;
+
+    for (size_t n = 0; n < walk; n++) {
+        uint32_t index = s->ring[(lo + n) % s->nring].index;
+        proxy_info *p = s->proxies[index];
+        if (proxy_full(p) || (skip_down && atomic_load_explicit(&p->down, memory_order_relaxed)))
+            continue;
+
+        size_t j = 0;
+        while (j < nseen && seen[j] != index) j++;
+        if (j < nseen) continue;
+
+        if (nseen == i) return p;
+        seen[nseen++] = index;
+    }
+
+    return NULL;
+}
+
+// fnv-1a, finalized so similar keys land far apart on the ring
+uint32_t affinity_key(const char *str, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    return mix32(h);
+}
+
+static int ring_cmp(const void *a, const void *b)
+{
+    const ring_point *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// murmur3's finalizer
+static uint32_t mix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// only safe on a set that can't be freed meanwhile, see rcu.h
+proxy_set *proxy_set_get(proxy_set *s)
+{
+    atomic_fetch_add_explicit(&s->refs, 1, memory_order_relaxed);
+    return s;
+}
+
+// a reference to the current set for threads that hold on to it while
+// blocking. r only has to be online for the duration of the call
+proxy_set *proxy_set_snapshot(_Atomic(proxy_set *) *cur, rcu_reader *r)
+{
+    rcu_online(r);
+    proxy_set *s = proxy_set_get(atomic_load_explicit(cur, memory_order_acquire));
+    rcu_offline(r);
+    return s;
+}
+
+void proxy_set_put(proxy_set *s)
+{
+    if (atomic_fetch_sub_explicit(&s->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    for (size_t i = 0; i < s->len; i++)
+        proxy_unref(s->proxies[i]);
+    for (size_t i = 0; i < s->poolslots; i++) {
+        if (s->pools[i].name == NULL) continue;
+        free(s->pools[i].name);
+        proxy_set_put(s->pools[i].set);
+    }
+    free(s->pools);
+    free(s->proxies);
+    free(s->ring);
+    free(s->alias);
+    free(s);
+}
+
+// skips proxies at max_conns, and the ones the health checker marked down
+// unless all of them are. NULL when every proxy tried was full
+proxy_info *proxy_set_next(proxy_set *s, int rotation)
+{
+    bool skip_down = atomic_load_explicit(&s->ndown, memory_order_relaxed) < s->len;
+    proxy_info *fallback = NULL;
+
+    for (size_t tries = 0; tries < s->len; tries++) {
+        proxy_info *p = proxy_set_pick(s, rotation);
+        if (proxy_full(p)) continue;
+        if (!skip_down || !atomic_load_explicit(&p->down, memory_order_relaxed)) return p;
+        fallback = p;
+    }
+
+    return fallback;
+}
+
+static proxy_info *proxy_set_pick(proxy_set *s, int rotation)
+{
+    size_t i;
+
+    switch (rotation) {
+    case ROTATION_STRIPED:
+        // every thread walks the ring on its own from a spread out offset,
+        // nothing is shared after the first pick
+        if (!has_stripe) {
+            stripe = atomic_fetch_add(&nstripes, 1) * (size_t)0x9e3779b97f4a7c15ULL;
+            has_stripe = 1;
+        }
+        i = stripe++;
+        break;
+    case ROTATION_LEASTCONN:
+        {
+            // least loaded of a small round robin window, the windows of
+            // consecutive picks don't overlap
+            i = atomic_fetch_add_explicit(&s->cursor, LEASTCONN_WINDOW, memory_order_relaxed);
+            proxy_info *best = proxy_set_column(s, i, mix32(i));
+            for (size_t j = 1; j < LEASTCONN_WINDOW && j < s->len; j++)
+                best = least_loaded(best, proxy_set_column(s, i + j, mix32(i + j)));
+            return best;
+        }
+    case ROTATION_P2C:
+        return least_loaded(proxy_set_draw(s), proxy_set_draw(s));
+    case ROTATION_LATENCY:
+        return least_cost(proxy_set_draw(s), proxy_set_draw(s));
+    default:
+        i = atomic_fetch_add_explicit(&s->cursor, 1, memory_order_relaxed);
+        break;
+    }
+
+    return proxy_set_column(s, i, mix32(i));
+}
+
+// the proxy column i of the pick table stands for. with equal weights
+// that's just proxies[i], so round robin stays strict
+static proxy_info *proxy_set_column(proxy_set *s, size_t i, uint32_t coin)
+{
+    i %= s->len;
+    if (s->alias && coin >= s->alias[i].prob)
+        i = s->alias[i].index;
+    return s->proxies[i];
+}
+
+// a random proxy, as likely as its weight
+static proxy_info *proxy_set_draw(proxy_set *s)
+{
+    uint64_t r = rng_next();
+    return proxy_set_column(s, r >> 32, r);
+}
+
+// fewest connections per unit of weight, full and down proxies last
+static proxy_info *least_loaded(proxy_info *a, proxy_info *b)
+{
+    bool aout = atomic_load_explicit(&a->down, memory_order_relaxed) || proxy_full(a);
+    bool bout = atomic_load_explicit(&b->down, memory_order_relaxed) || proxy_full(b);
+    if (aout != bout) return aout ? b : a;
+
+    uint64_t ai = atomic_load_explicit(&a->inflight, memory_order_relaxed);
+    uint64_t bi = atomic_load_explicit(&b->inflight, memory_order_relaxed);
+    ai *= atomic_load_explicit(&b->weight, memory_order_relaxed);
+    bi *= atomic_load_explicit(&a->weight, memory_order_relaxed);
+    return bi < ai ? b : a;
+}
+
+// expected wait, latency scaled by the connections already queued on it
+// and shared out by weight. unmeasured proxies cost nothing so they get
+// tried early
+static proxy_info *least_cost(proxy_info *a, proxy_info *b)
+{
+    bool aout = atomic_load_explicit(&a->down, memory_order_relaxed) || proxy_full(a);
+    bool bout = atomic_load_explicit(&b->down, memory_order_relaxed) || proxy_full(b);
+    if (aout != bout) return aout ? b : a;
+
+    uint64_t ac = (uint64_t)atomic_load_explicit(&a->latency, memory_order_relaxed) *
+                  (atomic_load_explicit(&a->inflight, memory_order_relaxed) + 1) /
+                  atomic_load_explicit(&a->weight, memory_order_relaxed);
+    uint64_t bc = (uint64_t)atomic_load_explicit(&b->latency, memory_order_relaxed) *
+                  (atomic_load_explicit(&b->inflight, memory_order_relaxed) + 1) /
+                  atomic_load_explicit(&b->weight, memory_order_relaxed);
+    return bc < ac ? b : a;
+}
+
+// per thread xorshift64*
+static uint64_t rng_next(void)
+{
+    if (rng == 0)
+        rng = (uint64_t)now_us() ^ (uint64_t)(uintptr_t)&rng ^ 0x9e3779b97f4a7c15ULL;
+
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545f4914f6cdd1dULL;
+}
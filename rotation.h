@@ -0,0 +1,86 @@
+#pragma once
+
+#include "proxy.h"
+#include "rcu.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROTATION_ROUNDROBIN 0
+#define ROTATION_STRIPED    1
+#define ROTATION_LEASTCONN  2
+#define ROTATION_P2C        3
+#define ROTATION_LATENCY    4
+
+// a point on the affinity hash ring, owned by proxies[index]
+typedef struct ring_point {
+    uint32_t hash;
+    uint32_t index;
+} ring_point;
+
+// a column of the weighted pick table: it stands for its own proxy with
+// probability prob / 2^32 and for proxies[index] otherwise
+typedef struct proxy_alias {
+    uint32_t prob;
+    uint32_t index;
+} proxy_alias;
+
+typedef struct proxy_pool proxy_pool;
+
+// an immutable snapshot of the proxy list. reloads publish a new one and
+// retire the old one once nobody can be reading it anymore
+typedef struct proxy_set {
+    proxy_info **proxies;
+    size_t len, cap;
+    ring_point *ring;              // sorted by hash, NULL without affinity
+    size_t nring;
+    proxy_alias *alias;            // one per proxy, NULL when weights are equal
+    proxy_pool *pools;             // open addressing by name, NULL without any
+    size_t npools, poolslots;
+    unsigned long gen;
+    atomic_uint refs;
+    atomic_size_t ndown;           // a hint, recounted by the health checker
+    // written on every strict round robin pick, kept off the read-mostly line
+    _Alignas(64) atomic_size_t cursor;
+} proxy_set;
+
+// the entries of a set tagged pool=NAME, a set of their own with its own
+// pick table, ring and cursor
+struct proxy_pool {
+    char *name;                    // NULL marks a free slot
+    struct proxy_set *set;
+};
+
+// an entry taken over by a reload and the options its new line gives it
+typedef struct proxy_kept {
+    proxy_info *proxy;
+    proxy_opts opts;               // pool cleared, the line is gone by then
+} proxy_kept;
+
+// the live set's entries by identity, so a reload hands unchanged ones
+// over with their health, latency and stats instead of parsing them anew
+typedef struct proxy_index {
+    proxy_set *set;
+    size_t *slots;                 // open addressing over set's indexes
+    size_t nslots;
+    atomic_bool *used;
+    proxy_kept *kept_opts;         // applied by proxy_index_retire()
+    size_t kept;
+} proxy_index;
+
+int rotation_from_str(const char *str);
+proxy_set *proxy_set_new(void);
+int proxy_set_load(proxy_set *s, const char *path, proxy_index *x);
+void proxy_index_init(proxy_index *x, proxy_set *old);
+void proxy_index_retire(proxy_index *x);
+void proxy_index_free(proxy_index *x);
+proxy_set *proxy_set_pool(proxy_set *s, const char *name);
+void proxy_set_recount(proxy_set *s);
+void proxy_set_weigh(proxy_set *s);
+void proxy_set_ring(proxy_set *s);
+proxy_info *proxy_set_affine(proxy_set *s, uint32_t key, size_t i);
+uint32_t affinity_key(const char *str, size_t len);
+proxy_set *proxy_set_get(proxy_set *s);
+proxy_set *proxy_set_snapshot(_Atomic(proxy_set *) *cur, rcu_reader *r);
+void proxy_set_put(proxy_set *s);
+proxy_info *proxy_set_next(proxy_set *s, int rotation);
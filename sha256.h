@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+typedef struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t len;                  // bytes hashed so far
+    unsigned char block[64];
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *c);
+void sha256_update(sha256_ctx *c, const void *data, size_t len);
+void sha256_final(sha256_ctx *c, unsigned char out[SHA256_LEN]);
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include "slab.h"
+#include "util.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// bytes per block, also its alignment so an object finds its block by
+// masking its address
+#define SLAB_BLOCK (64 * 1024)
+
+typedef struct slab_block {
+    struct slab_block *prev, *next; // slab->partial
+    void *free;                     // objects handed back, linked through their first word
+    size_t carved;                  // objects ever taken from the tail
+    size_t live;
+    bool listed;
+    _Alignas(max_align_t) unsigned char data[];
+} slab_block;
+
+static slab_block *block_new(slab *s);
+static void block_unlink(slab *s, slab_block *b);
+static void block_release(slab_block *b);
+
+void slab_init(slab *s, size_t size)
+{
+    size_t align = _Alignof(max_align_t);
+    memset(s, 0, sizeof(*s));
+    s->size = (size + align - 1) & ~(align - 1);
+    s->per = (SLAB_BLOCK - sizeof(slab_block)) / s->size;
+    if (s->per == 0) die("slab: %zu byte objects don't fit a block", size);
+}
+
+// zeroed memory, NULL when out of it
+void *slab_alloc(slab *s)
+{
+    slab_block *b = s->partial;
+    if (b == NULL && (b = block_new(s)) == NULL)
+        return NULL;
+
+    void *p = b->free;
+    if (p) memcpy(&b->free, p, sizeof(void *));
+    else p = b->data + b->carved++ * s->size;
+
+    if (++b->live == s->per)
+        block_unlink(s, b);
+    return memset(p, 0, s->size);
+}
+
+void slab_free(slab *s, void *p)
+{
+    slab_block *b = (slab_block *)((uintptr_t)p & ~(uintptr_t)(SLAB_BLOCK - 1));
+
+    memcpy(p, &b->free, sizeof(void *));
+    b->free = p;
+
+    if (!b->listed) {
+        b->prev = NULL;
+        b->next = s->partial;
+        if (s->partial) s->partial->prev = b;
+        s->partial = b;
+        b->listed = true;
+    }
+
+    if (--b->live) return;
+    block_unlink(s, b);
+    if (s->spare) block_release(s->spare);
+    s->spare = b;
+}
+
+// every object goes with its block
+void slab_destroy(slab *s)
+{
+    while (s->partial) {
+        slab_block *b = s->partial;
+        block_unlink(s, b);
+        block_release(b);
+    }
+    if (s->spare) block_release(s->spare);
+    s->spare = NULL;
+}
+
+// mmap only promises page alignment, so map twice the size and trim
+static slab_block *block_new(slab *s)
+{
+    slab_block *b = s->spare;
+
+    if (b) {
+        s->spare = NULL;
+    } else {
+        unsigned char *m = mmap(NULL, SLAB_BLOCK * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) return NULL;
+
+        unsigned char *start = (unsigned char *)(((uintptr_t)m + SLAB_BLOCK - 1) & ~(uintptr_t)(SLAB_BLOCK - 1));
+        if (start != m) munmap(m, start - m);
+        munmap(start + SLAB_BLOCK, m + SLAB_BLOCK - start);
+        b = (slab_block *)start;
+    }
+
+    memset(b, 0, sizeof(*b));
+    b->next = s->partial;
+    if (s->partial) s->partial->prev = b;
+    s->partial = b;
+    b->listed = true;
+    return b;
+}
+
+static void block_unlink(slab *s, slab_block *b)
+{
+    if (!b->listed) return;
+    if (b->prev) b->prev->next = b->next;
+    else s->partial = b->next;
+    if (b->next) b->next->prev = b->prev;
+    b->prev = b->next = NULL;
+    b->listed = false;
+}
+
+static void block_release(slab_block *b)
+{
+    munmap(b, SLAB_BLOCK);
+}
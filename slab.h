@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+// fixed size objects carved out of aligned blocks. a block goes back to
+// the system once all of its objects are freed, so a burst doesn't stay
+// resident. not thread safe, each worker owns its own
+typedef struct slab {
+    size_t size;                   // of one object, rounded up for alignment
+    size_t per;                    // objects per block
+    struct slab_block *partial;    // blocks with room left
+    struct slab_block *spare;      // one empty block kept against churn
+} slab;
+
+void slab_init(slab *s, size_t size);
+void *slab_alloc(slab *s);
+void slab_free(slab *s, void *p);
+void slab_destroy(slab *s);
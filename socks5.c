@@ -3,48 +3,251 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
-static int socks5_userpass_auth(proxy_info *proxy, int fd);
+static size_t socks5_greeting(const proxy_info *proxy, unsigned char *buf, bool only);
+static size_t socks5_userpass(const proxy_info *proxy, unsigned char *buf);
+static size_t socks5_connect(const proxy_info *proxy, unsigned char *buf);
+static size_t socks5_put_addr(unsigned char *buf, const struct sockaddr_storage *addr, const void *port);
+static int socks5_authenticated(negotiation *n);
+static void socks5_send(negotiation *n, int state, size_t len);
+static void socks5_expect(negotiation *n, int state);
+static void socks5_hello(negotiation *n);
 
-int socks5_auth(proxy_info *proxy, int fd)
+// with pipeline, req is the client's request for the exit hop. it goes out
+// right after that hop's greeting and its reply is left unread on fd
+void socks5_negotiation_init(negotiation *n, proxy_info *proxy, bool pipeline, const unsigned char *req, size_t reqlen)
 {
-    // ver + nmethods + methods
-    unsigned char buf[4];
+    n->cur = proxy;
+    n->pipeline = pipeline;
+    n->req = pipeline ? req : NULL;
+    n->reqlen = reqlen;
+    socks5_hello(n);
+}
+
+int socks5_negotiate(negotiation *n, int fd)
+{
+    int r;
+    size_t need;
+
+    for (;;) {
+        switch (n->state) {
+        case SOCKS5_GREETING:
+        case SOCKS5_USERPASS:
+        case SOCKS5_CONNECT:
+            if ((r = send_exact(fd, n->buf, n->len, &n->off)) != 0) return r;
+            n->state++;
+            n->len = 0;
+            break;
+
+        case SOCKS5_METHOD:
+            if ((r = recv_exact(fd, n->buf, 2, &n->len)) != 0) return r;
+            if (n->buf[0] != 5) return -1;
+
+            // when pipelining only one method was offered and everything
+            // after the greeting is already on the wire
+            switch (n->buf[1]) {
+            case SOCKS5_NO_AUTH:
+                if (n->pipeline && n->cur->user) return -1;
+                if (socks5_authenticated(n)) return 0;
+                break;
+            case SOCKS5_USERPASS_AUTH:
+                if (n->pipeline)
+                    socks5_expect(n, SOCKS5_USERPASS_REPLY);
+                else
+                    socks5_send(n, SOCKS5_USERPASS, socks5_userpass(n->cur, n->buf));
+                break;
+            default:
+                return -1;
+            }
+            break;
+
+        case SOCKS5_USERPASS_REPLY:
+            if ((r = recv_exact(fd, n->buf, 2, &n->len)) != 0) return r;
+            if (n->buf[0] != 1 || n->buf[1] != 0) return -1;
+            if (socks5_authenticated(n)) return 0;
+            break;
+
+        case SOCKS5_CONNECT_REPLY:
+            // ver + rep + rsv + atyp + first address byte
+            if ((r = recv_exact(fd, n->buf, 5, &n->len)) != 0) return r;
+            if (socks5_message_len(n->buf, &need) != 0) return -1;
+            if ((r = recv_exact(fd, n->buf, need, &n->len)) != 0) return r;
+            if (n->buf[0] != 5 || n->buf[1] != 0) return -1;
+
+            n->cur = n->cur->chain;
+            socks5_hello(n);
+            break;
+
+        default:
+            return -1;
+        }
+    }
+}
+
+// requests and replies share a layout, the whole length follows from the
+// first 5 bytes
+int socks5_message_len(const unsigned char *buf, size_t *len)
+{
+    switch (buf[3]) {
+    case SOCKS5_ATYP_IPV4: *len = 4 + 4 + 2; return 0;
+    case SOCKS5_ATYP_DOMAIN: *len = 4 + 1 + buf[4] + 2; return 0;
+    case SOCKS5_ATYP_IPV6: *len = 4 + 16 + 2; return 0;
+    default: return -1;
+    }
+}
+
+// a failure reply, bound to 0.0.0.0:0
+size_t socks5_reply(unsigned char *buf, int rep)
+{
+    memset(buf, 0, 10);
     buf[0] = 5;
-    buf[1] = proxy->user ? 2 : 1;
+    buf[1] = rep;
+    buf[3] = SOCKS5_ATYP_IPV4;
+    return 10;
+}
 
-    if (proxy->user) {
-        buf[2] = 2;
-        buf[3] = 0;
-    } else {
-        buf[2] = 0;
+// rewrites the request in buf from a domain name to addr, in place
+size_t socks5_resolved(unsigned char *buf, const struct sockaddr_storage *addr)
+{
+    unsigned char port[2];
+    memcpy(port, &buf[5 + buf[4]], 2);
+
+    if (addr->ss_family == AF_INET) {
+        buf[3] = SOCKS5_ATYP_IPV4;
+        memcpy(&buf[4], &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        memcpy(&buf[8], port, 2);
+        return 4 + 4 + 2;
     }
 
-    size_t buflen = proxy->user ? 4 : 3;
-    if (write(fd, buf, buflen) != (ssize_t)buflen) return -1;
+    buf[3] = SOCKS5_ATYP_IPV6;
+    memcpy(&buf[4], &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    memcpy(&buf[20], port, 2);
+    return 4 + 16 + 2;
+}
 
-    if (read(fd, buf, 2) != 2) return -1;
+// a UDP ASSOCIATE from 0.0.0.0:0, proxyrot's datagrams may come from any port
+size_t socks5_associate(unsigned char *buf)
+{
+    memset(buf, 0, 10);
+    buf[0] = 5;
+    buf[1] = SOCKS5_CMD_UDP_ASSOCIATE;
+    buf[3] = SOCKS5_ATYP_IPV4;
+    return 10;
+}
 
-    if (buf[0] != 5) return -1;
+// a success reply bound to addr
+size_t socks5_bound(unsigned char *buf, const struct sockaddr_storage *addr)
+{
+    const void *port = addr->ss_family == AF_INET ?
+        (const void *)&((const struct sockaddr_in *)addr)->sin_port :
+        (const void *)&((const struct sockaddr_in6 *)addr)->sin6_port;
 
-    switch (buf[1]) {
-    case 0:
+    buf[0] = 5;
+    buf[1] = 0;
+    buf[2] = 0;
+    return socks5_put_addr(buf, addr, port);
+}
+
+// the header of a datagram to a name, hdr, rebuilt into buf for addr
+size_t socks5_udp_resolved(unsigned char *buf, const unsigned char *hdr, const struct sockaddr_storage *addr)
+{
+    memset(buf, 0, 3);
+    return socks5_put_addr(buf, addr, &hdr[5 + hdr[4]]);
+}
+
+// the address of a request, reply or datagram header, -1 for a name
+int socks5_sockaddr(const unsigned char *buf, struct sockaddr_storage *addr, socklen_t *len)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (buf[3] == SOCKS5_ATYP_IPV4) {
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+        in->sin_family = AF_INET;
+        memcpy(&in->sin_addr, &buf[4], 4);
+        memcpy(&in->sin_port, &buf[8], 2);
+        *len = sizeof(*in);
+        return 0;
+    }
+
+    if (buf[3] == SOCKS5_ATYP_IPV6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+        in6->sin6_family = AF_INET6;
+        memcpy(&in6->sin6_addr, &buf[4], 16);
+        memcpy(&in6->sin6_port, &buf[20], 2);
+        *len = sizeof(*in6);
         return 0;
-    case 2:
-        return socks5_userpass_auth(proxy, fd);
-    default:
-        return -1;
     }
+
+    return -1;
 }
 
-static int socks5_userpass_auth(proxy_info *proxy, int fd)
+static void socks5_send(negotiation *n, int state, size_t len)
+{
+    n->state = state;
+    n->off = 0;
+    n->len = len;
+}
+
+static void socks5_expect(negotiation *n, int state)
+{
+    n->state = state;
+    n->len = 0;
+}
+
+// queues the greeting for n->cur. when pipelining, the userpass request
+// and the CONNECT to the next hop, or the client's request to the exit
+// hop, go out in the same write
+static void socks5_hello(negotiation *n)
+{
+    size_t len = socks5_greeting(n->cur, n->buf, n->pipeline);
+
+    if (n->pipeline) {
+        if (n->cur->user)
+            len += socks5_userpass(n->cur, n->buf + len);
+        if (n->cur->chain) {
+            len += socks5_connect(n->cur->chain, n->buf + len);
+        } else if (n->req) {
+            memcpy(n->buf + len, n->req, n->reqlen);
+            len += n->reqlen;
+        }
+    }
+
+    socks5_send(n, SOCKS5_GREETING, len);
+}
+
+// returns 1 when the whole chain is negotiated, otherwise queues the
+// CONNECT to the next hop
+static int socks5_authenticated(negotiation *n)
+{
+    if (n->cur->chain == NULL) return 1;
+    if (n->pipeline)
+        socks5_expect(n, SOCKS5_CONNECT_REPLY);
+    else
+        socks5_send(n, SOCKS5_CONNECT, socks5_connect(n->cur->chain, n->buf));
+    return 0;
+}
+
+static size_t socks5_greeting(const proxy_info *proxy, unsigned char *buf, bool only)
+{
+    // ver + nmethods + methods
+    buf[0] = 5;
+    buf[1] = proxy->user && !only ? 2 : 1;
+
+    if (proxy->user) {
+        buf[2] = SOCKS5_USERPASS_AUTH;
+        buf[3] = SOCKS5_NO_AUTH;
+    } else {
+        buf[2] = SOCKS5_NO_AUTH;
+    }
+
+    return 2 + buf[1];
+}
+
+static size_t socks5_userpass(const proxy_info *proxy, unsigned char *buf)
 {
     // ver + ulen + max uname + plen + max passwd
-    unsigned char buf[1 + 1 + 255 + 1 + 255];
     unsigned char *tmp = buf;
 
     size_t ulen = proxy->user ? strlen(proxy->user) : 0;
@@ -60,45 +263,45 @@ static int socks5_userpass_auth(proxy_info *proxy, int fd)
         memcpy(tmp, proxy->pass, plen);
     tmp+=plen;
 
-    if (write(fd, buf, tmp - buf) != tmp - buf) return -1;
-
-    if (read(fd, buf, 2) != 2) return -1;
-
-    if (buf[0] != 1) return -1;
-
-    if (buf[1] != 0) return -1;
-
-    return 0;
+    return tmp - buf;
 }
 
-int socks5_handler(proxy_info *proxy, int cfd, int pfd)
+static size_t socks5_connect(const proxy_info *proxy, unsigned char *buf)
 {
-    (void)proxy;
-    // TODO convert socks5h to socks5 if needed
+    // TODO support for socks5 without domainname atyp
+    size_t hostlen = strlen(proxy->host);
+    assert(hostlen <= 0xff);
+    uint16_t port = htons(atoi(proxy->port));
 
-    if (bridge_fd(cfd, pfd) != 0) {
-        fprintf(stderr, "connection failed\n");
-        return -1;
-    }
+    buf[0] = 5;
+    buf[1] = 1;
+    buf[2] = 0;
+    buf[3] = 3;
+    buf[4] = hostlen;
+    memcpy(&buf[5], proxy->host, hostlen);
+    memcpy(&buf[5 + hostlen], &port, 2);
 
-    return 0;
+    return 5 + hostlen + 2;
 }
 
-int socks5_chain(proxy_info *proxy, int fd)
+// atyp + addr + port from buf[3] on. IPv4 clients of a dual stack listener
+// get their IPv4 address back
+static size_t socks5_put_addr(unsigned char *buf, const struct sockaddr_storage *addr, const void *port)
 {
-    // TODO support for socks5 without domainname atyp
-    unsigned char reqbuf[4] = {5,1,0,3};
-    if (write(fd, reqbuf, sizeof(reqbuf)) != sizeof(reqbuf)) return 1;
-    size_t hostlen = strlen(proxy->host);
-    assert(hostlen <= 0xff);
-    uint16_t port = htons(atoi(proxy->port));
-    if (write(fd, &(unsigned char){(unsigned char)hostlen}, 1) != 1) return 1;
-    if (write(fd, proxy->host, hostlen) != (ssize_t)hostlen) return 1;
-    if (write(fd, &port, 2) != 2) return 1;
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
 
-    unsigned char repbuf[1+1+1+1+0xff+1+2];
-    if (read(fd, repbuf, sizeof(repbuf)) < 2) return 1;
-    if (repbuf[1] != 0) return 1;
+    if (addr->ss_family == AF_INET || IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+        buf[3] = SOCKS5_ATYP_IPV4;
+        if (addr->ss_family == AF_INET)
+            memcpy(&buf[4], &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        else
+            memcpy(&buf[4], &in6->sin6_addr.s6_addr[12], 4);
+        memcpy(&buf[8], port, 2);
+        return 4 + 4 + 2;
+    }
 
-    return 0;
+    buf[3] = SOCKS5_ATYP_IPV6;
+    memcpy(&buf[4], &in6->sin6_addr, 16);
+    memcpy(&buf[20], port, 2);
+    return 4 + 16 + 2;
 }
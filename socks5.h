@@ -6,6 +6,33 @@
 #define SOCKS5_NO_AUTH       0
 #define SOCKS5_USERPASS_AUTH 2
 
-int socks5_auth(proxy_info *proxy, int fd);
-int socks5_chain(proxy_info *proxy, int fd);
-int socks5_handler(proxy_info *proxy, int cfd, int pfd);
+#define SOCKS5_CMD_CONNECT       1
+#define SOCKS5_CMD_UDP_ASSOCIATE 3
+
+#define SOCKS5_ATYP_IPV4   1
+#define SOCKS5_ATYP_DOMAIN 3
+#define SOCKS5_ATYP_IPV6   4
+
+// reply codes
+#define SOCKS5_REP_FAILURE     1
+#define SOCKS5_REP_UNREACHABLE 4
+#define SOCKS5_REP_COMMAND     7
+#define SOCKS5_REP_ATYP        8
+
+// negotiation states
+#define SOCKS5_GREETING       0
+#define SOCKS5_METHOD         1
+#define SOCKS5_USERPASS       2
+#define SOCKS5_USERPASS_REPLY 3
+#define SOCKS5_CONNECT        4
+#define SOCKS5_CONNECT_REPLY  5
+
+void socks5_negotiation_init(negotiation *n, proxy_info *proxy, bool pipeline, const unsigned char *req, size_t reqlen);
+int socks5_negotiate(negotiation *n, int fd);
+int socks5_message_len(const unsigned char *buf, size_t *len);
+size_t socks5_reply(unsigned char *buf, int rep);
+size_t socks5_resolved(unsigned char *buf, const struct sockaddr_storage *addr);
+size_t socks5_associate(unsigned char *buf);
+size_t socks5_bound(unsigned char *buf, const struct sockaddr_storage *addr);
+size_t socks5_udp_resolved(unsigned char *buf, const unsigned char *hdr, const struct sockaddr_storage *addr);
+int socks5_sockaddr(const unsigned char *buf, struct sockaddr_storage *addr, socklen_t *len);
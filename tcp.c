@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include "tcp.h"
+#include "util.h"
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// unanswered keepalive probes before a peer counts as gone
+#define TCP_KEEPALIVE_PROBES 3
+// the kernel's limit for TCP_KEEPIDLE
+#define TCP_KEEPALIVE_MAX 32767
+
+static bool fastopen, quickack, deferaccept;
+static int keepalive, sndbuf, rcvbuf;
+
+static int tcp_number(const char *val, int max, int *out);
+static int tcp_set(int fd, int level, int name, int val);
+static int tcp_common(int fd);
+
+// opts is a comma separated list of fastopen, quickack, deferaccept,
+// keepalive=SECONDS, sndbuf=BYTES and rcvbuf=BYTES. returns -1 on anything
+// else
+int tcp_configure(const char *opts)
+{
+    char *const keys[] = {"fastopen", "quickack", "keepalive", "sndbuf", "rcvbuf", "deferaccept", NULL};
+    char *copy = strdup(opts), *s = copy, *val;
+    int r = 0;
+
+    if (copy == NULL) die("strdup:");
+
+    while (*s && r == 0) {
+        switch (getsubopt(&s, keys, &val)) {
+        case 0:
+            if (val) r = -1;
+            fastopen = true;
+            break;
+        case 1:
+            if (val) r = -1;
+            quickack = true;
+            break;
+        case 2:
+            r = tcp_number(val, TCP_KEEPALIVE_MAX, &keepalive);
+            break;
+        case 3:
+            r = tcp_number(val, INT_MAX, &sndbuf);
+            break;
+        case 4:
+            r = tcp_number(val, INT_MAX, &rcvbuf);
+            break;
+        case 5:
+            if (val) r = -1;
+            deferaccept = true;
+            break;
+        default:
+            r = -1;
+        }
+    }
+
+    free(copy);
+    return r;
+}
+
+// accepted sockets inherit everything but quickack from their listener.
+// clients speak first, with deferaccept they are only accepted once they
+// did or after defer_s seconds
+int tcp_listener(int fd, int backlog, int defer_s)
+{
+    if (tcp_common(fd) != 0) return -1;
+    if (deferaccept && tcp_set(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_s) != 0) return -1;
+    if (fastopen && tcp_set(fd, IPPROTO_TCP, TCP_FASTOPEN, backlog) != 0) return -1;
+    return 0;
+}
+
+void tcp_accepted(int fd)
+{
+    if (quickack) tcp_set(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+}
+
+// before connect(). with fastopen the connect returns right away when the
+// kernel has a cookie for the proxy, and the first write goes out in the SYN
+int tcp_dialing(int fd)
+{
+    if (tcp_common(fd) != 0) return -1;
+    if (fastopen && tcp_set(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1) != 0) return -1;
+    if (quickack && tcp_set(fd, IPPROTO_TCP, TCP_QUICKACK, 1) != 0) return -1;
+    return 0;
+}
+
+static int tcp_number(const char *val, int max, int *out)
+{
+    char *end;
+
+    if (val == NULL) return -1;
+    long n = strtol(val, &end, 10);
+    if (*val == 0 || *end != 0 || n <= 0 || n > max) return -1;
+    *out = n;
+    return 0;
+}
+
+static int tcp_set(int fd, int level, int name, int val)
+{
+    return setsockopt(fd, level, name, &val, sizeof(val));
+}
+
+// handshake messages and the tail of a relayed burst are small writes,
+// Nagle would hold them back until the peer's delayed ACK
+static int tcp_common(int fd)
+{
+    if (tcp_set(fd, IPPROTO_TCP, TCP_NODELAY, 1) != 0) return -1;
+    if (sndbuf && tcp_set(fd, SOL_SOCKET, SO_SNDBUF, sndbuf) != 0) return -1;
+    if (rcvbuf && tcp_set(fd, SOL_SOCKET, SO_RCVBUF, rcvbuf) != 0) return -1;
+
+    if (keepalive) {
+        int intvl = keepalive / TCP_KEEPALIVE_PROBES;
+        if (tcp_set(fd, SOL_SOCKET, SO_KEEPALIVE, 1) != 0) return -1;
+        if (tcp_set(fd, IPPROTO_TCP, TCP_KEEPIDLE, keepalive) != 0) return -1;
+        if (tcp_set(fd, IPPROTO_TCP, TCP_KEEPINTVL, intvl ? intvl : 1) != 0) return -1;
+        if (tcp_set(fd, IPPROTO_TCP, TCP_KEEPCNT, TCP_KEEPALIVE_PROBES) != 0) return -1;
+    }
+
+    return 0;
+}
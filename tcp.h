@@ -0,0 +1,6 @@
+#pragma once
+
+int tcp_configure(const char *opts);
+int tcp_listener(int fd, int backlog, int defer_s);
+void tcp_accepted(int fd);
+int tcp_dialing(int fd);
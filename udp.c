@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include "udp.h"
+#include "dns.h"
+#include "socks5.h"
+#include <errno.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// sends per sendmmsg(), a train counts as one unless it has to be split
+#define UDP_OUT 64
+// rsv + frag + atyp + IPv6 + port, the largest header a name is swapped for
+#define UDP_HDRMAX (4 + 16 + 2)
+
+#define WOULD_BLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == EINTR)
+// ICMP errors a connected socket reports once, later datagrams may get through
+#define UDP_SOFT(e) ((e) == ECONNREFUSED || (e) == EHOSTUNREACH || (e) == ENETUNREACH)
+
+// what one pump needs, allocated per worker thread on its first datagram
+typedef struct udp_batch {
+    struct mmsghdr in[UDP_BATCH];
+    struct iovec in_iov[UDP_BATCH];
+    struct sockaddr_storage in_name[UDP_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } in_ctl[UDP_BATCH];
+    struct mmsghdr out[UDP_OUT];
+    struct iovec out_iov[UDP_OUT][2];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } out_ctl[UDP_OUT];
+    unsigned char out_hdr[UDP_OUT][UDP_HDRMAX];
+    size_t nout;
+    char data[UDP_BATCH][UDP_BUFSZ];
+} udp_batch;
+
+static _Thread_local udp_batch *batch;
+
+static int udp_socket(int family);
+static void udp_set_port(struct sockaddr_storage *addr, in_port_t port);
+static bool udp_same(const struct sockaddr_storage *a, const struct sockaddr_storage *b, bool port);
+static int udp_accept(udp_relay *u, const struct msghdr *h, struct sockaddr_storage *client);
+static size_t udp_segment(struct msghdr *h, size_t len);
+static size_t udp_header_len(const unsigned char *p, size_t len);
+static void udp_outbound(udp_relay *u, unsigned char *data, size_t len, size_t seg);
+static void udp_queue(udp_relay *u, int i, const void *hdr, size_t hlen, void *data, size_t len, size_t seg);
+static void udp_flush(udp_relay *u, int i);
+
+// binds cli next to ctl's local address. a client that named its port
+// gets cli connected to it right away, otherwise its first datagram does
+int udp_open(udp_relay *u, int ctl, in_port_t port, const struct sockaddr *relay, socklen_t len, bool resolve)
+{
+    struct sockaddr_storage local, peer;
+    socklen_t llen = sizeof(local), plen = sizeof(peer);
+
+    memset(u, 0, sizeof(*u));
+    u->cli = u->up = -1;
+    u->ctl = ctl;
+    u->resolve = resolve;
+
+    if (getsockname(ctl, (struct sockaddr *)&local, &llen) != 0) return -1;
+    if (getpeername(ctl, (struct sockaddr *)&peer, &plen) != 0) return -1;
+    udp_set_port(&local, 0);
+
+    if ((u->cli = udp_socket(local.ss_family)) == -1) goto fail;
+    if (bind(u->cli, (struct sockaddr *)&local, llen) != 0) goto fail;
+    if (port) {
+        udp_set_port(&peer, port);
+        if (connect(u->cli, (struct sockaddr *)&peer, plen) != 0) goto fail;
+        u->paired = true;
+    }
+
+    if ((u->up = udp_socket(relay->sa_family)) == -1) goto fail;
+    if (connect(u->up, relay, len) != 0) goto fail;
+    return 0;
+
+fail:
+    if (u->cli != -1) close(u->cli);
+    if (u->up != -1) close(u->up);
+    u->cli = u->up = -1;
+    return -1;
+}
+
+// where the client sends its datagrams
+int udp_bound(const udp_relay *u, struct sockaddr_storage *addr)
+{
+    socklen_t len = sizeof(*addr);
+    return getsockname(u->cli, (struct sockaddr *)addr, &len);
+}
+
+// moves one batch of datagrams from cli to up (i = 0) or back (i = 1).
+// what can't be delivered is dropped like a congested network would, -1
+// only when a socket broke
+int udp_pump(udp_relay *u, int i)
+{
+    if (batch == NULL && (batch = malloc(sizeof(*batch))) == NULL) return -1;
+
+    udp_batch *b = batch;
+    for (int j = 0; j < UDP_BATCH; j++) {
+        b->in_iov[j] = (struct iovec){.iov_base = b->data[j], .iov_len = UDP_BUFSZ};
+        b->in[j].msg_hdr = (struct msghdr){
+            .msg_name = &b->in_name[j],
+            .msg_namelen = sizeof(b->in_name[j]),
+            .msg_iov = &b->in_iov[j],
+            .msg_iovlen = 1,
+            .msg_control = b->in_ctl[j].buf,
+            .msg_controllen = sizeof(b->in_ctl[j].buf),
+        };
+    }
+
+    int n = recvmmsg(i == 0 ? u->cli : u->up, b->in, UDP_BATCH, 0, NULL);
+    if (n == -1) return WOULD_BLOCK(errno) || UDP_SOFT(errno) ? 0 : -1;
+
+    bool unpaired = i == 0 && !u->paired;
+    struct sockaddr_storage client;
+    b->nout = 0;
+
+    for (int j = 0; j < n; j++) {
+        struct msghdr *h = &b->in[j].msg_hdr;
+        size_t len = b->in[j].msg_len, seg = udp_segment(h, len);
+
+        if (i == 1) {
+            // the relay's headers reach the client as they are, once it's known
+            if (u->paired) udp_queue(u, i, NULL, 0, b->data[j], len, seg);
+            continue;
+        }
+
+        if (unpaired && udp_accept(u, h, &client) != 0) continue;
+        udp_outbound(u, (unsigned char *)b->data[j], len, seg);
+    }
+
+    udp_flush(u, i);
+    return 0;
+}
+
+// frees the calling thread's batch
+void udp_cleanup(void)
+{
+    free(batch);
+    batch = NULL;
+}
+
+static int udp_socket(int family)
+{
+    int one = 1;
+    int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    // GRO hands over trains of datagrams in one read, kernels before 5.0
+    // just don't
+    if (fd != -1) setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+    return fd;
+}
+
+static void udp_set_port(struct sockaddr_storage *addr, in_port_t port)
+{
+    if (addr->ss_family == AF_INET)
+        ((struct sockaddr_in *)addr)->sin_port = port;
+    else
+        ((struct sockaddr_in6 *)addr)->sin6_port = port;
+}
+
+static bool udp_same(const struct sockaddr_storage *a, const struct sockaddr_storage *b, bool port)
+{
+    if (a->ss_family != b->ss_family) return false;
+
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *)a, *y = (const struct sockaddr_in *)b;
+        return x->sin_addr.s_addr == y->sin_addr.s_addr && (!port || x->sin_port == y->sin_port);
+    }
+
+    const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a, *y = (const struct sockaddr_in6 *)b;
+    return memcmp(&x->sin6_addr, &y->sin6_addr, 16) == 0 && (!port || x->sin6_port == y->sin6_port);
+}
+
+// until cli is connected datagrams from anywhere get queued on it. the
+// first one from the client's address pairs cli with its port, the rest
+// of the batch has to come from there too
+static int udp_accept(udp_relay *u, const struct msghdr *h, struct sockaddr_storage *client)
+{
+    const struct sockaddr_storage *from = h->msg_name;
+    socklen_t len = sizeof(*client);
+
+    if (u->paired) return udp_same(client, from, true) ? 0 : -1;
+
+    if (getpeername(u->ctl, (struct sockaddr *)client, &len) != 0) return -1;
+    if (!udp_same(client, from, false)) return -1;
+    if (connect(u->cli, h->msg_name, h->msg_namelen) != 0) return -1;
+
+    memcpy(client, from, h->msg_namelen);
+    u->paired = true;
+    return 0;
+}
+
+// the size of the datagrams in a GRO train, all but the last have it
+static size_t udp_segment(struct msghdr *h, size_t len)
+{
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(h); cm; cm = CMSG_NXTHDR(h, cm)) {
+        if (cm->cmsg_level != SOL_UDP || cm->cmsg_type != UDP_GRO) continue;
+
+        int seg;
+        memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+        if (seg > 0 && (size_t)seg < len) return seg;
+    }
+
+    return len;
+}
+
+// a datagram from the client starts like a request, except for frag in
+// place of cmd. 0 when the header is malformed or the datagram a fragment
+static size_t udp_header_len(const unsigned char *p, size_t len)
+{
+    size_t need;
+
+    if (len < 5 || p[2] != 0 || socks5_message_len(p, &need) != 0 || need > len)
+        return 0;
+    return need;
+}
+
+// a train goes on whole unless one of its datagrams needs dropping or a
+// name swapped, then they go one by one
+static void udp_outbound(udp_relay *u, unsigned char *data, size_t len, size_t seg)
+{
+    size_t off;
+
+    for (off = 0; off < len; off += seg) {
+        size_t n = len - off < seg ? len - off : seg;
+        if (udp_header_len(data + off, n) == 0) break;
+        if (u->resolve && data[off + 3] == SOCKS5_ATYP_DOMAIN) break;
+    }
+
+    if (off >= len) {
+        udp_queue(u, 0, NULL, 0, data, len, seg);
+        return;
+    }
+
+    for (off = 0; off < len; off += seg) {
+        unsigned char *p = data + off, hdr[UDP_HDRMAX];
+        size_t n = len - off < seg ? len - off : seg;
+        size_t hl = udp_header_len(p, n);
+        dns_addr addr;
+
+        if (hl == 0) continue;
+        if (!u->resolve || p[3] != SOCKS5_ATYP_DOMAIN) {
+            udp_queue(u, 0, NULL, 0, p, n, n);
+            continue;
+        }
+
+        // datagrams to a name still resolving are dropped, the lookup runs
+        if (dns_dest_lookup((char *)&p[5], p[4], &addr) != 0) continue;
+        udp_queue(u, 0, hdr, socks5_udp_resolved(hdr, p, &addr.addr), p + hl, n - hl, n - hl);
+    }
+}
+
+// queues hdr and data as one datagram, or data as a train the kernel
+// segments when seg is under len
+static void udp_queue(udp_relay *u, int i, const void *hdr, size_t hlen, void *data, size_t len, size_t seg)
+{
+    udp_batch *b = batch;
+    size_t k = b->nout;
+    struct msghdr *h = &b->out[k].msg_hdr;
+    struct iovec *iov = b->out_iov[k];
+
+    memset(h, 0, sizeof(*h));
+    h->msg_iov = iov;
+    if (hlen) {
+        memcpy(b->out_hdr[k], hdr, hlen);
+        *iov++ = (struct iovec){.iov_base = b->out_hdr[k], .iov_len = hlen};
+    }
+    *iov++ = (struct iovec){.iov_base = data, .iov_len = len};
+    h->msg_iovlen = iov - b->out_iov[k];
+
+    if (seg < len) {
+        uint16_t size = seg;
+        h->msg_control = b->out_ctl[k].buf;
+        h->msg_controllen = sizeof(b->out_ctl[k].buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(size));
+        memcpy(CMSG_DATA(cm), &size, sizeof(size));
+    }
+
+    if (++b->nout == UDP_OUT) udp_flush(u, i);
+}
+
+static void udp_flush(udp_relay *u, int i)
+{
+    udp_batch *b = batch;
+    int to = i == 0 ? u->up : u->cli;
+    size_t sent = 0;
+
+    while (sent < b->nout) {
+        int n = sendmmsg(to, &b->out[sent], b->nout - sent, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            // a full socket buffer drops the rest
+            if (WOULD_BLOCK(errno) || errno == ENOBUFS) break;
+            // this one was refused, too large or in place of an ICMP error
+            sent++;
+            continue;
+        }
+        for (int k = 0; k < n; k++)
+            u->total[i] += b->out[sent + k].msg_len;
+        sent += n;
+    }
+
+    b->nout = 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+// reads per call and direction, each a datagram or a train of them GRO
+// coalesced, so one busy association can't starve the others
+#define UDP_BATCH 32
+// the largest datagram and the largest GRO train
+#define UDP_BUFSZ 65536
+
+// both directions of a UDP association. cli is bound next to the client's
+// control connection and takes datagrams only from its address, up is
+// connected to the exit hop's relay. datagrams keep their SOCKS5 header
+// (rsv + frag + atyp + addr + port) on the way through, except that names
+// are swapped for addresses when resolve is set
+typedef struct udp_relay {
+    int cli, up;
+    int ctl;                      // the client's control connection
+    bool paired;                  // cli is connected to the client's port
+    bool resolve;
+    unsigned long long total[2];  // bytes delivered, [0] client -> upstream, [1] upstream -> client
+} udp_relay;
+
+int udp_open(udp_relay *u, int ctl, in_port_t port, const struct sockaddr *relay, socklen_t len, bool resolve);
+int udp_bound(const udp_relay *u, struct sockaddr_storage *addr);
+int udp_pump(udp_relay *u, int i);
+void udp_cleanup(void);
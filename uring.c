@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "util.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// completions per submission slot, the rest of the ops wait in the kernel
+#define URING_CQ_FACTOR 8
+// probed op codes, see uring_probe()
+#define URING_PROBE_OPS 256
+
+static int uring_probe(uring *r);
+static int uring_enter(uring *r, unsigned wait, long long ms);
+static int uring_buffers(uring *r, unsigned nbufs, size_t bufsz);
+static void buf_give(uring *r, unsigned bid);
+static struct io_uring_sqe *sqe_get(uring *r);
+
+// -1 when the kernel lacks something used here, the caller falls back to epoll
+int uring_init(uring *r, unsigned entries, unsigned nbufs, size_t bufsz)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * URING_CQ_FACTOR;
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd == -1) return -1;
+
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((p.features & need) != need || uring_probe(r) != 0)
+        goto unsupported;
+
+    // both rings share one mapping
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->rings == MAP_FAILED) {
+        r->rings = NULL;
+        goto unsupported;
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto unsupported;
+    }
+
+    char *base = r->rings;
+    r->sq_head = (unsigned *)(base + p.sq_off.head);
+    r->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    r->sq_array = (unsigned *)(base + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(base + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(base + p.cq_off.head);
+    r->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    r->tail = *r->sq_tail;
+
+    // sqes are always taken in order
+    for (unsigned i = 0; i < r->sq_entries; i++)
+        r->sq_array[i] = i;
+
+    if (uring_buffers(r, nbufs, bufsz) != 0)
+        goto unsupported;
+
+    return 0;
+
+unsupported:
+    uring_free(r);
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+void uring_free(uring *r)
+{
+    if (r->fd != -1) close(r->fd);
+    if (r->rings) munmap(r->rings, r->rings_size);
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->br) munmap(r->br, r->nbufs * sizeof(struct io_uring_buf));
+    if (r->bufs) munmap(r->bufs, r->nbufs * r->bufsz);
+    free(r->refs);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+// multishot accept, cancelling by fd and provided buffer rings all came
+// with IORING_OP_SOCKET, so that is what gets checked for them
+static int uring_probe(uring *r)
+{
+    static const unsigned char need[] = {
+        IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_ASYNC_CANCEL,
+        IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_CLOSE,
+        IORING_OP_SEND, IORING_OP_RECV, IORING_OP_SOCKET,
+    };
+
+    struct io_uring_probe *p = calloc(1, sizeof(*p) + sizeof(struct io_uring_probe_op[URING_PROBE_OPS]));
+    if (p == NULL) return -1;
+
+    int ret = -1;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, p, URING_PROBE_OPS) != 0)
+        goto out;
+
+    for (size_t i = 0; i < sizeof(need); i++)
+        if (need[i] > p->last_op || !(p->ops[need[i]].flags & IO_URING_OP_SUPPORTED))
+            goto out;
+
+    r->zc = IORING_OP_SEND_ZC <= p->last_op && p->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED;
+    ret = 0;
+
+out:
+    free(p);
+    return ret;
+}
+
+// nbufs buffers of bufsz, all handed to the kernel as buffer group 0. the
+// same memory is registered for zero copy sends when those are available
+static int uring_buffers(uring *r, unsigned nbufs, size_t bufsz)
+{
+    r->nbufs = nbufs;
+    r->bufsz = bufsz;
+
+    r->br = mmap(NULL, nbufs * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        return -1;
+    }
+
+    r->bufs = mmap(NULL, nbufs * bufsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->bufs == MAP_FAILED) {
+        r->bufs = NULL;
+        return -1;
+    }
+
+    r->refs = calloc(nbufs, 1);
+    if (r->refs == NULL) return -1;
+
+    struct io_uring_buf_reg reg = {.ring_addr = (uintptr_t)r->br, .ring_entries = nbufs, .bgid = 0};
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return -1;
+
+    for (unsigned i = 0; i < nbufs; i++)
+        buf_give(r, i);
+
+    struct iovec iov = {.iov_base = r->bufs, .iov_len = nbufs * bufsz};
+    if (r->zc && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+        r->zc = false;
+
+    return 0;
+}
+
+// submits what was queued and waits up to ms (forever when -1) for a
+// completion. returns -1 only on errors that won't go away
+int uring_wait(uring *r, long long ms)
+{
+    if (uring_enter(r, 1, ms) == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        return -1;
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek(uring *r)
+{
+    unsigned head = *r->cq_head;
+    if (head == atomic_load_explicit((_Atomic unsigned *)r->cq_tail, memory_order_acquire))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+// the peeked completion may be overwritten after this
+void uring_seen(uring *r)
+{
+    atomic_store_explicit((_Atomic unsigned *)r->cq_head, *r->cq_head + 1, memory_order_release);
+}
+
+static int uring_enter(uring *r, unsigned wait, long long ms)
+{
+    atomic_store_explicit((_Atomic unsigned *)r->sq_tail, r->tail, memory_order_release);
+    unsigned submit = r->tail - atomic_load_explicit((_Atomic unsigned *)r->sq_head, memory_order_acquire);
+
+    struct __kernel_timespec ts = {.tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000};
+    struct io_uring_getevents_arg arg = {.ts = ms >= 0 ? (uintptr_t)&ts : 0};
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+
+    return syscall(__NR_io_uring_enter, r->fd, submit, wait, flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+}
+
+// the memory of buffer bid, which the kernel just filled. it stays out of
+// the ring until its last reference is dropped
+char *uring_buf_take(uring *r, unsigned bid)
+{
+    r->refs[bid] = 1;
+    r->nfree--;
+    return r->bufs + bid * r->bufsz;
+}
+
+void uring_buf_ref(uring *r, unsigned bid)
+{
+    r->refs[bid]++;
+}
+
+void uring_buf_unref(uring *r, unsigned bid)
+{
+    if (--r->refs[bid] == 0)
+        buf_give(r, bid);
+}
+
+static void buf_give(uring *r, unsigned bid)
+{
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (r->nbufs - 1)];
+    b->addr = (uintptr_t)(r->bufs + bid * r->bufsz);
+    b->len = r->bufsz;
+    b->bid = bid;
+    r->br_tail++;
+    atomic_store_explicit((_Atomic unsigned short *)&r->br->tail, r->br_tail, memory_order_release);
+    r->nfree++;
+}
+
+// a full queue gets submitted to make room
+static struct io_uring_sqe *sqe_get(uring *r)
+{
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)r->sq_head, memory_order_acquire);
+
+    if (r->tail - head == r->sq_entries) {
+        if (uring_enter(r, 0, -1) == -1)
+            tdie("io_uring_enter:");
+        head = atomic_load_explicit((_Atomic unsigned *)r->sq_head, memory_order_acquire);
+        if (r->tail - head == r->sq_entries)
+            tdie("io_uring: submission queue stuck");
+    }
+
+    struct io_uring_sqe *sqe = &r->sqes[r->tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// one shot, ERR and HUP are reported whatever events asks for
+void uring_poll(uring *r, int fd, uint32_t events, uint64_t ud)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = ud;
+}
+
+// a poll that already fired is left alone, its completion is on the way
+void uring_poll_update(uring *r, uint64_t target, uint32_t events)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    sqe->poll32_events = events;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_UD_IGNORE;
+}
+
+// the removed poll completes with -ECANCELED
+void uring_poll_remove(uring *r, uint64_t target)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_UD_IGNORE;
+}
+
+// one completion per accepted connection until one comes without
+// IORING_CQE_F_MORE, then it has to be armed again
+void uring_accept(uring *r, int fd, uint64_t ud)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = ud;
+}
+
+// sa has to stay valid until the completion
+void uring_connect(uring *r, int fd, const struct sockaddr *sa, socklen_t len, uint64_t ud)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)sa;
+    sqe->off = len;
+    sqe->user_data = ud;
+}
+
+// the kernel picks a buffer once data is there, idle sockets hold none.
+// the completion carries its id, or -ENOBUFS when none was left
+void uring_recv(uring *r, int fd, uint64_t ud)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = r->bufsz;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = ud;
+}
+
+// buf has to be one of r's buffers for a zero copy send. those complete
+// twice: once sent, flagged IORING_CQE_F_MORE, and once the kernel let
+// go of the memory, flagged IORING_CQE_F_NOTIF
+void uring_send(uring *r, int fd, const char *buf, size_t len, bool zc, uint64_t ud)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ud;
+
+    if (zc && r->zc) {
+        sqe->opcode = IORING_OP_SEND_ZC;
+        sqe->ioprio = IORING_RECVSEND_FIXED_BUF | IORING_SEND_ZC_REPORT_USAGE;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+    }
+}
+
+// cancels whatever is pending on fd, then closes it. both run in order
+// on the next submission, before anything can reuse the number
+void uring_close(uring *r, int fd)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_UD_IGNORE;
+
+    sqe = sqe_get(r);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_UD_IGNORE;
+}
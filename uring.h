@@ -0,0 +1,60 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// user_data of an op: what it is for in the low 4 bits of a 16 byte
+// aligned pointer and 16 spare bits on top, above the 47 bits user space
+// addresses use
+#define URING_UD(ptr, op, aux) ((uint64_t)(uintptr_t)(ptr) | (uint64_t)(op) | (uint64_t)(aux) << 48)
+#define URING_UD_PTR(ud)       ((void *)(uintptr_t)((ud) & 0x0000fffffffffff0ULL))
+#define URING_UD_OP(ud)        ((unsigned)((ud) & 0xf))
+#define URING_UD_AUX(ud)       ((unsigned)((ud) >> 48))
+// completions nobody waits for
+#define URING_UD_IGNORE        0
+
+// an io_uring set up through the raw syscalls, with one group of
+// provided buffers that recvs pick from as data arrives. not thread safe,
+// each worker owns its own
+typedef struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    unsigned tail;                 // local sq tail, published on submit
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size, sqes_size;
+
+    struct io_uring_buf_ring *br;  // buffers handed to the kernel
+    char *bufs;
+    size_t bufsz;
+    unsigned nbufs, nfree;
+    unsigned short br_tail;
+    unsigned char *refs;           // per buffer, 0 while the kernel has it
+    bool zc;                       // zero copy sends from the registered buffers
+} uring;
+
+int uring_init(uring *r, unsigned entries, unsigned nbufs, size_t bufsz);
+void uring_free(uring *r);
+int uring_wait(uring *r, long long ms);
+struct io_uring_cqe *uring_peek(uring *r);
+void uring_seen(uring *r);
+
+char *uring_buf_take(uring *r, unsigned bid);
+void uring_buf_ref(uring *r, unsigned bid);
+void uring_buf_unref(uring *r, unsigned bid);
+
+void uring_poll(uring *r, int fd, uint32_t events, uint64_t ud);
+void uring_poll_update(uring *r, uint64_t target, uint32_t events);
+void uring_poll_remove(uring *r, uint64_t target);
+void uring_accept(uring *r, int fd, uint64_t ud);
+void uring_connect(uring *r, int fd, const struct sockaddr *sa, socklen_t len, uint64_t ud);
+void uring_recv(uring *r, int fd, uint64_t ud);
+void uring_send(uring *r, int fd, const char *buf, size_t len, bool zc, uint64_t ud);
+void uring_close(uring *r, int fd);
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include "users.h"
+#include "log.h"
+#include "util.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USER_SEP " \t\r\n"
+
+static int user_scan(user_table *t, user *u, char *line);
+static int scan_digest(user_table *t, user *u, const char *s);
+static int user_index(user_table *t, const char *path);
+static uint32_t hash(const char *s, size_t len);
+
+// parses a users file, one `USER sha256$SALT$HEX [pool=NAME]` per line
+// where HEX is sha256(SALT + password). NULL when it doesn't parse
+user_table *user_table_load(const char *path)
+{
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        log_report(LOG_ERROR, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    user_table *t = calloc(1, sizeof(*t));
+    if (t == NULL) die("calloc:");
+    t->arena = arena_new();
+
+    char *line = NULL;
+    size_t linecap = 0, cap = 0, lineno = 0;
+    int r = 0;
+
+    while (getline(&line, &linecap, f) != -1) {
+        lineno++;
+        if (t->len == cap) {
+            cap = cap ? cap * 2 : 1024;
+            t->users = realloc(t->users, sizeof(user[cap]));
+            if (t->users == NULL) die("realloc:");
+        }
+
+        int n = user_scan(t, &t->users[t->len], line);
+        if (n == -1) {
+            // not the line itself, it holds a password hash
+            log_report(LOG_ERROR, "%s:%zu: could not parse user", path, lineno);
+            r = -1;
+            break;
+        }
+        t->len += n;
+    }
+
+    if (r == 0 && ferror(f)) {
+        log_report(LOG_ERROR, "%s: %s", path, strerror(errno));
+        r = -1;
+    }
+
+    free(line);
+    fclose(f);
+
+    if (r == 0) r = user_index(t, path);
+    if (r != 0) {
+        user_table_free(t);
+        return NULL;
+    }
+
+    arena_seal(t->arena);
+    return t;
+}
+
+void user_table_free(user_table *t)
+{
+    if (t == NULL) return;
+    free(t->users);
+    free(t->slots);
+    arena_release(t->arena);
+    free(t);
+}
+
+const user *user_find(const user_table *t, const char *name, size_t len)
+{
+    uint32_t h = hash(name, len);
+    size_t mask = t->nslots - 1;
+
+    for (size_t i = h & mask; t->slots[i]; i = (i + 1) & mask) {
+        if (t->slots[i] >> 32 != h) continue;
+        const user *u = &t->users[(uint32_t)t->slots[i] - 1];
+        if (u->namelen == len && memcmp(u->name, name, len) == 0) return u;
+    }
+
+    return NULL;
+}
+
+// u may be NULL for a name that isn't in the table, the password is hashed
+// all the same so that a login takes as long whether or not its name exists
+bool user_check(const user *u, const char *pass, size_t len)
+{
+    static const user nobody = {.salt = ""};
+    const user *v = u ? u : &nobody;
+    unsigned char digest[SHA256_LEN];
+    sha256_ctx c;
+
+    sha256_init(&c);
+    sha256_update(&c, v->salt, v->saltlen);
+    sha256_update(&c, pass, len);
+    sha256_final(&c, digest);
+    return memeq_const(digest, v->digest, SHA256_LEN) && u != NULL;
+}
+
+// 1 when line holds a user, stored in u, 0 for blank and comment lines
+// and -1 when it is malformed
+static int user_scan(user_table *t, user *u, char *line)
+{
+    char *save, *name = strtok_r(line, USER_SEP, &save), *tok;
+    size_t len;
+
+    if (name == NULL || *name == '#') return 0;
+    if ((len = strlen(name)) > 255) return -1;
+
+    memset(u, 0, sizeof(*u));
+    u->name = arena_intern(t->arena, name, len);
+    u->namelen = len;
+
+    if ((tok = strtok_r(NULL, USER_SEP, &save)) == NULL) return -1;
+    if (scan_digest(t, u, tok) != 0) return -1;
+
+    while ((tok = strtok_r(NULL, USER_SEP, &save)) && *tok != '#') {
+        if (strncmp(tok, "pool=", 5) != 0 || tok[5] == 0) return -1;
+        u->pool = arena_intern(t->arena, tok + 5, strlen(tok + 5));
+    }
+
+    return 1;
+}
+
+// sha256$SALT$HEX
+static int scan_digest(user_table *t, user *u, const char *s)
+{
+    static const char prefix[] = "sha256$";
+
+    if (strncmp(s, prefix, sizeof(prefix) - 1) != 0) return -1;
+    s += sizeof(prefix) - 1;
+
+    const char *end = strchr(s, '$');
+    if (end == NULL || end == s || end - s > USER_SALT_MAX) return -1;
+    u->salt = arena_intern(t->arena, s, end - s);
+    u->saltlen = end - s;
+
+    s = end + 1;
+    if (strlen(s) != SHA256_LEN * 2) return -1;
+    for (size_t i = 0; i < SHA256_LEN * 2; i++) {
+        int c = tolower((unsigned char)s[i]);
+        if (!isxdigit(c)) return -1;
+        int v = isdigit(c) ? c - '0' : c - 'a' + 10;
+        u->digest[i / 2] = u->digest[i / 2] << 4 | v;
+    }
+
+    return 0;
+}
+
+// builds the slots, keeping the hash next to the index so a probe only
+// touches the record it is likely to match
+static int user_index(user_table *t, const char *path)
+{
+    if (t->len) {
+        user *users = realloc(t->users, sizeof(user[t->len]));
+        if (users) t->users = users;
+    }
+
+    t->nslots = 64;
+    while (t->nslots < t->len * 2) t->nslots *= 2;
+    t->slots = calloc(t->nslots, sizeof(uint64_t));
+    if (t->slots == NULL) die("calloc:");
+
+    for (size_t i = 0; i < t->len; i++) {
+        const user *u = &t->users[i];
+        if (user_find(t, u->name, u->namelen)) {
+            log_report(LOG_ERROR, "%s: duplicate user `%s`", path, u->name);
+            return -1;
+        }
+
+        uint32_t h = hash(u->name, u->namelen);
+        size_t j = h & (t->nslots - 1);
+        while (t->slots[j]) j = (j + 1) & (t->nslots - 1);
+        t->slots[j] = (uint64_t)h << 32 | (i + 1);
+    }
+
+    return 0;
+}
+
+// fnv-1a
+static uint32_t hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "arena.h"
+#include "sha256.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the longest salt a users file may give
+#define USER_SALT_MAX 64
+
+// one login of a users file, its strings live in the table's arena
+typedef struct user {
+    const char *name;
+    const char *salt;
+    const char *pool;              // NULL to pick from every proxy
+    unsigned char namelen, saltlen;
+    unsigned char digest[SHA256_LEN]; // sha256(salt + password)
+} user;
+
+// an immutable snapshot of a users file. reloads publish a new one and
+// free the old one once no worker can be reading it anymore
+typedef struct user_table {
+    user *users;
+    size_t len;
+    uint64_t *slots;               // name hash << 32 | index, 0 marks a free slot
+    size_t nslots;
+    arena *arena;
+} user_table;
+
+user_table *user_table_load(const char *path);
+void user_table_free(user_table *t);
+const user *user_find(const user_table *t, const char *name, size_t len);
+bool user_check(const user *u, const char *pass, size_t len);
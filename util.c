@@ -1,21 +1,64 @@
 #define _GNU_SOURCE
 #include "util.h"
-#include <poll.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
-void set_sock_timeout(int fd, int seconds)
+int recv_exact(int fd, void *buf, size_t need, size_t *len)
 {
-    struct timeval t;
-    t.tv_sec = seconds;
-    t.tv_usec = 0;
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
-    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+    while (*len < need) {
+        ssize_t n = read(fd, (char*)buf + *len, need - *len);
+        if (n == 0) return -1;
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return IO_WANT_READ;
+            return -1;
+        }
+        *len += n;
+    }
+    return 0;
+}
+
+int send_exact(int fd, const void *buf, size_t len, size_t *off)
+{
+    while (*off < len) {
+        ssize_t n = write(fd, (const char*)buf + *off, len - *off);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return IO_WANT_WRITE;
+            return -1;
+        }
+        *off += n;
+    }
+    return 0;
+}
+
+long long now_ms(void)
+{
+    return now_us() / 1000;
+}
+
+long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 1 when equal, in a time that only depends on len
+int memeq_const(const void *a, const void *b, size_t len)
+{
+    const volatile unsigned char *x = a, *y = b;
+    unsigned char d = 0;
+
+    for (size_t i = 0; i < len; i++)
+        d |= x[i] ^ y[i];
+    return d == 0;
 }
 
 void *emalloc(size_t sz)
@@ -60,49 +103,3 @@ void tdie(const char *fmt, ...)
 
     pthread_exit(NULL);
 }
-
-int bridge_fd(int fd1, int fd2)
-{
-    char buf[4096];
-    ssize_t rn1, rn2, wn1, wn2, lrn1, lrn2;
-
-    lrn1 = lrn2 = 0;
-
-    struct pollfd fds[2];
-
-    fds[0].fd     = fd1;
-    fds[0].events = POLLIN;
-    fds[1].fd     = fd2;
-    fds[1].events = POLLIN;
-
-    while (1) {
-        rn1 = rn2 = fds[0].revents = fds[1].revents = 0;
-
-        int e = poll(fds, 2, -1);
-        if (e == -1) return 1;
-
-        if ((fds[0].revents | fds[1].revents) & POLLERR) {
-            if (!((fds[0].revents | fds[1].revents) & POLLHUP))
-                return 1;
-        }
-
-        if (fds[0].revents & POLLIN) {
-            rn1 = read(fd1, buf, sizeof(buf));
-            if (rn1 == -1) return 1;
-            wn2 = write(fd2, buf, rn1);
-            if (wn2 != rn1) return 1;
-        }
-
-        if (fds[1].revents & POLLIN) {
-            rn2 = read(fd2, buf, sizeof(buf));
-            if (rn2 == -1) return 1;
-            wn1 = write(fd1, buf, rn2);
-            if (wn1 != rn2) return 1;
-        }
-
-        if ((rn1 | lrn1 | rn2 | lrn2) == 0) return 0;
-
-        lrn1 = rn1;
-        lrn2 = rn2;
-    }
-}
@@ -2,8 +2,14 @@
 
 #include <stddef.h>
 
-int bridge_fd(int fd1, int fd2);
-void set_sock_timeout(int fd, int seconds);
+#define IO_WANT_READ  1
+#define IO_WANT_WRITE 2
+
+int recv_exact(int fd, void *buf, size_t need, size_t *len);
+int send_exact(int fd, const void *buf, size_t len, size_t *off);
+long long now_ms(void);
+long long now_us(void);
+int memeq_const(const void *a, const void *b, size_t len);
 void die(const char *fmt, ...);
 void *emalloc(size_t sz);
 void tdie(const char *fmt, ...);
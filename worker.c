@@ -0,0 +1,1800 @@
+#define _GNU_SOURCE
+#include "worker.h"
+#include "dns.h"
+#include "log.h"
+#include "metrics.h"
+#include "proxyrot.h"
+#include "relay.h"
+#include "socks5.h"
+#include "tcp.h"
+#include "udp.h"
+#include "util.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_EVENTS  256
+#define MAX_ACCEPTS 64
+#define RING_ENTRIES 2048
+// rounds of up to RING_DRAIN_MS waiting for cancelled ops at exit
+#define RING_DRAIN_ROUNDS 100
+#define RING_DRAIN_MS 10
+
+// what a ring op is for, the low bits of its user_data, see URING_UD()
+#define OP_ACCEPT   1
+#define OP_WAKE     2
+#define OP_POLL_CLI 3
+#define OP_POLL_UP  4 // aux is conn->upgen
+#define OP_CONNECT  5 // aux is conn->upgen
+#define OP_DIR0     6 // aux as relay_post() sets it
+#define OP_DIR1     7
+#define OP_RESOLVED 8
+#define OP_DGRAM    9 // aux is the index in conn->dgram
+
+enum {
+    CONN_GREETING,       // reading client method selection
+    CONN_METHOD,         // sending selected method
+    CONN_USERPASS,       // reading client username/password
+    CONN_USERPASS_REPLY, // sending auth status
+    CONN_REQUEST,        // reading client request
+    CONN_REJECT,         // sending auth failure, then close
+    CONN_REFUSE,         // sending request failure, then close
+    CONN_CONNECT,        // waiting for upstream tcp connect
+    CONN_NEGOTIATE,      // auth/chain negotiation with upstream
+    CONN_RACING,         // waiting on the first of several upstream attempts
+    CONN_RESOLVE,        // waiting for the destination's address
+    CONN_FORWARD,        // sending the request upstream
+    CONN_ASSOCIATE,      // reading the exit hop's UDP ASSOCIATE reply
+    CONN_BOUND,          // telling the client where to send datagrams
+    CONN_RELAY,
+    CONN_DATAGRAM,       // relaying a UDP association
+    CONN_IDLE,           // negotiated upstream waiting in a warm pool
+    CONN_CLOSED,
+};
+
+typedef struct endpoint {
+    struct conn *conn;
+    int fd;
+    uint32_t events;
+    bool parked;                // taken out of the epoll set, see conn_park()
+    bool armed;                 // a ring poll is pending
+} endpoint;
+
+// what a connection needs only until it starts relaying
+typedef struct handshake {
+    long long dialed_at;        // us
+    long long connected_at;     // us
+    struct sockaddr_storage addr; // of the proxy, for a ring connect
+    socklen_t addrlen;
+    bool associate;             // the client asked for UDP ASSOCIATE
+    in_port_t udpport;          // where it sends datagrams from, 0 when it didn't say
+    proxy_set *pool;            // the user's own proxies, NULL for all of them
+    size_t off, len;
+    unsigned char buf[NEG_BUFSZ]; // the client's request once it's read
+    negotiation neg;
+} handshake;
+
+// kept small, a tunnel is mostly this struct while idle
+struct conn {
+    endpoint cli, up;
+    int state;
+    bool warm;                  // dialed ahead of demand, has no client
+    bool acquired;              // counted in proxy->inflight
+    unsigned char upgen;        // bumped whenever up's socket is closed
+    unsigned char starving;     // bit per direction waiting in worker->starved
+    unsigned short inflight;    // ring ops whose completions are still due
+    proxy_info *proxy;
+    handshake *hs;              // NULL once relaying or parked in a warm pool
+    long long deadline;
+    int timer;
+    struct conn *owner;         // client this upstream attempt races for
+    struct conn *attempts;      // upstream attempts racing for this client
+    unsigned nattempts;
+    struct conn *prev, *next;   // worker->conns, or worker->dead once closed
+    struct conn *tprev, *tnext; // worker->timers[timer]
+    struct conn *pprev, *pnext; // warm_pool->idle, owner->attempts, worker->starved or worker->resolving
+    union {
+        relay_dir dir[2];       // [0] client -> upstream, [1] upstream -> client
+        struct {                // a UDP association's instead
+            endpoint dgram[2];  // [0] for the client, [1] to the exit hop's relay
+            udp_relay udp;
+        };
+    };
+    uint32_t key;               // where it lands on the affinity ring
+    unsigned picks;             // proxies tried, retries walk the ring on
+    char clihost[INET6_ADDRSTRLEN];
+};
+
+// pre-negotiated upstreams of one proxy, owned by a single worker
+struct warm_pool {
+    conn *idle;        // newest first
+    unsigned nidle;
+    unsigned npending; // still connecting or negotiating
+    unsigned target;   // between warm_min and warm_max, grows on misses
+};
+
+static void worker_accept(worker *w);
+static void worker_accepted(worker *w, int res, unsigned flags);
+static void worker_reap(worker *w);
+static void worker_complete(worker *w, uint64_t ud, int res, unsigned flags);
+static void worker_unstarve(worker *w);
+static void worker_sweep(worker *w);
+static void worker_resolved(worker *w);
+static void worker_sync(worker *w);
+static void worker_expire(worker *w);
+static conn *conn_alloc(worker *w);
+static void conn_new(worker *w, int fd, const struct sockaddr_storage *cli);
+static void conn_close(worker *w, conn *c);
+static int conn_attach(worker *w, endpoint *e, int fd, uint32_t events);
+static void conn_watch(worker *w, endpoint *e, uint32_t events);
+static void conn_park(worker *w, endpoint *e);
+static void conn_unwatch(worker *w, endpoint *e);
+static uint64_t conn_poll_ud(endpoint *e);
+static void conn_hangup(worker *w, endpoint *e);
+static void conn_timer(worker *w, conn *c, int list, long long ms);
+static void conn_untimer(worker *w, conn *c);
+static void conn_expire(worker *w, conn *c);
+static void conn_event(worker *w, endpoint *e, uint32_t events);
+static void conn_client(worker *w, conn *c);
+static void conn_upstream(worker *w, conn *c);
+static void conn_refuse(worker *w, conn *c, int rep);
+static bool conn_resolves(conn *c, proxy_info *proxy);
+static void conn_prefetch(conn *c, proxy_info *proxy);
+static void conn_forward(worker *w, conn *c);
+static void conn_forward_send(worker *w, conn *c);
+static void conn_unresolve(worker *w, conn *c);
+static void conn_associate(worker *w, conn *c);
+static int conn_udp_relay(conn *c, struct sockaddr_storage *addr, socklen_t *len);
+static void conn_datagram_start(worker *w, conn *c);
+static void conn_datagram(worker *w, conn *c, endpoint *e);
+static proxy_info *exit_hop(proxy_info *proxy);
+static int conn_dial(worker *w, conn *c);
+static int conn_connect(worker *w, conn *c, int pfd);
+static int sock_error(int fd);
+static proxy_stats *conn_stats(worker *w, conn *c);
+static void conn_use(conn *c, proxy_info *proxy);
+static void conn_connected(worker *w, conn *c, int err);
+static void conn_negotiate(worker *w, conn *c);
+static void conn_upstream_failed(worker *w, conn *c);
+static void conn_release(conn *c);
+static void conn_handshaken(worker *w, conn *c);
+static void conn_relay_start(worker *w, conn *c);
+static void conn_relay(worker *w, conn *c, endpoint *e, uint32_t events);
+static void conn_relay_watch(worker *w, conn *c);
+static void conn_relay_side(worker *w, endpoint *e, relay_dir *in, relay_dir *out);
+static void conn_relay_post(conn *c, int i);
+static void conn_relay_complete(worker *w, conn *c, int i, int res, unsigned flags, unsigned aux);
+static void conn_starve(worker *w, conn *c, int i);
+static void conn_unstarve(worker *w, conn *c);
+static int select_method(const unsigned char *buf);
+static int userpass_login(conn *c);
+static void userpass_session(conn *c, size_t alen);
+static proxy_info *conn_pick(conn *c);
+static conn *warm_take(worker *w, proxy_info *proxy);
+static void warm_fill(worker *w, proxy_info *proxy);
+static int warm_dial(worker *w, proxy_info *proxy);
+static void warm_put(worker *w, conn *c);
+static void warm_unlink(worker *w, conn *c);
+static void conn_adopt(worker *w, conn *c, conn *from);
+static void race_launch(worker *w, conn *c);
+static proxy_info *race_pick(conn *c);
+static void race_won(worker *w, conn *a);
+static void race_cancel(worker *w, conn *c);
+static void race_unlink(conn *a);
+
+void worker_init(worker *w, int id, int listenfd, bool shared, int wakefd, int resolvefd)
+{
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->listenfd = listenfd;
+    w->resolvefd = resolvefd;
+    slab_init(&w->conn_slab, sizeof(conn));
+    slab_init(&w->hs_slab, sizeof(handshake));
+    rcu_register(&w->rcu);
+    w->epfd = -1;
+
+    if (use_uring) {
+        w->ring = emalloc(sizeof(uring));
+        if (uring_init(w->ring, RING_ENTRIES, RELAY_RING_BUFS, RELAY_RING_BUFSZ) == 0) {
+            uring_accept(w->ring, listenfd, URING_UD(NULL, OP_ACCEPT, 0));
+            uring_poll(w->ring, wakefd, EPOLLIN, URING_UD(NULL, OP_WAKE, 0));
+            uring_poll(w->ring, resolvefd, EPOLLIN, URING_UD(NULL, OP_RESOLVED, 0));
+            return;
+        }
+        if (id == 0) log_msg(LOG_WARN, "io_uring is unavailable, using epoll");
+        free(w->ring);
+        w->ring = NULL;
+    }
+
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd == -1) die("epoll_create1:");
+
+    // when every worker waits on the same listener EPOLLEXCLUSIVE wakes only one
+    struct epoll_event ev = {.events = EPOLLIN | (shared ? EPOLLEXCLUSIVE : 0), .data.ptr = w};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listenfd, &ev) != 0)
+        die("epoll_ctl:");
+
+    ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, wakefd, &ev) != 0)
+        die("epoll_ctl:");
+
+    ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = &w->resolvefd};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, resolvefd, &ev) != 0)
+        die("epoll_ctl:");
+}
+
+// gives a proxy that is about to be published its per worker state
+void worker_prepare(proxy_info *p)
+{
+    if (warm_max && p->warm == NULL) {
+        p->warm = calloc(nworkers, sizeof(warm_pool));
+        if (p->warm == NULL) die("calloc:");
+    }
+}
+
+void *worker_run(void *arg)
+{
+    worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    w->now = now_ms();
+    rcu_online(&w->rcu);
+
+    while (run) {
+        worker_sync(w);
+
+        int wait = -1;
+        for (int i = 0; i < NTIMERS; i++) {
+            if (w->timers[i].head == NULL) continue;
+            long long left = w->timers[i].head->deadline - w->now;
+            if (left < 0) left = 0;
+            if (wait == -1 || left < wait) wait = left;
+        }
+
+        // nothing from the proxy set is held across the wait, reloads
+        // don't have to wait for an idle worker. a ring submits everything
+        // queued since the last wait in the same call
+        rcu_offline(&w->rcu);
+        int n = w->ring ? uring_wait(w->ring, wait) : epoll_wait(w->epfd, events, MAX_EVENTS, wait);
+        rcu_online(&w->rcu);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            tdie(w->ring ? "io_uring_enter:" : "epoll_wait:");
+        }
+
+        // one clock read per batch, every deadline armed below is relative to it
+        w->now = now_ms();
+
+        // a ring reports through its completion queue, n is 0 then
+        if (w->ring)
+            worker_reap(w);
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) continue;
+            if (ptr == w)
+                worker_accept(w);
+            else if (ptr == &w->resolvefd)
+                worker_resolved(w);
+            else
+                conn_event(w, ptr, events[i].events);
+        }
+
+        worker_expire(w);
+        if (w->ring)
+            worker_unstarve(w);
+        worker_sweep(w);
+    }
+
+    rcu_offline(&w->rcu);
+
+    while (w->conns)
+        conn_close(w, w->conns);
+
+    // the kernel may still write to closed conns until their ops complete
+    for (int i = 0; w->ring && i < RING_DRAIN_ROUNDS; i++) {
+        if (uring_wait(w->ring, RING_DRAIN_MS) == -1) break;
+        worker_reap(w);
+        worker_sweep(w);
+        if (w->dead == NULL) break;
+    }
+
+    w->dead = NULL;
+    slab_destroy(&w->conn_slab);
+    slab_destroy(&w->hs_slab);
+    relay_cleanup();
+    udp_cleanup();
+    if (w->ring) {
+        uring_free(w->ring);
+        free(w->ring);
+    } else {
+        close(w->epfd);
+    }
+
+    return NULL;
+}
+
+static void worker_accept(worker *w)
+{
+    struct sockaddr_storage cli;
+
+    for (int i = 0; i < MAX_ACCEPTS; i++) {
+        socklen_t addrlen = sizeof(cli);
+        int fd = accept4(w->listenfd, (struct sockaddr*)&cli, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_msg(LOG_ERROR, "accept: %s", strerror(errno));
+            return;
+        }
+
+        conn_new(w, fd, &cli);
+    }
+}
+
+// a multishot accept completed, the listener was already drained by the
+// kernel, which also hands over nonblocking sockets
+static void worker_accepted(worker *w, int res, unsigned flags)
+{
+    struct sockaddr_storage cli;
+    socklen_t addrlen = sizeof(cli);
+
+    if (!(flags & IORING_CQE_F_MORE) && run)
+        uring_accept(w->ring, w->listenfd, URING_UD(NULL, OP_ACCEPT, 0));
+
+    if (res < 0) {
+        if (res != -EINTR && res != -ECONNABORTED && res != -ECANCELED)
+            log_msg(LOG_ERROR, "accept: %s", strerror(-res));
+        return;
+    }
+
+    if (!run || getpeername(res, (struct sockaddr*)&cli, &addrlen) != 0) {
+        close(res);
+        return;
+    }
+
+    conn_new(w, res, &cli);
+}
+
+// handles every completion the ring has ready
+static void worker_reap(worker *w)
+{
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = uring_peek(w->ring))) {
+        uint64_t ud = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_seen(w->ring);
+
+        if (ud != URING_UD_IGNORE)
+            worker_complete(w, ud, res, flags);
+    }
+}
+
+// completions of conns closed since still arrive, to settle their ops
+static void worker_complete(worker *w, uint64_t ud, int res, unsigned flags)
+{
+    conn *c = URING_UD_PTR(ud);
+    unsigned op = URING_UD_OP(ud);
+
+    if (op == OP_ACCEPT) {
+        worker_accepted(w, res, flags);
+        return;
+    }
+    // woken for shutdown, run is already 0
+    if (op == OP_WAKE) return;
+    if (op == OP_RESOLVED) {
+        if (run) uring_poll(w->ring, w->resolvefd, EPOLLIN, URING_UD(NULL, OP_RESOLVED, 0));
+        worker_resolved(w);
+        return;
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+        c->inflight--;
+
+    switch (op) {
+    case OP_POLL_CLI:
+    case OP_POLL_UP:
+        // polls are only used for the handshake, and ones on an up socket
+        // that was closed since are stale
+        if (c->state == CONN_CLOSED || c->state == CONN_RELAY || res == -ECANCELED) return;
+        if (op == OP_POLL_UP && URING_UD_AUX(ud) != c->upgen) return;
+        if (op == OP_POLL_CLI) c->cli.armed = false;
+        else c->up.armed = false;
+        conn_event(w, op == OP_POLL_CLI ? &c->cli : &c->up, res < 0 ? EPOLLERR : (uint32_t)res);
+        return;
+    case OP_CONNECT:
+        if (c->state == CONN_CLOSED || URING_UD_AUX(ud) != c->upgen) return;
+        conn_connected(w, c, -res);
+        return;
+    case OP_DIR0:
+    case OP_DIR1:
+        conn_relay_complete(w, c, op - OP_DIR0, res, flags, URING_UD_AUX(ud));
+        return;
+    case OP_DGRAM:
+        if (c->state != CONN_DATAGRAM || res == -ECANCELED) return;
+        c->dgram[URING_UD_AUX(ud)].armed = false;
+        conn_event(w, &c->dgram[URING_UD_AUX(ud)], res < 0 ? EPOLLERR : (uint32_t)res);
+        return;
+    }
+}
+
+// directions that ran out of ring buffers try again once some came back
+static void worker_unstarve(worker *w)
+{
+    while (w->starved && w->ring->nfree) {
+        conn *c = w->starved;
+        unsigned starving = c->starving;
+        conn_unstarve(w, c);
+        for (int i = 0; i < 2; i++)
+            if (starving & 1 << i) conn_relay_post(c, i);
+    }
+}
+
+// closed connections may still be referenced by the current batch or by
+// ring ops in flight
+static void worker_sweep(worker *w)
+{
+    conn **p = &w->dead;
+
+    while (*p) {
+        conn *c = *p;
+        if (c->inflight) {
+            p = &c->next;
+            continue;
+        }
+        *p = c->next;
+        conn_handshaken(w, c);
+        slab_free(&w->conn_slab, c);
+    }
+}
+
+// destinations some conns wait for got resolved, they look again
+static void worker_resolved(worker *w)
+{
+    uint64_t n;
+    read(w->resolvefd, &n, sizeof(n));
+
+    for (conn *c = w->resolving, *next; c; c = next) {
+        next = c->pnext;
+        conn_forward(w, c);
+    }
+}
+
+// tops up the warm pools of proxies a reload just added
+static void worker_sync(worker *w)
+{
+    proxy_set *s = atomic_load_explicit(&proxies, memory_order_acquire);
+    if (s->gen == w->gen) return;
+    w->gen = s->gen;
+
+    for (size_t i = 0; warm_max && i < s->len; i++) {
+        warm_pool *pool = &s->proxies[i]->warm[w->id];
+        if (pool->target < (unsigned)warm_min) pool->target = warm_min;
+        warm_fill(w, s->proxies[i]);
+    }
+}
+
+static void worker_expire(worker *w)
+{
+    for (int i = 0; i < NTIMERS; i++) {
+        timer_list *t = &w->timers[i];
+        while (t->head && t->head->deadline <= w->now) {
+            conn *c = t->head;
+            conn_untimer(w, c);
+            conn_expire(w, c);
+        }
+    }
+}
+
+static conn *conn_alloc(worker *w)
+{
+    conn *c = slab_alloc(&w->conn_slab);
+    handshake *hs = slab_alloc(&w->hs_slab);
+    if (c == NULL || hs == NULL) {
+        log_msg(LOG_ERROR, "malloc: %s", strerror(ENOMEM));
+        if (c) slab_free(&w->conn_slab, c);
+        if (hs) slab_free(&w->hs_slab, hs);
+        return NULL;
+    }
+
+    c->hs = hs;
+    c->cli.conn = c->up.conn = c;
+    c->cli.fd = c->up.fd = -1;
+
+    c->next = w->conns;
+    if (w->conns) w->conns->prev = c;
+    w->conns = c;
+
+    return c;
+}
+
+static void conn_new(worker *w, int fd, const struct sockaddr_storage *cli)
+{
+    conn *c = conn_alloc(w);
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+
+    c->state = CONN_GREETING;
+
+    switch (cli->ss_family) {
+    case AF_INET:
+        inet_ntop(cli->ss_family, &((struct sockaddr_in *)cli)->sin_addr, c->clihost, sizeof(c->clihost));
+        break;
+    case AF_INET6:
+        inet_ntop(cli->ss_family, &((struct sockaddr_in6 *)cli)->sin6_addr, c->clihost, sizeof(c->clihost));
+        break;
+    }
+
+    if (affinity)
+        c->key = affinity_key(c->clihost, strlen(c->clihost));
+
+    tcp_accepted(fd);
+    if (conn_attach(w, &c->cli, fd, EPOLLIN) != 0) {
+        close(fd);
+        c->cli.fd = -1;
+        conn_close(w, c);
+        return;
+    }
+
+    conn_timer(w, c, TIMER_CLIENT, client_timeout);
+}
+
+static void conn_close(worker *w, conn *c)
+{
+    if (c->state == CONN_CLOSED) return;
+
+    conn_untimer(w, c);
+    conn_release(c);
+    if (c->state == CONN_RESOLVE) conn_unresolve(w, c);
+    if (c->warm) warm_unlink(w, c);
+    if (c->owner) race_unlink(c);
+    race_cancel(w, c);
+
+    if (c->starving) conn_unstarve(w, c);
+    conn_hangup(w, &c->cli);
+    conn_hangup(w, &c->up);
+    if (c->state == CONN_BOUND || c->state == CONN_DATAGRAM) {
+        conn_hangup(w, &c->dgram[0]);
+        conn_hangup(w, &c->dgram[1]);
+    }
+    if (c->state == CONN_RELAY || c->state == CONN_DATAGRAM) {
+        proxy_stats *s = conn_stats(w, c);
+        if (s) metrics_add(&s->active, -1);
+    }
+    if (c->state == CONN_RELAY) {
+        relay_free(&c->dir[0]);
+        relay_free(&c->dir[1]);
+    }
+
+    if (c->proxy) proxy_unref(c->proxy);
+    c->proxy = NULL;
+    // a ring connect may not have been submitted yet, its address stays
+    // until worker_sweep()
+    if (c->inflight == 0) conn_handshaken(w, c);
+
+    if (c->prev) c->prev->next = c->next;
+    else w->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+
+    c->state = CONN_CLOSED;
+    c->prev = NULL;
+    c->next = w->dead;
+    w->dead = c;
+}
+
+static int conn_attach(worker *w, endpoint *e, int fd, uint32_t events)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = e};
+    e->fd = fd;
+    e->events = events;
+
+    if (w->ring) {
+        e->armed = false;
+        conn_watch(w, e, events);
+        return 0;
+    }
+
+    return epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// a ring poll is one shot, it gets armed again after every event
+static void conn_watch(worker *w, endpoint *e, uint32_t events)
+{
+    if (w->ring) {
+        if (!e->armed) {
+            uring_poll(w->ring, e->fd, events, conn_poll_ud(e));
+            e->conn->inflight++;
+            e->armed = true;
+        } else if (e->events != events) {
+            uring_poll_update(w->ring, conn_poll_ud(e), events);
+        }
+        e->events = events;
+        return;
+    }
+
+    if (e->parked) {
+        e->parked = false;
+        if (conn_attach(w, e, e->fd, events) != 0)
+            tdie("epoll_ctl:");
+        return;
+    }
+    if (e->events == events) return;
+
+    struct epoll_event ev = {.events = events, .data.ptr = e};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, e->fd, &ev) != 0)
+        tdie("epoll_ctl:");
+    e->events = events;
+}
+
+// a socket shut both ways keeps reporting EPOLLHUP whatever it is watched
+// for, so it leaves the epoll set while it has nothing to wait for
+static void conn_park(worker *w, endpoint *e)
+{
+    if (e->parked) return;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, e->fd, NULL) != 0)
+        tdie("epoll_ctl:");
+    e->parked = true;
+}
+
+// takes a pending ring poll off e
+static void conn_unwatch(worker *w, endpoint *e)
+{
+    if (!e->armed) return;
+    uring_poll_remove(w->ring, conn_poll_ud(e));
+    e->armed = false;
+}
+
+static uint64_t conn_poll_ud(endpoint *e)
+{
+    conn *c = e->conn;
+    if (e == &c->cli) return URING_UD(c, OP_POLL_CLI, 0);
+    if (e == &c->up) return URING_UD(c, OP_POLL_UP, c->upgen);
+    return URING_UD(c, OP_DGRAM, e - c->dgram);
+}
+
+// closes e's socket. on a ring whatever is pending on it gets cancelled
+// first, and up's ops completing after that are told apart by upgen
+static void conn_hangup(worker *w, endpoint *e)
+{
+    if (e->fd == -1) return;
+
+    if (w->ring) {
+        uring_close(w->ring, e->fd);
+        e->armed = false;
+        if (e == &e->conn->up) e->conn->upgen++;
+    } else {
+        close(e->fd);
+    }
+
+    e->fd = -1;
+}
+
+// each list only holds deadlines of now + one fixed timeout, so appending
+// keeps it sorted
+static void conn_timer(worker *w, conn *c, int list, long long ms)
+{
+    if (c->deadline == w->now + ms && c->timer == list) return;
+    conn_untimer(w, c);
+
+    timer_list *t = &w->timers[list];
+    c->timer = list;
+    c->deadline = w->now + ms;
+    c->tprev = t->tail;
+    if (t->tail) t->tail->tnext = c;
+    else t->head = c;
+    t->tail = c;
+}
+
+static void conn_untimer(worker *w, conn *c)
+{
+    if (c->deadline == 0) return;
+
+    timer_list *t = &w->timers[c->timer];
+    if (c->tprev) c->tprev->tnext = c->tnext;
+    else t->head = c->tnext;
+    if (c->tnext) c->tnext->tprev = c->tprev;
+    else t->tail = c->tprev;
+    c->tprev = c->tnext = NULL;
+    c->deadline = 0;
+}
+
+static void conn_expire(worker *w, conn *c)
+{
+    switch (c->state) {
+    case CONN_CONNECT:
+    case CONN_NEGOTIATE:
+        conn_upstream_failed(w, c);
+        return;
+    case CONN_RELAY:
+    case CONN_DATAGRAM:
+        log_msg(LOG_INFO, "connection from %s idle, closing", c->clihost);
+        conn_close(w, c);
+        return;
+    case CONN_IDLE:
+        {
+            // unused for a whole idle period, shrink back towards warm_min
+            proxy_info *proxy = c->proxy;
+            warm_pool *pool = &proxy->warm[w->id];
+            if (pool->target > (unsigned)warm_min) pool->target--;
+            proxy_ref(proxy);
+            conn_close(w, c);
+            warm_fill(w, proxy);
+            proxy_unref(proxy);
+        }
+        return;
+    case CONN_RACING:
+        // stagger delay is over, start the next attempt
+        race_launch(w, c);
+        return;
+    case CONN_RESOLVE:
+        log_msg(LOG_WARN, "could not resolve %.*s in time", c->hs->buf[4], &c->hs->buf[5]);
+        conn_refuse(w, c, SOCKS5_REP_UNREACHABLE);
+        return;
+    case CONN_FORWARD:
+        log_msg(LOG_WARN, "could not forward request from %s", c->clihost);
+        conn_close(w, c);
+        return;
+    case CONN_ASSOCIATE:
+        {
+            proxy_info *hop = exit_hop(c->proxy);
+            log_msg(LOG_WARN, "no UDP ASSOCIATE reply from proxy %s %s:%s", proxy_proto_name(hop->proto), hop->host, hop->port);
+            conn_refuse(w, c, SOCKS5_REP_FAILURE);
+        }
+        return;
+    default:
+        log_msg(LOG_WARN, "auth negotiation failed");
+        conn_close(w, c);
+        return;
+    }
+}
+
+static void conn_event(worker *w, endpoint *e, uint32_t events)
+{
+    conn *c = e->conn;
+
+    switch (c->state) {
+    case CONN_CLOSED:
+        return;
+    case CONN_CONNECT:
+        if (e == &c->up) conn_connected(w, c, sock_error(c->up.fd));
+        else conn_close(w, c);
+        return;
+    case CONN_NEGOTIATE:
+        if (e == &c->up) conn_negotiate(w, c);
+        else conn_close(w, c);
+        return;
+    case CONN_RELAY:
+        conn_relay(w, c, e, events);
+        return;
+    case CONN_IDLE:
+        // the upstream hung up or spoke out of turn
+        conn_close(w, c);
+        return;
+    case CONN_RACING:
+    case CONN_RESOLVE:
+        // the client hung up while attempts were running, or either side
+        // did while the destination was being resolved
+        conn_close(w, c);
+        return;
+    case CONN_FORWARD:
+        if (e == &c->up) conn_forward_send(w, c);
+        else conn_close(w, c);
+        return;
+    case CONN_ASSOCIATE:
+        if (e == &c->up) conn_associate(w, c);
+        else conn_close(w, c);
+        return;
+    case CONN_BOUND:
+        if (e == &c->cli) conn_client(w, c);
+        else conn_close(w, c);
+        return;
+    case CONN_DATAGRAM:
+        conn_datagram(w, c, e);
+        return;
+    default:
+        conn_client(w, c);
+        return;
+    }
+}
+
+static void conn_client(worker *w, conn *c)
+{
+    int fd = c->cli.fd;
+    size_t need;
+    int r, login;
+
+    for (;;) {
+        switch (c->state) {
+        case CONN_GREETING:
+            // ver + nmethods + methods
+            if ((r = recv_exact(fd, c->hs->buf, 2, &c->hs->len)) != 0) goto io;
+            if (c->hs->buf[0] != 5) goto fail;
+            if ((r = recv_exact(fd, c->hs->buf, 2 + c->hs->buf[1], &c->hs->len)) != 0) goto io;
+
+            c->hs->buf[1] = select_method(c->hs->buf);
+            c->state = c->hs->buf[1] == SOCKS5_INVALID_AUTH ? CONN_REJECT : CONN_METHOD;
+            c->hs->off = 0;
+            break;
+
+        case CONN_METHOD:
+            if ((r = send_exact(fd, c->hs->buf, 2, &c->hs->off)) != 0) goto io;
+            c->state = c->hs->buf[1] == SOCKS5_NO_AUTH ? CONN_REQUEST : CONN_USERPASS;
+            c->hs->len = 0;
+            break;
+
+        case CONN_USERPASS:
+            // ver + ulen + uname + plen + passwd
+            if ((r = recv_exact(fd, c->hs->buf, 2, &c->hs->len)) != 0) goto io;
+            if (c->hs->buf[0] != 1) goto fail;
+            if ((r = recv_exact(fd, c->hs->buf, 3 + c->hs->buf[1], &c->hs->len)) != 0) goto io;
+            if ((r = recv_exact(fd, c->hs->buf, 3 + c->hs->buf[1] + c->hs->buf[2 + c->hs->buf[1]], &c->hs->len)) != 0) goto io;
+
+            if ((login = userpass_login(c)) != -1) {
+                if (affinity) userpass_session(c, login);
+                c->hs->buf[1] = 0;
+                c->state = CONN_USERPASS_REPLY;
+            } else {
+                c->hs->buf[1] = 0xff;
+                c->state = CONN_REJECT;
+            }
+            c->hs->off = 0;
+            break;
+
+        case CONN_USERPASS_REPLY:
+            if ((r = send_exact(fd, c->hs->buf, 2, &c->hs->off)) != 0) goto io;
+            c->state = CONN_REQUEST;
+            c->hs->len = 0;
+            break;
+
+        case CONN_REQUEST:
+            // ver + cmd + rsv + atyp + first address byte
+            if ((r = recv_exact(fd, c->hs->buf, 5, &c->hs->len)) != 0) goto io;
+            if (c->hs->buf[0] != 5) goto fail;
+            if (socks5_message_len(c->hs->buf, &need) != 0) {
+                log_msg(LOG_WARN, "unsupported address type from %s", c->clihost);
+                conn_refuse(w, c, SOCKS5_REP_ATYP);
+                return;
+            }
+            if ((r = recv_exact(fd, c->hs->buf, need, &c->hs->len)) != 0) goto io;
+            if (c->hs->buf[1] == SOCKS5_CMD_UDP_ASSOCIATE) {
+                c->hs->associate = true;
+                memcpy(&c->hs->udpport, &c->hs->buf[need - 2], 2);
+            } else if (c->hs->buf[1] != SOCKS5_CMD_CONNECT) {
+                log_msg(LOG_WARN, "unsupported command from %s", c->clihost);
+                conn_refuse(w, c, SOCKS5_REP_COMMAND);
+                return;
+            }
+            conn_upstream(w, c);
+            return;
+
+        case CONN_REJECT:
+            if ((r = send_exact(fd, c->hs->buf, 2, &c->hs->off)) != 0) goto io;
+            goto fail;
+
+        case CONN_REFUSE:
+            if ((r = send_exact(fd, c->hs->buf, c->hs->len, &c->hs->off)) != 0) goto io;
+            conn_close(w, c);
+            return;
+
+        case CONN_BOUND:
+            if ((r = send_exact(fd, c->hs->buf, c->hs->len, &c->hs->off)) != 0) goto io;
+            conn_datagram_start(w, c);
+            return;
+        }
+    }
+
+io:
+    if (r == -1) goto fail;
+    conn_watch(w, &c->cli, r == IO_WANT_READ ? EPOLLIN : EPOLLOUT);
+    return;
+
+fail:
+    log_msg(LOG_WARN, "auth negotiation failed");
+    conn_close(w, c);
+}
+
+static int select_method(const unsigned char *buf)
+{
+    if (server_flags & FLAG_NO_AUTH && memchr(&buf[2], SOCKS5_NO_AUTH, buf[1]))
+        return SOCKS5_NO_AUTH;
+
+    if (server_flags & FLAG_USERPASS_AUTH && memchr(&buf[2], SOCKS5_USERPASS_AUTH, buf[1]))
+        return SOCKS5_USERPASS_AUTH;
+
+    return SOCKS5_INVALID_AUTH;
+}
+
+// the length of the account c logs in to, USER of USER-SESSION with
+// --affinity, -1 when the login is refused. the users file is looked up
+// first, at most twice and with one hash of the password whatever the
+// outcome. a user bound to a pool gets c->hs->pool
+static int userpass_login(conn *c)
+{
+    const unsigned char *buf = c->hs->buf;
+    const char *name = (const char *)&buf[2], *pass = (const char *)&buf[3 + buf[1]], *dash;
+    size_t ulen = buf[1], plen = buf[2 + ulen];
+    user_table *t = atomic_load_explicit(&users, memory_order_acquire);
+
+    if (t) {
+        const user *u = user_find(t, name, ulen);
+        if (u == NULL && affinity && (dash = memchr(name, '-', ulen)))
+            u = user_find(t, name, dash - name);
+
+        if (user_check(u, pass, plen)) {
+            if (u->pool == NULL) return u->namelen;
+
+            proxy_set *pool = proxy_set_pool(atomic_load_explicit(&proxies, memory_order_acquire), u->pool);
+            if (pool == NULL) {
+                log_msg(LOG_WARN, "user %s is bound to pool %s, which has no proxies", u->name, u->pool);
+                return -1;
+            }
+            c->hs->pool = proxy_set_get(pool);
+            return u->namelen;
+        }
+    }
+
+    if (server_user == NULL)
+        return -1;
+
+    size_t slen = strlen(server_user);
+
+    if (ulen < slen || memcmp(name, server_user, slen) != 0)
+        return -1;
+
+    if (ulen != slen && !(affinity && ulen > slen + 1 && name[slen] == '-'))
+        return -1;
+
+    if (server_pass && (plen != strlen(server_pass) || !memeq_const(pass, server_pass, plen)))
+        return -1;
+
+    return slen;
+}
+
+// USER-SESSION keys c by SESSION instead of its address, so clients
+// behind the same address can keep apart and roaming ones keep their proxy.
+// alen is USER's length
+static void userpass_session(conn *c, size_t alen)
+{
+    size_t ulen = c->hs->buf[1];
+
+    if (ulen > alen + 1)
+        c->key = affinity_key((char *)&c->hs->buf[3 + alen], ulen - alen - 1);
+}
+
+// with affinity the next choice for c's key, otherwise the rotation's next.
+// both from the user's pool when it has one
+static proxy_info *conn_pick(conn *c)
+{
+    return affinity ? get_affine_proxy(c->hs->pool, c->key, c->picks++) : get_next_proxy(c->hs->pool);
+}
+
+static void conn_upstream(worker *w, conn *c)
+{
+    char proxy_str[4096];
+
+    // the client stays quiet until its request gets answered
+    conn_watch(w, &c->cli, 0);
+
+    if (retry && race > 1) {
+        c->state = CONN_RACING;
+        race_launch(w, c);
+        return;
+    }
+
+    // only give up early when every proxy failed synchronously
+    for (size_t i = 0; i < proxy_count(c->hs->pool); i++) {
+        conn_release(c);
+        proxy_info *proxy = conn_pick(c);
+        if (proxy == NULL) {
+            log_msg(LOG_WARN, "every proxy is at its connection limit");
+            break;
+        }
+        // filled up since it was picked
+        if (!proxy_acquire(proxy)) continue;
+        conn_use(c, proxy);
+        c->acquired = true;
+        if (log_enabled(LOG_INFO)) {
+            sprint_proxy(c->proxy, proxy_str, sizeof(proxy_str));
+            log_msg(LOG_INFO, "connection from %s through proxy %s", c->clihost, proxy_str);
+        }
+
+        conn *warm;
+        if (c->proxy->warm && (warm = warm_take(w, c->proxy))) {
+            conn_adopt(w, c, warm);
+            conn_forward(w, c);
+            return;
+        }
+
+        conn_prefetch(c, c->proxy);
+        int pfd = conn_dial(w, c);
+        if (pfd != -1) {
+            if (conn_connect(w, c, pfd) != 0) {
+                close(pfd);
+                c->up.fd = -1;
+                break;
+            }
+            c->state = CONN_CONNECT;
+            conn_timer(w, c, TIMER_CONNECT, connect_timeout);
+            return;
+        }
+
+        log_msg(LOG_WARN, "could not connect to proxy %s %s:%s", proxy_proto_name(c->proxy->proto), c->proxy->host, c->proxy->port);
+        if (!retry) break;
+    }
+
+    conn_close(w, c);
+}
+
+// answers the client's request with a failure, closing once it's sent
+static void conn_refuse(worker *w, conn *c, int rep)
+{
+    if (c->state == CONN_RESOLVE) conn_unresolve(w, c);
+    conn_hangup(w, &c->up);
+
+    c->state = CONN_REFUSE;
+    c->hs->len = socks5_reply(c->hs->buf, rep);
+    c->hs->off = 0;
+    conn_timer(w, c, TIMER_CLIENT, client_timeout);
+    conn_client(w, c);
+}
+
+// a plain socks5 exit hop is handed addresses, socks5h resolves names itself
+static bool conn_resolves(conn *c, proxy_info *proxy)
+{
+    if (c->hs->associate || c->hs->buf[3] != SOCKS5_ATYP_DOMAIN) return false;
+    return exit_hop(proxy)->proto == PROXY_SOCKS5;
+}
+
+// gets the destination resolving while the upstream is dialed
+static void conn_prefetch(conn *c, proxy_info *proxy)
+{
+    dns_addr addr;
+    if (conn_resolves(c, proxy))
+        dns_dest_lookup((char *)&c->hs->buf[5], c->hs->buf[4], &addr);
+}
+
+// the upstream is negotiated, the client's request goes out on it next.
+// waiting for the destination's address counts as one more hop
+static void conn_forward(worker *w, conn *c)
+{
+    if (c->hs->associate) {
+        // the exit hop gets datagrams from proxyrot, not from the client
+        c->hs->len = socks5_associate(c->hs->buf);
+    } else if (conn_resolves(c, c->proxy)) {
+        dns_addr addr;
+        int r = dns_dest_lookup((char *)&c->hs->buf[5], c->hs->buf[4], &addr);
+
+        if (r == DNS_PENDING) {
+            if (c->state == CONN_RESOLVE) return;
+            c->state = CONN_RESOLVE;
+            c->pprev = NULL;
+            c->pnext = w->resolving;
+            if (w->resolving) w->resolving->pprev = c;
+            w->resolving = c;
+            // only a hang up is of interest meanwhile
+            conn_watch(w, &c->up, 0);
+            conn_timer(w, c, TIMER_HOP, hop_timeout);
+            return;
+        }
+
+        if (c->state == CONN_RESOLVE) conn_unresolve(w, c);
+        if (r != 0) {
+            log_msg(LOG_WARN, "could not resolve %.*s", c->hs->buf[4], &c->hs->buf[5]);
+            conn_refuse(w, c, SOCKS5_REP_UNREACHABLE);
+            return;
+        }
+        c->hs->len = socks5_resolved(c->hs->buf, &addr.addr);
+    }
+
+    c->state = CONN_FORWARD;
+    c->hs->off = 0;
+    conn_timer(w, c, TIMER_HOP, hop_timeout);
+    conn_forward_send(w, c);
+}
+
+// the upstream's reply comes back through the relay, except for a UDP
+// ASSOCIATE's
+static void conn_forward_send(worker *w, conn *c)
+{
+    int r = send_exact(c->up.fd, c->hs->buf, c->hs->len, &c->hs->off);
+
+    if (r == -1) {
+        log_msg(LOG_WARN, "could not forward request from %s", c->clihost);
+        conn_close(w, c);
+        return;
+    }
+
+    if (r != 0) {
+        conn_watch(w, &c->up, EPOLLOUT);
+        return;
+    }
+
+    if (c->hs->associate) {
+        c->state = CONN_ASSOCIATE;
+        c->hs->len = 0;
+        conn_associate(w, c);
+        return;
+    }
+
+    conn_relay_start(w, c);
+}
+
+static void conn_unresolve(worker *w, conn *c)
+{
+    if (c->pprev) c->pprev->pnext = c->pnext;
+    else w->resolving = c->pnext;
+    if (c->pnext) c->pnext->pprev = c->pprev;
+    c->pprev = c->pnext = NULL;
+}
+
+// the exit hop's reply names the relay it takes datagrams on, the client
+// gets told about a socket of proxyrot's instead
+static void conn_associate(worker *w, conn *c)
+{
+    proxy_info *hop = exit_hop(c->proxy);
+    struct sockaddr_storage relay;
+    socklen_t len;
+    size_t need;
+
+    // ver + rep + rsv + atyp + first address byte
+    int r = recv_exact(c->up.fd, c->hs->buf, 5, &c->hs->len);
+    if (r == 0 && socks5_message_len(c->hs->buf, &need) != 0) r = -1;
+    if (r == 0) r = recv_exact(c->up.fd, c->hs->buf, need, &c->hs->len);
+
+    if (r > 0) {
+        conn_watch(w, &c->up, EPOLLIN);
+        return;
+    }
+
+    if (r == -1 || c->hs->buf[0] != 5 || c->hs->buf[1] != 0) {
+        log_msg(LOG_WARN, "UDP ASSOCIATE through proxy %s %s:%s failed", proxy_proto_name(hop->proto), hop->host, hop->port);
+        conn_refuse(w, c, r == 0 && c->hs->buf[0] == 5 ? c->hs->buf[1] : SOCKS5_REP_FAILURE);
+        return;
+    }
+
+    if (conn_udp_relay(c, &relay, &len) != 0) {
+        log_msg(LOG_WARN, "proxy %s %s:%s named no usable UDP relay", proxy_proto_name(hop->proto), hop->host, hop->port);
+        conn_refuse(w, c, SOCKS5_REP_FAILURE);
+        return;
+    }
+
+    if (udp_open(&c->udp, c->cli.fd, c->hs->udpport, (struct sockaddr *)&relay, len, hop->proto == PROXY_SOCKS5) != 0) {
+        log_msg(LOG_ERROR, "udp relay: %s", strerror(errno));
+        conn_refuse(w, c, SOCKS5_REP_FAILURE);
+        return;
+    }
+
+    c->dgram[0] = (endpoint){.conn = c, .fd = c->udp.cli};
+    c->dgram[1] = (endpoint){.conn = c, .fd = c->udp.up};
+
+    struct sockaddr_storage bound;
+    udp_bound(&c->udp, &bound);
+
+    // only a hang up is of interest on up until the client knows
+    conn_watch(w, &c->up, 0);
+    c->state = CONN_BOUND;
+    c->hs->len = socks5_bound(c->hs->buf, &bound);
+    c->hs->off = 0;
+    conn_timer(w, c, TIMER_CLIENT, client_timeout);
+    conn_client(w, c);
+}
+
+// an exit hop answering with an unspecified address means its own, known
+// for a single hop or a chain's literal exit host
+static int conn_udp_relay(conn *c, struct sockaddr_storage *addr, socklen_t *len)
+{
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    in_port_t port;
+
+    if (socks5_sockaddr(c->hs->buf, addr, len) != 0) return -1;
+    if (addr->ss_family == AF_INET ? in->sin_addr.s_addr != INADDR_ANY : !IN6_IS_ADDR_UNSPECIFIED(&in6->sin6_addr))
+        return 0;
+
+    port = addr->ss_family == AF_INET ? in->sin_port : in6->sin6_port;
+    *len = sizeof(*addr);
+
+    if (c->proxy->chain == NULL) {
+        if (getpeername(c->up.fd, (struct sockaddr *)addr, len) != 0) return -1;
+    } else if (inet_pton(AF_INET, exit_hop(c->proxy)->host, &in->sin_addr) == 1) {
+        addr->ss_family = AF_INET;
+        *len = sizeof(*in);
+    } else if (inet_pton(AF_INET6, exit_hop(c->proxy)->host, &in6->sin6_addr) == 1) {
+        addr->ss_family = AF_INET6;
+        *len = sizeof(*in6);
+    } else {
+        return -1;
+    }
+
+    if (addr->ss_family == AF_INET) in->sin_port = port;
+    else in6->sin6_port = port;
+    return 0;
+}
+
+// the association lasts as long as the client's control connection
+static void conn_datagram_start(worker *w, conn *c)
+{
+    if (idle_timeout)
+        conn_timer(w, c, TIMER_TUNNEL, idle_timeout);
+    else
+        conn_untimer(w, c);
+
+    conn_handshaken(w, c);
+    c->state = CONN_DATAGRAM;
+
+    proxy_stats *s = conn_stats(w, c);
+    if (s) metrics_add(&s->active, 1);
+
+    conn_watch(w, &c->cli, EPOLLIN | EPOLLRDHUP);
+    conn_watch(w, &c->up, EPOLLIN | EPOLLRDHUP);
+    for (int i = 0; i < 2; i++) {
+        if (conn_attach(w, &c->dgram[i], c->dgram[i].fd, EPOLLIN) != 0) {
+            log_msg(LOG_ERROR, "epoll_ctl: %s", strerror(errno));
+            conn_close(w, c);
+            return;
+        }
+    }
+}
+
+static void conn_datagram(worker *w, conn *c, endpoint *e)
+{
+    // the control connections carry nothing once associated
+    if (e == &c->cli || e == &c->up) {
+        conn_close(w, c);
+        return;
+    }
+
+    int i = e - c->dgram;
+    unsigned long long total = c->udp.total[i];
+    int r = udp_pump(&c->udp, i);
+
+    proxy_stats *s = conn_stats(w, c);
+    if (s) metrics_add(i == 0 ? &s->bytes_up : &s->bytes_down, c->udp.total[i] - total);
+
+    if (r == -1) {
+        log_msg(LOG_WARN, "udp relay failed");
+        conn_close(w, c);
+        return;
+    }
+
+    if (idle_timeout)
+        conn_timer(w, c, TIMER_TUNNEL, idle_timeout);
+    conn_watch(w, e, EPOLLIN);
+}
+
+static proxy_info *exit_hop(proxy_info *proxy)
+{
+    while (proxy->chain) proxy = proxy->chain;
+    return proxy;
+}
+
+// starts a non-blocking connect to c->proxy, a ring only gets the socket
+// and leaves the connect to conn_connect()
+static int conn_dial(worker *w, conn *c)
+{
+    proxy_stats *s = conn_stats(w, c);
+    if (s) metrics_add(&s->conns, 1);
+
+    c->hs->dialed_at = now_us();
+    int pfd = w->ring ? proxy_socket(c->proxy, &c->hs->addr, &c->hs->addrlen) : proxy_connect(c->proxy);
+    if (pfd == -1 && s) metrics_add(&s->fails[METRICS_FAIL_CONNECT], 1);
+    return pfd;
+}
+
+// makes pfd c's upstream, conn_connected() follows once it connected
+static int conn_connect(worker *w, conn *c, int pfd)
+{
+    if (w->ring == NULL)
+        return conn_attach(w, &c->up, pfd, EPOLLOUT);
+
+    c->up.fd = pfd;
+    c->up.armed = false;
+    uring_connect(w->ring, pfd, (struct sockaddr*)&c->hs->addr, c->hs->addrlen, URING_UD(c, OP_CONNECT, c->upgen));
+    c->inflight++;
+    return 0;
+}
+
+// the outcome of a non-blocking connect
+static int sock_error(int fd)
+{
+    int err;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+        return errno;
+    return err;
+}
+
+static proxy_stats *conn_stats(worker *w, conn *c)
+{
+    proxy_stats *s = metrics_stats(c->proxy);
+    return s ? &s[w->id] : NULL;
+}
+
+// c keeps proxy alive, even after a reload dropped it
+static void conn_use(conn *c, proxy_info *proxy)
+{
+    proxy_ref(proxy);
+    if (c->proxy) proxy_unref(c->proxy);
+    c->proxy = proxy;
+}
+
+static void conn_connected(worker *w, conn *c, int err)
+{
+    if (err != 0) {
+        conn_upstream_failed(w, c);
+        return;
+    }
+
+    proxy_stats *s = conn_stats(w, c);
+    c->hs->connected_at = now_us();
+    if (s) metrics_observe(s->connect, &s->connect_sum, c->hs->connected_at - c->hs->dialed_at);
+
+    // a client's own connection sends its request along with the exit hop's
+    // greeting, unless that hop needs it resolved first
+    bool early = !c->owner && !c->warm && !c->hs->associate && !conn_resolves(c, c->proxy);
+    proxy_negotiation_init(&c->hs->neg, c->proxy, pipeline, early ? c->hs->buf : NULL, c->hs->len);
+    c->state = CONN_NEGOTIATE;
+    conn_timer(w, c, TIMER_HOP, hop_timeout);
+    conn_negotiate(w, c);
+}
+
+// every hop of a chain gets its own hop_timeout
+static void conn_negotiate(worker *w, conn *c)
+{
+    proxy_info *hop = c->hs->neg.cur;
+    int r = proxy_negotiate(&c->hs->neg, c->up.fd);
+
+    if (r == -1) {
+        conn_upstream_failed(w, c);
+        return;
+    }
+
+    if (r != 0) {
+        if (c->hs->neg.cur != hop)
+            conn_timer(w, c, TIMER_HOP, hop_timeout);
+        conn_watch(w, &c->up, r == IO_WANT_READ ? EPOLLIN : EPOLLOUT);
+        return;
+    }
+
+    long long now = now_us();
+    proxy_stats *s = conn_stats(w, c);
+    if (s) metrics_observe(s->handshake, &s->handshake_sum, now - c->hs->connected_at);
+    proxy_latency(c->proxy, now - c->hs->dialed_at);
+
+    if (c->owner)
+        race_won(w, c);
+    else if (c->warm)
+        warm_put(w, c);
+    else if (c->hs->neg.req)
+        conn_relay_start(w, c);
+    else
+        conn_forward(w, c);
+}
+
+static void conn_release(conn *c)
+{
+    if (!c->acquired) return;
+    proxy_release(c->proxy);
+    c->acquired = false;
+}
+
+// hands c's handshake state back once c is done negotiating
+static void conn_handshaken(worker *w, conn *c)
+{
+    if (c->hs == NULL) return;
+    if (c->hs->pool) proxy_set_put(c->hs->pool);
+    slab_free(&w->hs_slab, c->hs);
+    c->hs = NULL;
+}
+
+static void conn_relay_start(worker *w, conn *c)
+{
+    // After succesfull connection, only the idle timeout is left
+    if (idle_timeout)
+        conn_timer(w, c, TIMER_TUNNEL, idle_timeout);
+    else
+        conn_untimer(w, c);
+
+    conn_handshaken(w, c);
+    relay_init(&c->dir[0], c->cli.fd, c->up.fd, splice_relay, w->ring);
+    relay_init(&c->dir[1], c->up.fd, c->cli.fd, splice_relay, w->ring);
+    c->state = CONN_RELAY;
+
+    proxy_stats *s = conn_stats(w, c);
+    if (s) metrics_add(&s->active, 1);
+
+    // a ring relays with recvs and sends of its own, no polls
+    if (w->ring) {
+        conn_unwatch(w, &c->cli);
+        conn_unwatch(w, &c->up);
+        conn_relay_post(c, 0);
+        conn_relay_post(c, 1);
+        return;
+    }
+
+    conn_relay_watch(w, c);
+}
+
+static void conn_upstream_failed(worker *w, conn *c)
+{
+    proxy_info *p = c->proxy;
+    int phase;
+
+    if (c->state == CONN_CONNECT) {
+        phase = METRICS_FAIL_CONNECT;
+        log_msg(LOG_WARN, "could not connect to proxy %s %s:%s", proxy_proto_name(p->proto), p->host, p->port);
+    } else if (proxy_negotiation_chaining(&c->hs->neg)) {
+        phase = METRICS_FAIL_CHAIN;
+        p = c->hs->neg.cur->chain;
+        log_msg(LOG_WARN, "could not chain with proxy %s %s:%s", proxy_proto_name(p->proto), p->host, p->port);
+    } else {
+        phase = METRICS_FAIL_AUTH;
+        p = c->hs->neg.cur;
+        log_msg(LOG_WARN, "auth negotiation with proxy %s %s:%s failed", proxy_proto_name(p->proto), p->host, p->port);
+    }
+
+    proxy_stats *s = conn_stats(w, c);
+    if (s) metrics_add(&s->fails[phase], 1);
+
+    // count a failure as a full connect timeout so latency aware selection avoids it
+    proxy_latency(c->proxy, connect_timeout * 1000LL);
+
+    conn_hangup(w, &c->up);
+
+    if (c->owner) {
+        // a lost attempt makes room for the next one right away
+        conn *owner = c->owner;
+        conn_close(w, c);
+        if (owner->nattempts < (unsigned)race)
+            race_launch(w, owner);
+        return;
+    }
+
+    if (retry && !c->warm)
+        conn_upstream(w, c);
+    else
+        conn_close(w, c);
+}
+
+static void conn_relay(worker *w, conn *c, endpoint *e, uint32_t events)
+{
+    relay_dir *in  = e == &c->cli ? &c->dir[0] : &c->dir[1];
+    relay_dir *out = e == &c->cli ? &c->dir[1] : &c->dir[0];
+    unsigned long long up = c->dir[0].total, down = c->dir[1].total;
+    int r = events & EPOLLERR ? -1 : 0;
+
+    // a hangup without an error is a FIN, reading finds the EOF
+    if (r == 0 && events & (EPOLLIN | EPOLLHUP) && relay_pump(in) == -1)
+        r = -1;
+    if (r == 0 && events & EPOLLOUT && relay_pump(out) == -1)
+        r = -1;
+
+    proxy_stats *s = conn_stats(w, c);
+    if (s) {
+        metrics_add(&s->bytes_up, c->dir[0].total - up);
+        metrics_add(&s->bytes_down, c->dir[1].total - down);
+    }
+
+    if (r == -1)
+        log_msg(LOG_WARN, "connection failed");
+
+    if (r == -1 || (relay_done(&c->dir[0]) && relay_done(&c->dir[1]))) {
+        conn_close(w, c);
+        return;
+    }
+
+    if (idle_timeout)
+        conn_timer(w, c, TIMER_TUNNEL, idle_timeout);
+    conn_relay_watch(w, c);
+}
+
+// read from a side only while its direction is drained and still open,
+// wait for POLLOUT only on a side that has data queued for it
+static void conn_relay_watch(worker *w, conn *c)
+{
+    conn_relay_side(w, &c->cli, &c->dir[0], &c->dir[1]);
+    conn_relay_side(w, &c->up, &c->dir[1], &c->dir[0]);
+}
+
+// e is read into in and written from out
+static void conn_relay_side(worker *w, endpoint *e, relay_dir *in, relay_dir *out)
+{
+    uint32_t events = (relay_pending(in) || relay_done(in) ? 0 : EPOLLIN) | (relay_pending(out) ? EPOLLOUT : 0);
+
+    if (events == 0 && relay_done(out)) conn_park(w, e);
+    else conn_watch(w, e, events);
+}
+
+static void conn_relay_post(conn *c, int i)
+{
+    c->inflight += relay_post(&c->dir[i], URING_UD(c, OP_DIR0 + i, 0));
+}
+
+// a ring op of c->dir[i] completed
+static void conn_relay_complete(worker *w, conn *c, int i, int res, unsigned flags, unsigned aux)
+{
+    relay_dir *d = &c->dir[i];
+    unsigned long long total = d->total;
+    int r = relay_complete(d, res, flags, aux);
+
+    // settled, the rest went with the conn
+    if (c->state != CONN_RELAY) return;
+
+    proxy_stats *s = conn_stats(w, c);
+    if (s) metrics_add(i == 0 ? &s->bytes_up : &s->bytes_down, d->total - total);
+
+    if (r == -1)
+        log_msg(LOG_WARN, "connection failed");
+
+    if (r == -1 || (relay_done(&c->dir[0]) && relay_done(&c->dir[1]))) {
+        conn_close(w, c);
+        return;
+    }
+
+    if (idle_timeout)
+        conn_timer(w, c, TIMER_TUNNEL, idle_timeout);
+
+    if (r == RELAY_NOBUF) conn_starve(w, c, i);
+    else conn_relay_post(c, i);
+}
+
+// c->dir[i] waits for a ring buffer, see worker_unstarve()
+static void conn_starve(worker *w, conn *c, int i)
+{
+    if (c->starving == 0) {
+        c->pprev = NULL;
+        c->pnext = w->starved;
+        if (w->starved) w->starved->pprev = c;
+        w->starved = c;
+    }
+    c->starving |= 1 << i;
+}
+
+static void conn_unstarve(worker *w, conn *c)
+{
+    if (c->pprev) c->pprev->pnext = c->pnext;
+    else w->starved = c->pnext;
+    if (c->pnext) c->pnext->pprev = c->pprev;
+    c->pprev = c->pnext = NULL;
+    c->starving = 0;
+}
+
+// hands out an idle upstream for proxy, if any, and tops the pool back up.
+// a miss lets the pool grow towards warm_max
+static conn *warm_take(worker *w, proxy_info *proxy)
+{
+    warm_pool *pool = &proxy->warm[w->id];
+    conn *c = pool->idle;
+
+    if (c)
+        warm_unlink(w, c);
+    else if (pool->target < (unsigned)warm_max)
+        pool->target++;
+
+    warm_fill(w, proxy);
+    return c;
+}
+
+// retired proxies are left to drain
+static void warm_fill(worker *w, proxy_info *proxy)
+{
+    warm_pool *pool = &proxy->warm[w->id];
+    if (atomic_load_explicit(&proxy->retired, memory_order_relaxed)) return;
+
+    while (pool->nidle + pool->npending < pool->target)
+        if (warm_dial(w, proxy) != 0) break;
+}
+
+static int warm_dial(worker *w, proxy_info *proxy)
+{
+    conn *c = conn_alloc(w);
+    if (c == NULL) return -1;
+
+    conn_use(c, proxy);
+    c->state = CONN_CONNECT;
+
+    int pfd = conn_dial(w, c);
+    if (pfd == -1 || conn_connect(w, c, pfd) != 0) {
+        if (pfd != -1) close(pfd);
+        c->up.fd = -1;
+        conn_close(w, c);
+        return -1;
+    }
+
+    c->warm = true;
+    proxy->warm[w->id].npending++;
+    conn_timer(w, c, TIMER_CONNECT, connect_timeout);
+    return 0;
+}
+
+static void warm_put(worker *w, conn *c)
+{
+    warm_pool *pool = &c->proxy->warm[w->id];
+
+    pool->npending--;
+    pool->nidle++;
+    c->state = CONN_IDLE;
+    conn_handshaken(w, c);
+    c->pprev = NULL;
+    c->pnext = pool->idle;
+    if (pool->idle) pool->idle->pprev = c;
+    pool->idle = c;
+
+    conn_watch(w, &c->up, EPOLLIN | EPOLLRDHUP);
+    conn_timer(w, c, TIMER_IDLE, warm_idle * 1000LL);
+}
+
+// stops counting c towards its pool
+static void warm_unlink(worker *w, conn *c)
+{
+    warm_pool *pool = &c->proxy->warm[w->id];
+
+    if (c->state == CONN_IDLE) {
+        if (c->pprev) c->pprev->pnext = c->pnext;
+        else pool->idle = c->pnext;
+        if (c->pnext) c->pnext->pprev = c->pprev;
+        c->pprev = c->pnext = NULL;
+        pool->nidle--;
+    } else {
+        pool->npending--;
+    }
+
+    c->warm = false;
+}
+
+// moves the negotiated upstream of from, a warm connection or a race
+// attempt, over to client connection c
+static void conn_adopt(worker *w, conn *c, conn *from)
+{
+    // warm connections aren't counted, c keeps its own count for them
+    if (from->acquired) {
+        conn_release(c);
+        c->acquired = true;
+        from->acquired = false;
+    }
+    conn_use(c, from->proxy);
+
+    c->up.fd = from->up.fd;
+    c->up.events = from->up.events;
+    from->up.fd = -1;
+    if (w->ring) conn_unwatch(w, &from->up);
+    conn_close(w, from);
+
+    // conn_forward() follows and polls on a ring only if it has to
+    if (w->ring) {
+        c->up.armed = false;
+        return;
+    }
+
+    struct epoll_event ev = {.events = c->up.events, .data.ptr = &c->up};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->up.fd, &ev) != 0)
+        tdie("epoll_ctl:");
+}
+
+// starts one more upstream attempt for client c and schedules the next one
+// after race_delay. gives up on c once nothing is left in flight
+static void race_launch(worker *w, conn *c)
+{
+    char proxy_str[4096];
+
+    for (size_t i = 0; i < proxy_count(c->hs->pool); i++) {
+        proxy_info *proxy = race_pick(c);
+        if (proxy == NULL) {
+            log_msg(LOG_WARN, "every proxy is at its connection limit");
+            break;
+        }
+        if (!proxy_acquire(proxy)) continue;
+        if (log_enabled(LOG_INFO)) {
+            sprint_proxy(proxy, proxy_str, sizeof(proxy_str));
+            log_msg(LOG_INFO, "connection from %s through proxy %s", c->clihost, proxy_str);
+        }
+
+        conn *a;
+        if (proxy->warm && (a = warm_take(w, proxy))) {
+            // the attempts still in flight lost, c is taken care of
+            race_cancel(w, c);
+            conn_use(c, proxy);
+            c->acquired = true;
+            conn_adopt(w, c, a);
+            conn_forward(w, c);
+            return;
+        }
+
+        conn_prefetch(c, proxy);
+        a = conn_alloc(w);
+        if (a == NULL) {
+            proxy_release(proxy);
+            break;
+        }
+
+        a->owner = c;
+        conn_use(a, proxy);
+        a->state = CONN_CONNECT;
+        a->acquired = true;
+
+        a->pprev = NULL;
+        a->pnext = c->attempts;
+        if (c->attempts) c->attempts->pprev = a;
+        c->attempts = a;
+        c->nattempts++;
+
+        int pfd = conn_dial(w, a);
+        if (pfd != -1 && conn_connect(w, a, pfd) == 0) {
+            conn_timer(w, a, TIMER_CONNECT, connect_timeout);
+            if (c->nattempts < (unsigned)race)
+                conn_timer(w, c, TIMER_RACE, race_delay);
+            else
+                conn_untimer(w, c);
+            return;
+        }
+
+        if (pfd != -1) close(pfd);
+        a->up.fd = -1;
+        log_msg(LOG_WARN, "could not connect to proxy %s %s:%s", proxy_proto_name(proxy->proto), proxy->host, proxy->port);
+        conn_close(w, a);
+    }
+
+    if (c->nattempts == 0)
+        conn_close(w, c);
+}
+
+// prefers a proxy none of c's running attempts already use
+static proxy_info *race_pick(conn *c)
+{
+    proxy_info *proxy = conn_pick(c);
+
+    for (unsigned tries = 0; tries < c->nattempts; tries++) {
+        conn *a = c->attempts;
+        while (a && a->proxy != proxy) a = a->pnext;
+        if (a == NULL) break;
+        proxy = conn_pick(c);
+    }
+
+    return proxy;
+}
+
+// the first attempt to finish negotiating wins, the others get cancelled
+static void race_won(worker *w, conn *a)
+{
+    conn *c = a->owner;
+
+    race_unlink(a);
+    race_cancel(w, c);
+    conn_adopt(w, c, a);
+    conn_forward(w, c);
+}
+
+// closes every attempt still racing for c, none of them may call back
+static void race_cancel(worker *w, conn *c)
+{
+    while (c->attempts) {
+        conn *a = c->attempts;
+        race_unlink(a);
+        conn_close(w, a);
+    }
+}
+
+static void race_unlink(conn *a)
+{
+    conn *c = a->owner;
+
+    if (a->pprev) a->pprev->pnext = a->pnext;
+    else c->attempts = a->pnext;
+    if (a->pnext) a->pnext->pprev = a->pprev;
+    a->pprev = a->pnext = NULL;
+    a->owner = NULL;
+    c->nattempts--;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "proxy.h"
+#include "rcu.h"
+#include "slab.h"
+#include "uring.h"
+#include <stdbool.h>
+
+#define TIMER_CLIENT    0
+#define TIMER_CONNECT   1
+#define TIMER_HOP       2
+#define TIMER_IDLE      3
+#define TIMER_RACE      4
+#define TIMER_TUNNEL    5
+#define NTIMERS         6
+
+typedef struct conn conn;
+typedef struct warm_pool warm_pool;
+
+typedef struct timer_list {
+    conn *head, *tail;
+} timer_list;
+
+typedef struct worker {
+    int id;
+    int epfd;                  // -1 when running on a ring
+    uring *ring;               // NULL when running on epoll
+    int listenfd;
+    long long now;
+    conn *conns;
+    timer_list timers[NTIMERS];
+    conn *dead;
+    conn *starved;             // relaying on a ring and waiting for a buffer
+    conn *resolving;           // waiting for their destination's address
+    int resolvefd;             // written once addresses somebody waited for are in
+    unsigned long gen;         // proxy set generation last seen
+    slab conn_slab;
+    slab hs_slab;
+    rcu_reader rcu;
+} worker;
+
+void worker_init(worker *w, int id, int listenfd, bool shared, int wakefd, int resolvefd);
+void *worker_run(void *arg);
+void worker_prepare(proxy_info *p);